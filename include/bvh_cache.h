@@ -0,0 +1,64 @@
+#pragma once
+
+#include "scene_object.h"
+
+#include <cstdint>
+#include <string>
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& fileName);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isOpen() const { return data != nullptr; }
+    const uint8_t* getData() const { return data; }
+    size_t getSize() const { return size; }
+
+private:
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    void* file = nullptr;
+    void* mapping = nullptr;
+#endif
+};
+
+// Persistent cache of built object BVHs, one file per object, named after a hash
+// of the object geometry and the build settings. Loading a cached BVH maps the file
+// and copies the nodes out of it, which is much faster than building them.
+class BVHCache {
+public:
+    // Environment variable with the cache directory, used when the scene doesn't set one
+    static constexpr const char* DIRECTORY_ENV_VAR = "CHAOS_BVH_CACHE_DIR";
+
+    /// <summary>
+    /// Cache directory for objects built with the given settings
+    /// </summary>
+    /// <returns> Empty string if caching is disabled </returns>
+    static std::string getDirectory(const BVHBuildSettings& settings);
+
+    /// <summary>
+    /// FNV-1a hash of the vertices and the triangles of the object, before the BVH build
+    /// reorders them, and of the settings that affect the built tree
+    /// </summary>
+    static uint64_t computeKey(const Object& object);
+
+    /// <summary>
+    /// Replace the triangle order and the acceleration structure of the object with the cached ones
+    /// </summary>
+    /// <returns> Whether a valid cache file for the key was found </returns>
+    static bool load(Object& object, const std::string& directory, uint64_t key);
+
+    static void save(const Object& object, const std::string& directory, uint64_t key);
+
+private:
+    /// <summary>
+    /// Whether every index in the loaded triangles, nodes and leaf packs of the object is in bounds, and the trees
+    /// fit the traversal stacks. The structures are traversed without checks, so a corrupt file must not get that far
+    /// </summary>
+    static bool isValid(const Object& object);
+};
@@ -10,11 +10,87 @@
   #define ChaosRendererAPI
 #endif
 
+// Values of the bvhBuilder parameter. Interactive renders should prefer the LBVH builder,
+// which is much faster to build, final renders the SAH builder, which is faster to trace.
+#define BVH_BUILDER_FROM_SCENE -1
+#define BVH_BUILDER_MEDIAN 0
+#define BVH_BUILDER_SAH 1
+#define BVH_BUILDER_LBVH 2
+
+// Values of the integrator parameter. The wavefront integrator traces the rays of a bucket in sorted
+// streams, one bounce at a time, instead of following every path to its end.
+#define INTEGRATOR_FROM_SCENE -1
+#define INTEGRATOR_RECURSIVE 0
+#define INTEGRATOR_WAVEFRONT 1
+
+// Values of the bucketOrder parameter, see BucketOrder in scene.h
+#define BUCKET_ORDER_FROM_SCENE -1
+#define BUCKET_ORDER_RASTER 0
+#define BUCKET_ORDER_SPIRAL 1
+#define BUCKET_ORDER_HILBERT 2
+#define BUCKET_ORDER_COST 3
+
+// A scene loaded once, with its BVHs built, and rendered many times with a different camera, settings or materials.
+// The render calls that take a file name load and build the scene again on every call. A session is used by one thread at a time
+typedef struct RenderSession RenderSession;
+
+// Called after each pass of a progressive render, with the image so far and what the pass added to it
+// (see ProgressivePass in renderer_lib.h). Return 0 to stop the render there
+typedef int (*ProgressivePassCallback)(const float* pixels, int pass, int passCount, int giRays, double passMs, double rmsChange, void* userData);
+
 extern "C" {
 ChaosRendererAPI void render(void* pixels, float t);
 ChaosRendererAPI void renderCamera(void* pixels, float x, float y, float z, float fov, float pan, float tilt, float roll);
+ChaosRendererAPI void renderCamera2(void* pixels, float x, float y, float z, float fov, float pan, float tilt, float roll, int bvhBuilder);
 ChaosRendererAPI void renderFile(void* pixels, const char* fileName);
 ChaosRendererAPI void renderFile2(void* pixels, const char* fileName, int width, int height);
+ChaosRendererAPI void renderFile3(void* pixels, const char* fileName, int width, int height, int bvhBuilder);
+ChaosRendererAPI void renderFile4(void* pixels, const char* fileName, int width, int height, int bvhBuilder, int integrator);
+// renderThreads of 0 keeps the thread count of the scene, which is one per hardware thread unless the scene sets it
+ChaosRendererAPI void renderFile5(void* pixels, const char* fileName, int width, int height, int bvhBuilder, int integrator, int renderThreads);
+// Null if the scene has no objects, e.g. the file could not be read
+ChaosRendererAPI RenderSession* createRenderSession(const char* fileName, int bvhBuilder);
+ChaosRendererAPI void destroyRenderSession(RenderSession* session);
+// Same camera as renderCamera
+ChaosRendererAPI void setSessionCamera(RenderSession* session, float x, float y, float z, float fov, float pan, float tilt, float roll);
+// Zero width, height and renderThreads, and INTEGRATOR_FROM_SCENE, keep the current value
+ChaosRendererAPI void setSessionSettings(RenderSession* session, int width, int height, int integrator, int renderThreads);
+// Materials are indexed in the order of the scene file. Return 0 if there is no such material, or it has no albedo or IOR
+ChaosRendererAPI int setSessionMaterialAlbedo(RenderSession* session, int material, float r, float g, float b);
+ChaosRendererAPI int setSessionMaterialIOR(RenderSession* session, int material, float ior);
+// Only traces, the pixels must fit the width and height of the session
+ChaosRendererAPI void renderSession(RenderSession* session, void* pixels);
+ChaosRendererAPI void getSessionSize(RenderSession* session, int* width, int* height);
+// Render in passes of passGIRays GI rays per diffuse hit, calling callback after each. Returns the number of passes rendered
+ChaosRendererAPI int renderSessionProgressive(RenderSession* session, void* pixels, int passGIRays, ProgressivePassCallback callback, void* userData);
+// Also sets sampleCounts, if not null, to the number of passes that rendered each pixel
+ChaosRendererAPI int renderSessionProgressive2(RenderSession* session, void* pixels, int* sampleCounts, int passGIRays, ProgressivePassCallback callback, void* userData);
+// Progressive renders stop rendering a pixel once the estimated noise of its luminance is below the threshold, 0 to render every pass
+ChaosRendererAPI void setSessionNoiseThreshold(RenderSession* session, float noiseThreshold);
+// Zero bucketSize, BUCKET_ORDER_FROM_SCENE and a negative adaptiveBuckets keep the current value. The bucket costs
+// are taken from the previous render of the session
+ChaosRendererAPI void setSessionBuckets(RenderSession* session, int bucketSize, int bucketOrder, int adaptiveBuckets);
 ChaosRendererAPI void render2(void* pixels, const float* vertices, const int* triangleIndices, int trianglesCount);
 ChaosRendererAPI void getSizeFromFile(const char* fileName, int* width, int* height);
+ChaosRendererAPI void printSceneStats(const char* fileName);
+// Time tracing the camera rays of the scene one at a time and in packets, and print the results
+ChaosRendererAPI void benchmarkRayPackets(const char* fileName, int repeats);
+// Compare the memory and the traversal time of the float and the compressed wide BVH of the scene, and print the results
+ChaosRendererAPI void benchmarkCompressedBVH(const char* fileName, int repeats);
+// Name of the instruction set of the ray-triangle and ray-box kernels picked for this CPU, e.g. "AVX2+FMA"
+ChaosRendererAPI const char* getSIMDKernelsName();
+// Cast the fixed rays of castHitSet (see renderer_lib.h) at the scene with the kernels of this process, to compare
+// them between kernel sets. Every array takes rayCount values, object -1 for a miss, except triangles, which takes
+// the three vertex indices of the hit triangle of every ray. Returns 0 if the scene has no objects
+ChaosRendererAPI int castSceneHitSet(const char* fileName, int rayCount, int* objects, int* instances, int* triangles, float* t, float* u, float* v, int* occluded);
+// Timings of the last render call, of the one that finished last if several run at once. Shadow ray time is summed
+// over the render threads. Null pointers are skipped
+ChaosRendererAPI void getLastRenderStats(double* renderMs, unsigned long long* primaryRays, unsigned long long* shadowRays, double* shadowMs);
+// Camera, secondary and shadow rays traced per second of the last render call
+ChaosRendererAPI double getLastRenderRaysPerSecond();
+// Number of threads of the last render call
+ChaosRendererAPI int getLastRenderThreadCount();
+// Work of a thread of the last render call: its time in buckets, against the render time, and the buckets it rendered,
+// stole from other threads and split for them. Null pointers are skipped
+ChaosRendererAPI void getLastRenderThreadStats(int thread, double* busyMs, unsigned long long* buckets, unsigned long long* steals, unsigned long long* splits);
 }
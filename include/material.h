@@ -2,14 +2,53 @@
 
 #include "utils.h"
 
+#include <vector>
+
 class Scene;
 
 const real_t shadowBias = 1e-4f;
 
 
+// Ray of the wavefront integrator (see renderer_lib.cpp). The recursive integrator returns the
+// color of a ray from Material::shade, the wavefront one adds what the ray contributes to its pixel,
+// scaled by weight, and queues the secondary rays with their own weights instead of tracing them.
+struct PathRay {
+    Ray ray;
+    // Fraction of the color of the ray that goes into the pixel
+    Color weight;
+    int pixel = 0;
+    // depth argument of Material::shade for the hit of the ray
+    int depth = 0;
+    bool backface = false;
+    // Misses add the background color
+    bool missBackground = true;
+};
+
+// Adds contribution to the pixel if nothing is hit before maxT
+struct ShadowRay {
+    Ray ray;
+    real_t maxT = 0;
+    Color contribution;
+    int pixel = 0;
+};
+
+struct WavefrontQueue {
+    std::vector<PathRay> rays;
+    std::vector<ShadowRay> shadowRays;
+    // Colors of the pixels of the bucket
+    std::vector<Color> pixels;
+};
+
+
 class Material {
 public:
+    virtual ~Material() = default;
+
     virtual Color shade(const Scene& scene, const Ray& ray, const IntersectionData& idata, int depth = 0) const = 0;
+
+    // Wavefront counterpart of shade: add the color of the hit to path.pixel,
+    // and queue the rays shade would trace
+    virtual void queueRays(const Scene& scene, const PathRay& path, const IntersectionData& idata, WavefrontQueue& queue) const = 0;
 };
 
 
@@ -20,6 +59,7 @@ public:
 
 public:
     virtual Color shade(const Scene& scene, const Ray& ray, const IntersectionData& idata, int depth = 0) const override;
+    virtual void queueRays(const Scene& scene, const PathRay& path, const IntersectionData& idata, WavefrontQueue& queue) const override;
 };
 
 
@@ -30,6 +70,7 @@ public:
 
 public:
     virtual Color shade(const Scene& scene, const Ray& ray, const IntersectionData& idata, int depth = 0) const override;
+    virtual void queueRays(const Scene& scene, const PathRay& path, const IntersectionData& idata, WavefrontQueue& queue) const override;
 };
 
 
@@ -40,6 +81,7 @@ public:
 
 public:
     virtual Color shade(const Scene& scene, const Ray& ray, const IntersectionData& idata, int depth = 0) const override;
+    virtual void queueRays(const Scene& scene, const PathRay& path, const IntersectionData& idata, WavefrontQueue& queue) const override;
 };
 
 
@@ -51,4 +93,5 @@ public:
 
 public:
     virtual Color shade(const Scene& scene, const Ray& ray, const IntersectionData& idata, int depth = 0) const override;
+    virtual void queueRays(const Scene& scene, const PathRay& path, const IntersectionData& idata, WavefrontQueue& queue) const override;
 };
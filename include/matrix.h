@@ -112,4 +112,23 @@ struct Matrix {
         return t;
     }
 
+    real_t determinant() const
+    {
+        return dot(r1, cross(r2, r3));
+    }
+
+    /// <summary>
+    /// Inverse of the matrix. The matrix should not be singular
+    /// </summary>
+    /// <returns> The inverse matrix </returns>
+    Matrix inverse() const
+    {
+        // The columns of the inverse are the cross products of the rows, divided by the determinant
+        const real_t invDet = 1 / determinant();
+        const Vector c1 = cross(r2, r3) * invDet;
+        const Vector c2 = cross(r3, r1) * invDet;
+        const Vector c3 = cross(r1, r2) * invDet;
+        return Matrix(c1, c2, c3).transposed();
+    }
+
 };
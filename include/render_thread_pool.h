@@ -0,0 +1,100 @@
+#pragma once
+
+#include "utils.h"
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+
+// Work of one render thread during a run of the pool
+struct RenderThreadStats {
+    // Time spent in buckets. Against the render time, this is the utilization of the thread
+    double busyMs = 0;
+    uint64_t buckets = 0;
+    // Buckets taken from the queues of other threads
+    uint64_t steals = 0;
+    // Halves this thread split off its buckets and left to the others
+    uint64_t splits = 0;
+};
+
+/// <summary>
+/// Split off the second half of the longer side of the bucket into half. The split is at a multiple of the tile size
+/// from the corner of the bucket, so the tiles of the halves are those of the whole bucket
+/// </summary>
+/// <returns> False, and the bucket is left whole, if a half would be smaller than the minimum </returns>
+bool splitBucket(Bucket& bucket, Bucket& half, size_t tileWidth, size_t tileHeight);
+
+/// <summary>
+/// Render threads that are started once and kept for the next renders. Each thread has its own queue of buckets,
+/// it works from the front of it, and once it is empty steals from the back of the queues of the others.
+/// Near the end of a run, when fewer buckets than threads are left in the queues, a thread that takes a bucket
+/// splits it and leaves halves at the back of its queue, for the threads that are about to run out of work
+/// </summary>
+class RenderThreadPool {
+public:
+    // Called on a pool thread, with the index of the thread
+    using BucketWork = std::function<void(const Bucket& bucket, unsigned thread)>;
+
+    /// <param name="threadCount"> 0 for one per hardware thread </param>
+    explicit RenderThreadPool(unsigned threadCount);
+    ~RenderThreadPool();
+    RenderThreadPool(const RenderThreadPool&) = delete;
+    RenderThreadPool& operator=(const RenderThreadPool&) = delete;
+
+    unsigned getThreadCount() const { return unsigned(threads.size()); }
+
+    /// <summary>
+    /// Call work for every bucket on the pool threads, and return once all are done.
+    /// Calls from several threads are run one after another
+    /// </summary>
+    /// <param name="tileWidth, tileHeight"> Buckets are split only at multiples of this size from their corner </param>
+    /// <param name="interleaved"> Deal the buckets to the threads in turn, so that all of them work through the buckets
+    /// in their order, instead of in runs of neighbouring ones </param>
+    /// <returns> What each thread did during the run </returns>
+    std::vector<RenderThreadStats> run(const std::vector<Bucket>& buckets, size_t tileWidth, size_t tileHeight, bool interleaved, const BucketWork& work);
+
+private:
+    struct BucketQueue {
+        std::mutex mutex;
+        std::deque<Bucket> buckets;
+    };
+
+    void threadMain(unsigned index);
+    void runBuckets(unsigned index);
+    bool popBucket(unsigned index, Bucket& bucket);
+    bool stealBucket(unsigned index, Bucket& bucket);
+    void notifyIdleThreads();
+
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<BucketQueue>> queues;
+    std::vector<RenderThreadStats> threadStats;
+
+    // Serializes the calls to run
+    std::mutex runMutex;
+
+    // Guards the fields below, which start the threads on a run and tell when they are done with it
+    std::mutex mutex;
+    std::condition_variable startCondition;
+    std::condition_variable doneCondition;
+    uint64_t runIndex = 0;
+    unsigned finishedThreads = 0;
+    bool stopping = false;
+
+    // Of the current run
+    const BucketWork* work = nullptr;
+    size_t tileWidth = 1;
+    size_t tileHeight = 1;
+    // Buckets queued or being rendered, split halves included
+    std::atomic<size_t> unfinishedBuckets{ 0 };
+    // Buckets in the queues of all threads
+    std::atomic<size_t> queuedBuckets{ 0 };
+    // Threads that find every queue empty wait here for a split to queue halves, or for the run to finish
+    std::mutex idleMutex;
+    std::condition_variable idleCondition;
+};
@@ -2,7 +2,139 @@
 
 #include "utils.h"
 #include "scene.h"
+#include "render_thread_pool.h"
 
 #include <vector>
+#include <functional>
+#include <cstdint>
 
-void renderImage(Color* pixels, const Scene& scene);
+struct RenderStats {
+    double renderMs = 0;
+    uint64_t primaryRays = 0;
+    // Primary rays that were coherent enough to be traced in packets
+    uint64_t packetRays = 0;
+    // Rays traced for the hits of other rays: GI, reflection and refraction rays
+    uint64_t secondaryRays = 0;
+    // Occlusion queries towards the lights. The time is summed over the render threads,
+    // so it is CPU time and can be larger than the render time
+    uint64_t shadowRays = 0;
+    double shadowMs = 0;
+    // Work of each render thread, its busy time against renderMs is its utilization
+    std::vector<RenderThreadStats> threads;
+};
+
+// Counters of the calling thread, the shading code adds its shadow rays here
+RenderStats& threadRenderStats();
+
+// Time it took to render the parts of an image, summed over cells of RENDER_COST_CELL_SIZE pixels.
+// Kept from one render to the next, to order and split the buckets of the next one by their cost
+struct RenderCostMap {
+    size_t width = 0;
+    size_t height = 0;
+    // Row by row
+    std::vector<double> cellMs;
+};
+
+const size_t RENDER_COST_CELL_SIZE = 8;
+
+/// <summary>
+/// Render the image, one bucket at a time on the render threads
+/// </summary>
+/// <param name="costs"> If not null, set to the cost of the parts of the image in this render. If it has the costs of
+/// a previous render of the same size, the buckets are ordered and split by them. Otherwise, the cost of every cell
+/// is estimated first by timing one of its pixels, if the bucket settings need it </param>
+void renderImage(Color* pixels, const Scene& scene, RenderStats* stats = nullptr, RenderCostMap* costs = nullptr);
+
+// What a pass of a progressive render added to the image
+struct ProgressivePass {
+    // From 0
+    int index = 0;
+    int passCount = 0;
+    // GI rays per diffuse hit in the image so far, out of SceneSettings::giRays
+    int giRays = 0;
+    double passMs = 0;
+    double totalMs = 0;
+    // Root mean square of the change of the pixels rendered by the pass, 0 for the first one
+    double rmsChange = 0;
+    size_t renderedPixels = 0;
+    // Pixels whose noise is still above SceneSettings::noiseThreshold, which the next pass renders.
+    // All of them without a threshold
+    size_t noisyPixels = 0;
+};
+
+// Called with the image after each pass. Returns false to stop the render
+using ProgressiveCallback = std::function<bool(const Color* pixels, const ProgressivePass& pass)>;
+
+/// <summary>
+/// Render the image in passes that trace a share of the GI rays of the scene each, and average them with the
+/// passes before into pixels. Once every pass is done the image is as noisy as the one renderImage gives.
+/// With a SceneSettings::noiseThreshold, the noise of every pixel is estimated from the variance of its passes,
+/// and the passes after the first few only render the pixels where it is above the threshold.
+/// The render ends early once it is below in all of them
+/// </summary>
+/// <param name="scene"> Its passGIRays setting is changed for every pass, and restored at the end </param>
+/// <param name="passGIRays"> GI rays per diffuse hit in each pass </param>
+/// <param name="stats"> Summed over the passes, the thread stats are those of the last pass </param>
+/// <param name="sampleCounts"> If not null, set to the number of passes that rendered each pixel </param>
+/// <returns> Number of passes rendered </returns>
+int renderProgressive(Color* pixels, Scene& scene, int passGIRays, const ProgressiveCallback& callback, RenderStats* stats = nullptr, int* sampleCounts = nullptr);
+
+struct PrimaryRayBenchmark {
+    uint64_t rays = 0;
+    // Rays that were coherent enough to be traced in packets
+    uint64_t packetRays = 0;
+    double singleMs = 0;
+    double packetMs = 0;
+    // Pixels whose closest hit differs between the two
+    uint64_t mismatches = 0;
+};
+
+/// <summary>
+/// Trace the camera rays of every pixel, without shading, one ray at a time and then in packets,
+/// and compare the hits. The traversal, not the shading, is what packets speed up
+/// </summary>
+/// <param name="repeats"> Each way is timed this many times, and the fastest time is kept </param>
+PrimaryRayBenchmark benchmarkPrimaryRays(const Scene& scene, int repeats = 3);
+
+struct CompressedBVHBenchmark {
+    uint64_t rays = 0;
+    // Summed over the objects
+    int wideNodeCount = 0;
+    // Memory of the acceleration structures of all objects, see BVHStats::memoryBytes
+    size_t floatBytes = 0;
+    size_t compressedBytes = 0;
+    double floatMs = 0;
+    double compressedMs = 0;
+    // Pixels whose closest hit differs between the two
+    uint64_t mismatches = 0;
+};
+
+/// <summary>
+/// Trace the camera rays of every pixel one at a time, without shading, through the wide BVHs
+/// of the objects with float and with compressed bounds, and compare memory, time and hits.
+/// The objects are switched back to their own layout at the end
+/// </summary>
+/// <param name="repeats"> Each layout is timed this many times, and the fastest time is kept </param>
+CompressedBVHBenchmark benchmarkCompressedBVH(Scene& scene, int repeats = 3);
+
+// Closest hit of a ray of castHitSet
+struct HitSetEntry {
+    // Indices in Scene::objects and Scene::instances, -1 for a miss
+    int object = -1;
+    int instance = -1;
+    // Vertex indices of the triangle, the index of the triangle itself depends on the BVH build
+    Triangle triangle;
+    real_t t = 0;
+    real_t u = 0;
+    real_t v = 0;
+    // Whether the any-hit query finds a triangle before the end of the ray
+    bool occluded = false;
+};
+
+/// <summary>
+/// Cast a fixed set of rays at the scene, half of them from around its bounds to points inside them and half from
+/// points inside them in random directions, and return the closest hit of each and whether the ray is occluded.
+/// The rays depend only on the count and the bounds, so runs of the same build with different kernels
+/// (CHAOS_SIMD_KERNELS, see getSIMDKernels) can be compared hit by hit
+/// </summary>
+std::vector<HitSetEntry> castHitSet(const Scene& scene, int rayCount);
@@ -6,12 +6,78 @@
 
 #include <vector>
 #include <string>
+#include <ostream>
+#include <optional>
+
+enum class Integrator {
+    // Material::shade traces the secondary rays of every hit depth-first
+    Recursive,
+    // Rays are traced a generation at a time for a whole bucket, sorted to make
+    // neighbouring rays visit the same nodes, and shaded grouped by material
+    Wavefront,
+};
+
+// Order in which the render threads take the buckets
+enum class BucketOrder {
+    // Row by row. Each thread gets a band of rows
+    Raster,
+    // Outwards from the center of the image, which usually has the subject
+    Spiral,
+    // Along a Hilbert curve. Each thread gets a compact region, and neighbouring buckets share cached nodes
+    Hilbert,
+    // The most expensive first, so the cheap ones fill the gaps at the end
+    Cost,
+};
 
 struct SceneSettings {
     size_t width = 1920;
     size_t height = 1080;
     Color background{ 0.2f, 0.2f, 0.2f };
     size_t bucketSize = 24;
+    BucketOrder bucketOrder = BucketOrder::Raster;
+    // Split the buckets that are expected to take much longer than the others, see RenderCostMap
+    bool adaptiveBuckets = false;
+    // Trace the camera rays of neighbouring pixels together, when their directions are coherent
+    bool rayPackets = true;
+    Integrator integrator = Integrator::Recursive;
+    // 0 for one per hardware thread
+    unsigned renderThreads = 0;
+    // GI rays traced from every diffuse hit
+    int giRays = 128;
+    // GI rays traced from every diffuse hit by a pass of a progressive render, which weighs them as if
+    // all giRays were traced. 0 outside of progressive renders
+    int passGIRays = 0;
+    // Progressive renders stop rendering a pixel once the standard error of its luminance is below this. 0 to render all passes
+    real_t noiseThreshold = 0;
+    BVHBuildSettings bvh{};
+};
+
+// Placement of a scene object. Instances of the same object share its mesh and BVH,
+// rays are transformed into the object space of the instance to intersect them.
+struct Instance {
+    int objectIndex = -1;
+    // Object to world transform: transform * p + translation
+    Matrix transform;
+    Vector translation{};
+    Matrix inverseTransform;
+    // Transforms normals from object to world space
+    Matrix normalTransform;
+    // Overrides the material of the object when set
+    const Material* material = nullptr;
+    // World space bounds
+    AABB bounds;
+    // Rays don't need to be transformed
+    bool identity = true;
+};
+
+// Node of the top-level acceleration structure, built over the bounds of the scene instances.
+// The BVH of every object is the bottom level.
+struct TLASNode {
+    AABB bounds;
+    int left = -1;
+    int right = -1;
+    int startInstanceIndex = -1;
+    int endInstanceIndex = -1;
 };
 
 class Scene : Intersectable {
@@ -20,26 +86,102 @@ public:
     SceneSettings settings;
     Camera camera;
     std::vector<Object> objects;
+    std::vector<Instance> instances;
     std::vector<Material*> materials;
     std::vector<Light> lights;
 
+private:
+    std::vector<TLASNode> tlas;
+    // Instance indices, ordered so that every TLAS leaf references a contiguous range
+    std::vector<int> tlasInstances;
+
+    // Scene load timings
+    double documentParseMs = 0;
+    std::vector<double> objectParseMs;
+
 public:
     Scene() {}
     Scene(const SceneSettings& settings)
         : settings(settings)
     {}
-    Scene(const std::string& fileName)
+    Scene(const std::string& fileName, std::optional<BVHBuildMode> builder = std::nullopt)
     {
-        load(fileName);
+        load(fileName, builder);
     }
 
-    void addObject(const Object& object);
-    void load(const std::string& fileName);
+    /// <summary>
+    /// Add an object and place it once, without a transform
+    /// </summary>
+    /// <param name="visible"> Whether to place the object. Objects only rendered through instances are not placed themselves </param>
+    /// <returns> Index of the object </returns>
+    int addObject(Object object, bool visible = true);
+
+    /// <summary>
+    /// Place an object again, sharing its mesh and BVH
+    /// </summary>
+    /// <param name="transform"> Rotation and scale from object to world space </param>
+    /// <param name="material"> Overrides the object material if not null </param>
+    /// <returns> Index of the instance, -1 if the transform is singular </returns>
+    int addInstance(int objectIndex, const Matrix& transform, const Vector& translation, const Material* material = nullptr);
+
+    /// <summary>
+    /// Load a scene from a .crtscene file
+    /// </summary>
+    /// <param name="builder"> Overrides the BVH builder from the scene settings, e.g. LBVH for interactive rendering </param>
+    void load(const std::string& fileName, std::optional<BVHBuildMode> builder = std::nullopt);
+
+    /// <summary>
+    /// (Re)build the top-level acceleration structure over the instances.
+    /// Only the instance bounds are used, so this is cheap compared to building the object BVHs.
+    /// Until it is called, instances added after the last build are found by testing every instance.
+    /// </summary>
+    void buildTLAS();
+
+    /// <summary>
+    /// Move the vertices of an object (see Object::updateVertices) and update the TLAS to the new bounds of its instances
+    /// </summary>
+    /// <returns> Whether the BVH of the object was rebuilt instead of refit. False, with nothing changed, for an invalid objectIndex </returns>
+    bool updateObjectVertices(int objectIndex, const std::vector<Vector>& vertices);
 
     Color shade(const Ray& ray, const IntersectionData& idata) const;
 
+    // Material of the hit instance, or of the hit object if the instance doesn't override it
+    const Material* getMaterial(const IntersectionData& idata) const;
+
+    /// <summary>
+    /// Position and normals of the closest hit along a ray, computed once shading needs them.
+    /// Traversal only records the distance, barycentrics and triangle of the hits it tries
+    /// </summary>
+    /// <param name="smooth"> Whether to compute the smooth shading point and normal </param>
+    HitAttributes finalizeHit(const Ray& ray, const IntersectionData& idata, bool smooth) const;
+
     // Intersectable
     bool intersect(Ray ray, IntersectionData& idata, bool backface = false, bool any = false, real_t max_t = 1e30f) const override;
 
+    // intersect for a ray prepared with prepareRay
+    bool intersect(const KernelRay& ray, IntersectionData& idata, bool backface = false, bool any = false, real_t max_t = 1e30f) const;
+
+    /// <summary>
+    /// Closest hits of a packet of coherent rays, e.g. camera rays of neighbouring pixels, traced together
+    /// </summary>
+    /// <param name="activeMask"> Bit i is set if rays[i] is traced </param>
+    /// <returns> Mask of the rays that hit something </returns>
+    int intersectPacket(const Ray rays[RAY_PACKET_SIZE], IntersectionData idata[RAY_PACKET_SIZE], int activeMask, bool backface = false) const;
+
+    /// <summary>
+    /// Print the acceleration structure statistics of every object in the scene
+    /// </summary>
+    void printStats(std::ostream& os) const;
+
     static void getSizeFromFile(const std::string& fileName, int& width, int& height);
+
+private:
+    void buildTLASRecursive(int nodeIndex);
+    void updateInstanceBounds(Instance& instance) const;
+    // intersect for a kind of query known at compile time
+    template <RayQuery query>
+    bool intersect(const KernelRay& ray, IntersectionData& idata, real_t max_t) const;
+    template <RayQuery query>
+    bool intersectInstance(int instanceIndex, const KernelRay& ray, IntersectionData& idata) const;
+    int intersectInstancePacket(int instanceIndex, const KernelRayPacket& packet, IntersectionData idata[RAY_PACKET_SIZE], int activeMask, bool backface) const;
 };
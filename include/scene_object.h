@@ -1,35 +1,96 @@
 #pragma once
 
 #include <vector>
+#include <atomic>
+#include <cstdint>
+#include <string>
 #include "utils.h"
 #include "material.h"
+#include "simd_kernels.h"
 
+// Maximum depth of a BVH, the size of the traversal stack
+const int BVH_STACK_SIZE = 64;
 
-#if (WITH_SIMD == 2)
-struct PackedTriangles
-{
-    __m256 e1[3];
-    __m256 e2[3];
-    __m256 v0[3];
+// 32 bytes, two nodes per cache line
+struct alignas(32) BVHNode {
+    real_t boundsMin[3] = { 1e30f, 1e30f, 1e30f };
+    // Interior nodes: index of the left child, the right child is right after it
+    // Leaves: index of the first LeafPackBlock of the packs with the triangles
+    int leftFirst = -1;
+    real_t boundsMax[3] = { -1e30f, -1e30f, -1e30f };
+    // Number of triangles in a leaf, 0 for interior nodes
+    int count = 0;
+
+    bool isLeaf() const { return count > 0; }
+
+    AABB getBounds() const
+    {
+        return { { boundsMin[0], boundsMin[1], boundsMin[2] }, { boundsMax[0], boundsMax[1], boundsMax[2] } };
+    }
+
+    void setBounds(const AABB& bounds)
+    {
+        for (int i = 0; i < 3; ++i) {
+            boundsMin[i] = bounds.min[i];
+            boundsMax[i] = bounds.max[i];
+        }
+    }
+};
+static_assert(sizeof(BVHNode) == 32, "BVHNode should fit in half a cache line");
+
+enum class BVHBuildMode {
+    Median, // Split at the triangle-count median on the longest axis
+    SAH,    // Binned Surface Area Heuristic
+    LBVH,   // Linear BVH: triangles sorted by the Morton code of their centroid. Fast to build, slower to traverse
 };
 
-struct PackedRay
-{
-    __m256 origin[3];
-    __m256 dir[3];
-    __m256 length;
+struct BVHBuildSettings {
+    BVHBuildMode mode = BVHBuildMode::SAH;
+    // Number of centroid bins per axis for the SAH builder
+    int binCount = 16;
+    // SAH cost model: cost of traversing one node vs. intersecting one leaf pack.
+    // Leaves are tested a pack at a time, so their size is picked in whole packs of the active SIMD kernels
+    real_t traversalCost = 1.0f;
+    real_t intersectionCost = 1.0f;
+    // Nodes with at most minLeafSize triangles are always leaves,
+    // nodes with more than maxLeafSize triangles are always split
+    int minLeafSize = 1;
+    int maxLeafSize = 16;
+    // Collapse the binary BVH into an 8-wide one for traversal
+    bool wide = false;
+    // Store the wide BVH with the bounds quantized to 8 bits (see CompressedWideBVHNode),
+    // for scenes whose traversal is bound by memory bandwidth. Implies wide
+    bool compressed = false;
+    // Store the vertices of the triangles in the leaf packs instead of the edges, and test them with the
+    // watertight kernels, so rays can't slip through the cracks between triangles that share an edge
+    bool watertight = false;
+    // Threads used to build the top levels of large BVHs. 0 uses all hardware threads
+    int buildThreads = 0;
+    // A refit BVH is rebuilt when its SAH cost grows past this multiple of the cost
+    // right after the last build. 0 always refits
+    real_t refitRebuildThreshold = 2.0f;
+    // Directory of the on-disk BVH cache (see BVHCache). Empty uses the CHAOS_BVH_CACHE_DIR
+    // environment variable, caching is disabled if neither is set
+    std::string cacheDirectory;
 };
-#endif
-
-struct BVHNode {
-    AABB bounds;
-    int left = -1;
-    int right = -1;
-    int startTriangleIndex = -1;
-    int endTriangleIndex = -1;
-#if (WITH_SIMD == 2)
-    PackedTriangles pack;
-#endif
+
+struct BVHStats {
+    int nodeCount = 0;
+    int leafCount = 0;
+    int maxDepth = 0;
+    // Expected cost of a random ray against the tree, in the units of the cost model
+    real_t sahCost = 0;
+    // Expected number of interior nodes visited by a random ray in the binary
+    // and in the wide BVH (0 if there is none), estimated from the node surface areas
+    real_t traversalSteps = 0;
+    real_t wideTraversalSteps = 0;
+    int wideNodeCount = 0;
+    bool compressed = false;
+    // Memory used by the acceleration structure: nodes, leaf packs and wide or compressed nodes
+    size_t memoryBytes = 0;
+    // Time to build the BVH, or to load it if it was found in the cache
+    double buildMs = 0;
+    bool loadedFromCache = false;
 };
 
 struct Triangle {
@@ -39,6 +100,7 @@ struct Triangle {
 };
 
 class Object : Intersectable {
+    friend class BVHCache;
 
 private:
     // Object data
@@ -47,61 +109,153 @@ private:
     std::vector<Triangle> triangles;
     const Material* material;
     AABB aabb;
-    bool hasAABB;
 
     std::vector<BVHNode> bvh;
+    std::vector<LeafPackBlock> leafPacks;
+    // Triangles per leaf pack, the width of the kernels the packs were built for
+    int packWidth = 1;
+    std::vector<WideBVHNode> wideBVH;
+    // Replaces wideBVH when the bounds are compressed, the node indices are the same
+    std::vector<CompressedWideBVHNode> compressedBVH;
+    BVHBuildSettings buildSettings;
+    BVHStats bvhStats;
+    // SAH cost of the BVH when it was last built, to tell how much refitting degraded it
+    real_t builtSahCost = 0;
 
 public:
     // Constructors
-    Object(std::vector<Vector>&& vertices, std::vector<int>&& triangles, const Material* material = nullptr)
+    Object(std::vector<Vector>&& vertices, std::vector<int>&& triangles, const Material* material = nullptr, const BVHBuildSettings& buildSettings = {})
         : vertices(vertices)
         , triangles(triangles.size() / 3)
         , material(material)
-        , hasAABB(false)
+        , buildSettings(buildSettings)
     {
         for (int i = 0; i < this->triangles.size(); ++i) {
             this->triangles[i] = { triangles[i * 3 + 0], triangles[i * 3 + 1], triangles[i * 3 + 2] };
         }
         calculate_normals();
         calculate_aabb();
-        calculate_bvh();
+        calculate_bvh_cached();
     }
-    Object(const std::vector<Vector>& vertices, const std::vector<int>& triangles, const Material* material = nullptr)
+    Object(const std::vector<Vector>& vertices, const std::vector<int>& triangles, const Material* material = nullptr, const BVHBuildSettings& buildSettings = {})
         : vertices(vertices)
         , triangles(triangles.size() / 3)
         , material(material)
-        , hasAABB(false)
+        , buildSettings(buildSettings)
     {
         for (int i = 0; i < this->triangles.size(); ++i) {
             this->triangles[i] = { triangles[i * 3 + 0], triangles[i * 3 + 1], triangles[i * 3 + 2] };
         }
         calculate_normals();
         calculate_aabb();
-        calculate_bvh();
+        calculate_bvh_cached();
     }
 
     // Intersectable
     bool intersect(Ray ray, IntersectionData& idata, bool backface = false, bool any = false, real_t max_t = 1e30f) const override;
 
+    // intersect for a ray prepared with prepareRay
+    bool intersect(const KernelRay& ray, IntersectionData& idata, bool backface = false, bool any = false, real_t max_t = 1e30f) const;
+
+    // intersect for a kind of query known at compile time, instantiated for every RayQuery
+    template <RayQuery query>
+    bool intersect(const KernelRay& ray, IntersectionData& idata, real_t max_t = 1e30f) const;
+
+    /// <summary>
+    /// Closest hits of a packet of coherent rays, traced together through the binary BVH
+    /// </summary>
+    /// <param name="activeMask"> Bit i is set if rays[i] is traced </param>
+    /// <param name="maxT"> Only hits closer than maxT[i] are looked for along rays[i] </param>
+    /// <returns> Mask of the rays that hit the object </returns>
+    int intersectPacket(const Ray rays[RAY_PACKET_SIZE], IntersectionData idata[RAY_PACKET_SIZE], int activeMask, const real_t maxT[RAY_PACKET_SIZE], bool backface = false) const;
+
+    // intersectPacket for rays prepared with prepareRayPacket
+    int intersectPacket(const KernelRayPacket& packet, IntersectionData idata[RAY_PACKET_SIZE], int activeMask, const real_t maxT[RAY_PACKET_SIZE], bool backface = false) const;
+
     const Material* getMaterial() const { return material; }
     void setMaterial(const Material* mat) { material = mat; }
 
-    IntersectionData smoothIntersection(const IntersectionData& idata) const;
+    /// <summary>
+    /// Position, geometric normal and, if smooth, shading point and normal of a hit, all in object space
+    /// </summary>
+    /// <param name="ip"> The hit point, in object space </param>
+    HitAttributes finalizeHit(const Vector& ip, const IntersectionData& idata, bool smooth) const;
+
+    size_t getTriangleCount() const { return triangles.size(); }
+    // Indexed in the order of the BVH, which the build changes
+    const Triangle& getTriangle(int index) const { return triangles[index]; }
+    const AABB& getAABB() const { return aabb; }
+    const BVHStats& getBVHStats() const { return bvhStats; }
+
+    /// <summary>
+    /// Move the vertices of the object, keeping its triangles. The BVH bounds are refit to the new
+    /// positions, unless the quality of the tree degrades past refitRebuildThreshold and it is rebuilt.
+    /// </summary>
+    /// <param name="newVertices"> New positions, as many as the object has vertices </param>
+    /// <returns> Whether the BVH was rebuilt </returns>
+    bool updateVertices(const std::vector<Vector>& newVertices);
+
+    /// <summary>
+    /// Switch the wide BVH between the float and the compressed layout, or off, without rebuilding the binary BVH
+    /// </summary>
+    void setWideBVHLayout(bool wide, bool compressed);
 
 private:
     void calculate_normals();
     void calculate_aabb();
     void calculate_bvh();
+    void calculate_bvh_cached();
 
-    void calculate_bvh_recursive(int nodeIndex);
+    void calculate_bvh_recursive(int nodeIndex, int depth, std::atomic<int>& nodeCount, int parallelDepth);
+    int find_split_median(int nodeIndex);
+    int find_split_sah(int nodeIndex);
+    void calculate_lbvh(std::atomic<int>& nodeCount, unsigned threads, int parallelDepth);
+    void calculate_lbvh_recursive(int nodeIndex, const std::vector<uint32_t>& mortonCodes, int depth, std::atomic<int>& nodeCount, int parallelDepth);
+    void refit_bvh();
+    void calculate_bvh_stats();
+    void calculate_wide_bvh();
+    int collapse_wide_bvh_recursive(int nodeIndex);
+    void compress_wide_bvh();
 
-#if (WITH_SIMD == 2)
-    PackedTriangles makePackedTriangles(size_t start, size_t end) const;
-#endif
-    bool BVHIntersection(const Ray& ray, const BVHNode& node, IntersectionData& idata, bool backface, bool any, real_t max_t) const;
-    bool intersectBVHTriangles(const Ray& ray, const BVHNode& node, IntersectionData& idata, bool backface, bool any, real_t max_t) const;
+    Vector triangleCentroid(const Triangle& triangle) const;
+
+    int leafPackCount(int triangleCount) const;
+    int leafPackBlocks() const;
+    LeafPackInfo getLeafPackInfo(int block) const;
+    void makeLeafPacks(int block, int start, int count);
+    void calculate_leaf_packs();
+    template <RayQuery query>
+    bool BVHIntersection(const KernelRay& ray, const SIMDKernels& kernels, IntersectionData& idata, real_t max_t) const;
+    template <RayQuery query, typename WideNode>
+    bool wideBVHIntersection(const std::vector<WideNode>& nodes, const KernelRay& ray, const SIMDKernels& kernels, IntersectionData& idata, real_t max_t) const;
+    template <bool backface>
+    bool intersectBVHTriangles(const KernelRay& ray, const SIMDKernels& kernels, const BVHNode& node, IntersectionData& idata) const;
+    template <bool backface>
+    bool occludedBVHTriangles(const KernelRay& ray, const SIMDKernels& kernels, const BVHNode& node, real_t max_t) const;
+    void setLeafPackHit(int block, const KernelHit& hit, IntersectionData& idata) const;
 };
 
+/// <summary>
+/// The form of a ray the kernels take, with the inverse direction and its signs computed once.
+/// Prepared once per ray, and shared by every box and triangle test along it, down to the object BVHs
+/// </summary>
+KernelRay prepareRay(const Ray& ray);
+
+/// <summary>
+/// prepareRay for the rays of a packet
+/// </summary>
+KernelRayPacket prepareRayPacket(const Ray rays[RAY_PACKET_SIZE]);
+
+/// <summary>
+/// 30-bit Morton code of a point in the unit cube, 10 bits per axis. Points outside are clamped to it
+/// </summary>
+uint32_t mortonCode(real_t x, real_t y, real_t z);
+
+/// <summary>
+/// Stable sort of 64-bit keys by the 30-bit Morton code in their upper half. The lower half is free for a payload
+/// </summary>
+void radixSortMortonKeys(std::vector<uint64_t>& keys, unsigned threads);
+
 struct Light : Intersectable {
     Vector position{};
     real_t intensity = 1000;
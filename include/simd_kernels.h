@@ -0,0 +1,157 @@
+#pragma once
+
+// Ray-triangle and ray-box kernels, compiled for several instruction sets in the same library.
+// The best set the CPU supports is selected at startup.
+//
+// The kernel sources (src/kernels_*.cpp) are compiled with ISA-specific flags, so this header
+// is included by them and must stay free of inline functions and of other headers. The linker
+// may keep any one copy of an inline function, and it could be one compiled for a newer ISA.
+
+// The triangles of a BVH leaf are stored apart from the nodes, so that traversing
+// interior nodes doesn't pull the triangle data in the cache. They are split in packs
+// of consecutive triangles, as many as the active kernels test at once (packWidth).
+// A pack is a structure of arrays of floats, the first vertex and the two edges
+// of the triangle in every lane:
+//     v0[3][packWidth], e1[3][packWidth], e2[3][packWidth]
+// followed by its LeafPackInfo, and padded to whole LeafPackBlocks.
+// Objects built for the watertight test store the three vertices instead, in the same places:
+//     v0[3][packWidth], v1[3][packWidth], v2[3][packWidth]
+// The test needs no edges, and shared vertices give bit-identical results in both triangles.
+// Unused lanes of the last pack of a leaf repeat its last triangle, so they don't need masking.
+struct alignas(64) LeafPackBlock {
+    float data[16];
+};
+
+struct LeafPackInfo {
+    // Index of the triangle in the first lane
+    int firstTriangle;
+    // Number of used lanes
+    int count;
+};
+
+// Node of the 8-wide BVH, collapsed from the binary one. The bounds of the children
+// are stored as structure of arrays, so all eight are tested against a ray at once.
+// Unused child slots have empty (inverted) bounds, so they are never hit.
+struct alignas(32) WideBVHNode {
+    float minX[8], minY[8], minZ[8];
+    float maxX[8], maxY[8], maxZ[8];
+    // Index of a WideBVHNode for interior children,
+    // bitwise negated index of the binary BVH leaf node for leaves
+    int child[8];
+};
+
+// Wide node with the bounds of the children quantized to 8 bits per plane, on a grid over
+// the bounds of the node: plane = origin + q * scale. The scale is a power of two, so
+// q * scale is exact and every kernel dequantizes a plane to the same float, with or
+// without FMA. The planes are rounded outwards, so a quantized box contains the child.
+// 128 bytes, two cache lines, where a WideBVHNode takes four.
+// Unused child slots have qMin > qMax, which dequantizes to an empty (inverted) box.
+struct alignas(64) CompressedWideBVHNode {
+    float origin[3];
+    float scale[3];
+    unsigned char qMin[3][8];
+    unsigned char qMax[3][8];
+    // Same as WideBVHNode::child, indices of CompressedWideBVHNodes for interior children
+    int child[8];
+};
+
+// Ray with the values the box tests need precomputed
+struct KernelRay {
+    float origin[3];
+    float dir[3];
+    float invDir[3];
+    // origin * invDir, so the distance to a plane is a single multiply-subtract
+    float originInvDir[3];
+    // Whether the direction is negative along an axis, so the near plane of a box is its max
+    int negativeDir[3];
+    // For the watertight triangle test, the axes of the space of the ray: z is the largest
+    // component of the direction, x and y are swapped if it is negative to keep the winding
+    int shearAxes[3];
+    // dir[x] / dir[z], dir[y] / dir[z] and 1 / dir[z], the shear that maps the direction to +z
+    float shear[3];
+};
+
+struct KernelHit {
+    float t;
+    float u;
+    float v;
+    // Lane of the hit triangle in the pack
+    int lane;
+};
+
+// Rays traced together by the packet kernels
+const int RAY_PACKET_SIZE = 8;
+
+// Coherent rays (e.g. camera rays of neighbouring pixels) traced together through the BVH,
+// as structure of arrays with one ray per lane, so a node is tested against all of them at once
+struct alignas(32) KernelRayPacket {
+    float origin[3][RAY_PACKET_SIZE];
+    float dir[3][RAY_PACKET_SIZE];
+    float invDir[3][RAY_PACKET_SIZE];
+    float originInvDir[3][RAY_PACKET_SIZE];
+    int shearAxes[3][RAY_PACKET_SIZE];
+    float shear[3][RAY_PACKET_SIZE];
+};
+
+// Closest hit of every ray of a packet, see KernelHit
+struct alignas(32) KernelPacketHit {
+    float t[RAY_PACKET_SIZE];
+    float u[RAY_PACKET_SIZE];
+    float v[RAY_PACKET_SIZE];
+    int lane[RAY_PACKET_SIZE];
+};
+
+struct SIMDKernels {
+    const char* name;
+    // Triangles per leaf pack
+    int packWidth;
+
+    // Find the closest triangle among the first count lanes of the pack hit before hit.t.
+    // Returns whether hit was updated
+    bool (*intersectLeafPack)(const KernelRay& ray, const float* pack, int count, bool backface, KernelHit& hit);
+
+    // Whether any of the first count lanes of the pack is hit before maxT, for shadow rays.
+    // Stops at the first hit and computes no hit attributes
+    bool (*occludedLeafPack)(const KernelRay& ray, const float* pack, int count, bool backface, float maxT);
+
+    // Slab test of the 8 children of a wide node. The near and far planes are picked
+    // from the sign of the ray direction, so empty (inverted) boxes are never hit.
+    // Returns the mask of children entered before maxT, and their entry distances in tNear
+    int (*intersectWideNode)(const KernelRay& ray, const WideBVHNode& node, float maxT, float tNear[8]);
+
+    // intersectWideNode for a compressed node, the quantized planes are dequantized in the test
+    int (*intersectCompressedWideNode)(const KernelRay& ray, const CompressedWideBVHNode& node, float maxT, float tNear[8]);
+
+    // Slab test of one box. Boxes behind the ray are missed, flat boxes are hit.
+    // tNear is negative if the origin is inside the box
+    bool (*intersectAABB)(const KernelRay& ray, const float boundsMin[3], const float boundsMax[3], float& tNear);
+
+    // Slab test of one box against the rays of the packet set in activeMask.
+    // Returns the mask of the rays entering it before their tMax, and their entry distances in tNear
+    int (*intersectPacketAABB)(const KernelRayPacket& packet, const float boundsMin[3], const float boundsMax[3], const float tMax[RAY_PACKET_SIZE], int activeMask, float tNear[RAY_PACKET_SIZE]);
+
+    // Test the first count lanes of the pack against the rays of the packet set in activeMask,
+    // every triangle against all rays at once. Returns the mask of the rays whose hit was updated
+    int (*intersectPacketLeafPack)(const KernelRayPacket& packet, const float* pack, int count, bool backface, int activeMask, KernelPacketHit& hits);
+
+    // The leaf pack kernels for the vertex packs of watertight objects. The test of Woop et al. (2013),
+    // "Watertight Ray/Triangle Intersection": the triangle is moved to the space of the ray and the
+    // edge functions are computed without FMA, so the two triangles of an edge get exactly opposite
+    // values and a ray can't pass between them. The packet kernel tests the rays one at a time
+    bool (*intersectLeafPackWatertight)(const KernelRay& ray, const float* pack, int count, bool backface, KernelHit& hit);
+    bool (*occludedLeafPackWatertight)(const KernelRay& ray, const float* pack, int count, bool backface, float maxT);
+    int (*intersectPacketLeafPackWatertight)(const KernelRayPacket& packet, const float* pack, int count, bool backface, int activeMask, KernelPacketHit& hits);
+};
+
+// Defined in src/kernels_<isa>.cpp
+extern const SIMDKernels scalarKernels;
+extern const SIMDKernels sse41Kernels;
+extern const SIMDKernels avx2Kernels;
+extern const SIMDKernels avx512Kernels;
+
+/// <summary>
+/// Kernels for the best instruction set supported by the CPU and the OS, selected on the first call.
+/// The CHAOS_SIMD_KERNELS environment variable (scalar, sse4.1, avx2 or avx512)
+/// can select an older instruction set, e.g. to compare results
+/// </summary>
+const SIMDKernels& getSIMDKernels();
@@ -12,6 +12,7 @@ const real_t PI = 3.14159265359f;
 #include <algorithm>
 
 class Object;
+struct Instance;
 
 struct Color {
     real_t r = 0;
@@ -50,17 +51,27 @@ struct Bucket {
     size_t h = 0;
 };
 
+// What traversal records about a hit. The rest is computed once for the closest hit, see HitAttributes
 struct IntersectionData {
     real_t t = 0;
     real_t u = 0;
     real_t v = 0;
-    real_t w = 0;
-    Vector ip{};
-    Vector normal{};
     const Object* object = nullptr;
+    // Placement of the object that was hit, null when intersecting an object directly
+    const Instance* instance = nullptr;
     int triangle_index = -1;
 };
 
+// Surface of the closest hit in world space, see Scene::finalizeHit
+struct HitAttributes {
+    Vector ip{};
+    // Geometric normal of the triangle
+    Vector normal{};
+    // Shading point and normal, ip and normal unless the material is smooth shaded
+    Vector smoothIp{};
+    Vector smoothNormal{};
+};
+
 struct Ray {
     Vector origin = {};
     Vector dir = {};
@@ -79,13 +90,60 @@ struct AABB {
         min.z = std::min(min.z, v.z);
         max.z = std::max(max.z, v.z);
     }
+
+    void expand(const AABB& box) {
+        min.x = std::min(min.x, box.min.x);
+        max.x = std::max(max.x, box.max.x);
+        min.y = std::min(min.y, box.min.y);
+        max.y = std::max(max.y, box.max.y);
+        min.z = std::min(min.z, box.min.z);
+        max.z = std::max(max.z, box.max.z);
+    }
+
+    real_t surfaceArea() const {
+        const Vector size = max - min;
+        if (size.x < 0 || size.y < 0 || size.z < 0)
+            return 0;
+        return 2 * (size.x * size.y + size.y * size.z + size.z * size.x);
+    }
 };
 
 class Intersectable {
 public:
+    // With any set, only whether something is hit before max_t is returned (occlusion query),
+    // the hit attributes in idata are not filled
     virtual bool intersect(Ray ray, IntersectionData& idata, bool backface = false, bool any = false, real_t max_t = 1e30f) const = 0;
 };
 
+// The backface and any flags of Intersectable::intersect as one value. The traversal of the objects and
+// of the scene is instantiated for each kind of query, so its loops don't branch on the flags
+enum class RayQuery {
+    // Closest hit on either side of the triangles
+    Closest,
+    // Closest hit on the front side of the triangles, back faces are culled
+    ClosestFrontFace,
+    // Whether anything is hit on either side, for shadow rays
+    Any,
+    AnyFrontFace,
+};
+
+constexpr RayQuery rayQuery(bool backface, bool any)
+{
+    return any ?
+        (backface ? RayQuery::Any : RayQuery::AnyFrontFace) :
+        (backface ? RayQuery::Closest : RayQuery::ClosestFrontFace);
+}
+
+constexpr bool isAnyHitQuery(RayQuery query)
+{
+    return query == RayQuery::Any || query == RayQuery::AnyFrontFace;
+}
+
+constexpr bool hitsBackFaces(RayQuery query)
+{
+    return query == RayQuery::Closest || query == RayQuery::Any;
+}
+
 static real_t deg2rad(real_t deg)
 {
     static const real_t c = PI / 180;
@@ -0,0 +1,39 @@
+import ctypes
+import distutils.ccompiler
+import os
+import sys
+
+# Check for CHAOS_RAYTRACING_LIB_PATH env. variable, and use that if availbale
+# Otherwise, try to load from the default install location
+RENDERER_LIB_FNAME = 'renderer_lib' + distutils.ccompiler.new_compiler().shared_lib_extension
+RENDERER_LIB_PATH = os.path.abspath(os.getenv('CHAOS_RAYTRACING_LIB_PATH', default=os.path.join(os.path.dirname(__file__), os.path.pardir, 'install', 'lib')))
+RENDERER_LIB_FULL_PATH = os.path.join(RENDERER_LIB_PATH, RENDERER_LIB_FNAME)
+
+dll = ctypes.CDLL(RENDERER_LIB_FULL_PATH)
+dll.benchmarkCompressedBVH.argtypes = [ctypes.c_char_p, ctypes.c_int]
+
+
+def benchmark_folder(folder_path, repeats):
+    for root, dirs, files in os.walk(folder_path):
+        for file in sorted(files):
+            if file.endswith(".crtscene"):
+                benchmark_scene(os.path.join(root, file), repeats)
+
+
+def benchmark_scene(fileName, repeats):
+    dll.benchmarkCompressedBVH(bytes(fileName, sys.getfilesystemencoding()), repeats)
+    sys.stdout.flush()
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print("Usage: python benchmark_compressed_bvh.py <fileName/folder> [repeats]")
+    else:
+        path = sys.argv[1]
+        repeats = int(sys.argv[2]) if len(sys.argv) > 2 else 3
+        if os.path.isfile(path):
+            benchmark_scene(path, repeats)
+        elif os.path.isdir(path):
+            benchmark_folder(path, repeats)
+        else:
+            print(f"Invalid input: {path} is not a valid file or folder path.")
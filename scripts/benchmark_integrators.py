@@ -0,0 +1,62 @@
+import ctypes
+import distutils.ccompiler
+import os
+import sys
+
+# Check for CHAOS_RAYTRACING_LIB_PATH env. variable, and use that if availbale
+# Otherwise, try to load from the default install location
+RENDERER_LIB_FNAME = 'renderer_lib' + distutils.ccompiler.new_compiler().shared_lib_extension
+RENDERER_LIB_PATH = os.path.abspath(os.getenv('CHAOS_RAYTRACING_LIB_PATH', default=os.path.join(os.path.dirname(__file__), os.path.pardir, 'install', 'lib')))
+RENDERER_LIB_FULL_PATH = os.path.join(RENDERER_LIB_PATH, RENDERER_LIB_FNAME)
+
+# Values of INTEGRATOR_* in lib_export.h
+INTEGRATORS = {'recursive': 0, 'wavefront': 1}
+
+dll = ctypes.CDLL(RENDERER_LIB_FULL_PATH)
+dll.renderFile4.argtypes = [ctypes.POINTER(ctypes.c_float), ctypes.c_char_p, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_int]
+dll.getSizeFromFile.argtypes = [ctypes.c_char_p, ctypes.POINTER(ctypes.c_int), ctypes.POINTER(ctypes.c_int)]
+dll.getLastRenderStats.argtypes = [ctypes.POINTER(ctypes.c_double), ctypes.POINTER(ctypes.c_ulonglong), ctypes.POINTER(ctypes.c_ulonglong), ctypes.POINTER(ctypes.c_double)]
+dll.getLastRenderRaysPerSecond.restype = ctypes.c_double
+
+
+def benchmark_folder(folder_path, repeats):
+    for root, dirs, files in os.walk(folder_path):
+        for file in sorted(files):
+            if file.endswith(".crtscene"):
+                benchmark_scene(os.path.join(root, file), repeats)
+
+
+def benchmark_scene(fileName, repeats):
+    c_fileName = ctypes.c_char_p(bytes(fileName, sys.getfilesystemencoding()))
+    c_width = ctypes.c_int()
+    c_height = ctypes.c_int()
+    dll.getSizeFromFile(c_fileName, ctypes.byref(c_width), ctypes.byref(c_height))
+    width, height = c_width.value, c_height.value
+    c_buffer = (ctypes.c_float * (width * height * 4))()
+
+    print(fileName)
+    for name, integrator in INTEGRATORS.items():
+        # Best of the repeats, the scene is loaded and its BVH built again for every render
+        best_ms, best_rays_per_second = 0, 0
+        for _ in range(repeats):
+            dll.renderFile4(c_buffer, c_fileName, width, height, -1, integrator)
+            render_ms = ctypes.c_double()
+            dll.getLastRenderStats(ctypes.byref(render_ms), None, None, None)
+            if best_rays_per_second < dll.getLastRenderRaysPerSecond():
+                best_ms, best_rays_per_second = render_ms.value, dll.getLastRenderRaysPerSecond()
+        print(f"  {name:10} {best_ms:.1f} ms, {best_rays_per_second / 1e6:.2f} Mrays/s")
+    sys.stdout.flush()
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print("Usage: python benchmark_integrators.py <fileName/folder> [repeats]")
+    else:
+        path = sys.argv[1]
+        repeats = int(sys.argv[2]) if len(sys.argv) > 2 else 3
+        if os.path.isfile(path):
+            benchmark_scene(path, repeats)
+        elif os.path.isdir(path):
+            benchmark_folder(path, repeats)
+        else:
+            print(f"Invalid input: {path} is not a valid file or folder path.")
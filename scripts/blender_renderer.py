@@ -16,6 +16,10 @@ RENDERER_LIB_FULL_PATH = os.path.join(RENDERER_LIB_PATH, RENDERER_LIB_FNAME)
 
 LOG_TIME = True
 
+# BVH builders, see lib_export.h
+BVH_BUILDER_FROM_SCENE = -1
+BVH_BUILDER_LBVH = 2
+
 
 def export_scene_to_json(scene, filepath):
     scale = scene.render.resolution_percentage / 100.0
@@ -126,7 +130,7 @@ class CustomRenderEngine(bpy.types.RenderEngine):
         self.scene_data = None
         self.draw_data = None
         self.dll = ctypes.CDLL(RENDERER_LIB_FULL_PATH)
-        self.dll.renderFile.argtypes = [ctypes.POINTER(ctypes.c_float), ctypes.c_char_p]
+        self.dll.renderFile3.argtypes = [ctypes.POINTER(ctypes.c_float), ctypes.c_char_p, ctypes.c_int, ctypes.c_int, ctypes.c_int]
 
     # When the render engine instance is destroy, this is called. Clean up any
     # render engine data here, for example stopping running render threads.
@@ -150,7 +154,9 @@ class CustomRenderEngine(bpy.types.RenderEngine):
 
         with CodeTimer('Render'):
             self.c_buffer = (ctypes.c_float * (self.size_x * self.size_y * 4))()
-            self.dll.renderFile(self.c_buffer, ctypes.c_char_p(self.scene_path.encode('utf-8')))
+            # Previews are re-rendered on every edit, so build their BVHs with the fast LBVH builder
+            bvh_builder = BVH_BUILDER_LBVH if self.is_preview else BVH_BUILDER_FROM_SCENE
+            self.dll.renderFile3(self.c_buffer, ctypes.c_char_p(self.scene_path.encode('utf-8')), self.size_x, self.size_y, bvh_builder)
 
         with CodeTimer('Write image'):
             # Flip pixel buffer
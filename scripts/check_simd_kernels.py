@@ -0,0 +1,129 @@
+import ctypes
+import distutils.ccompiler
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+# Check for CHAOS_RAYTRACING_LIB_PATH env. variable, and use that if availbale
+# Otherwise, try to load from the default install location
+RENDERER_LIB_FNAME = 'renderer_lib' + distutils.ccompiler.new_compiler().shared_lib_extension
+RENDERER_LIB_PATH = os.path.abspath(os.getenv('CHAOS_RAYTRACING_LIB_PATH', default=os.path.join(os.path.dirname(__file__), os.path.pardir, 'install', 'lib')))
+RENDERER_LIB_FULL_PATH = os.path.join(RENDERER_LIB_PATH, RENDERER_LIB_FNAME)
+
+# Names of CHAOS_SIMD_KERNELS, and of the kernels as getSIMDKernelsName reports them
+KERNEL_SETS = [('scalar', 'scalar'), ('sse4.1', 'SSE4.1'), ('avx2', 'AVX2+FMA'), ('avx512', 'AVX-512')]
+
+# Without the watertight test the edge functions are computed with FMA by the AVX2 and AVX-512 kernels and
+# without it by the others, so they round differently. A ray that grazes an edge can hit the triangle with one
+# set and pass it by, on to whatever is behind, with another, or hit the neighbouring triangle at the same distance.
+# Such differences are tolerated when the nearer hit is this close to an edge of its triangle, in barycentric
+# coordinates, or both are for hits at the same distance. With the watertight test nothing is tolerated
+EDGE_EPSILON = 1e-4
+# Same hit, the distance may differ in the last bits
+T_EPSILON = 1e-4
+
+
+def cast_hit_set(kernels, fileName, rayCount):
+    """Cast the rays of castHitSet with the given kernels. Runs in a child process, the kernels are picked once per process"""
+    dll = ctypes.CDLL(RENDERER_LIB_FULL_PATH)
+    dll.castSceneHitSet.argtypes = [ctypes.c_char_p, ctypes.c_int] + [ctypes.POINTER(ctypes.c_int)] * 3 + [ctypes.POINTER(ctypes.c_float)] * 3 + [ctypes.POINTER(ctypes.c_int)]
+    dll.castSceneHitSet.restype = ctypes.c_int
+    dll.getSIMDKernelsName.restype = ctypes.c_char_p
+
+    objects, instances, occluded = [(ctypes.c_int * rayCount)() for _ in range(3)]
+    triangles = (ctypes.c_int * (3 * rayCount))()
+    t, u, v = [(ctypes.c_float * rayCount)() for _ in range(3)]
+    loaded = dll.castSceneHitSet(bytes(fileName, sys.getfilesystemencoding()), rayCount, objects, instances, triangles, t, u, v, occluded)
+    return {
+        'kernels': dll.getSIMDKernelsName().decode(),
+        'loaded': bool(loaded),
+        # object, instance, triangle vertices, t, u, v, occluded
+        'hits': [[objects[i], instances[i], list(triangles[3 * i:3 * i + 3]), t[i], u[i], v[i], occluded[i]] for i in range(rayCount)],
+    }
+
+
+def run_kernels(kernels, fileName, rayCount):
+    env = dict(os.environ, CHAOS_SIMD_KERNELS=kernels)
+    output = subprocess.run([sys.executable, __file__, '--cast', kernels, fileName, str(rayCount)], env=env, check=True, capture_output=True, text=True).stdout
+    return json.loads(output.splitlines()[-1])
+
+
+def near_edge(hit):
+    u, v = hit[4], hit[5]
+    return min(u, v, 1 - u - v) <= EDGE_EPSILON
+
+
+def edge_graze(a, b):
+    hits = sorted((hit for hit in (a, b) if hit[0] >= 0), key=lambda hit: hit[3])
+    if not hits:
+        return False
+    if len(hits) == 2 and abs(hits[0][3] - hits[1][3]) <= T_EPSILON * max(hits[0][3], 1):
+        return near_edge(hits[0]) and near_edge(hits[1])
+    return near_edge(hits[0])
+
+
+def compare(reference, hits, watertight):
+    """Indices of the rays whose hits differ, and how many of them are tolerated edge grazes"""
+    failed, grazes = [], 0
+    for i, (a, b) in enumerate(zip(reference, hits)):
+        if watertight:
+            # The watertight test has no FMA and no rounding that depends on the set, the hits must be bit-identical
+            if a != b:
+                failed.append(i)
+            continue
+        same = a[:3] == b[:3] and abs(a[3] - b[3]) <= T_EPSILON * max(a[3], 1) and a[6] == b[6]
+        if same:
+            continue
+        if edge_graze(a, b):
+            grazes += 1
+        else:
+            failed.append(i)
+    return failed, grazes
+
+
+def with_watertight(fileName, watertight):
+    """Copy of the scene with the watertight setting of its BVHs forced"""
+    with open(fileName) as f:
+        scene = json.load(f)
+    scene.setdefault('settings', {}).setdefault('bvh', {})['watertight'] = watertight
+    copy = tempfile.NamedTemporaryFile('w', suffix='.crtscene', delete=False)
+    with copy:
+        json.dump(scene, copy)
+    return copy.name
+
+
+def check_scene(fileName, rayCount):
+    ok = True
+    for watertight in (False, True):
+        sceneCopy = with_watertight(fileName, watertight)
+        try:
+            reference = run_kernels('scalar', sceneCopy, rayCount)
+            if not reference['loaded']:
+                print(f"{fileName}: the scene has no objects")
+                return False
+            layout = 'watertight' if watertight else 'default'
+            for kernels, name in KERNEL_SETS[1:]:
+                result = run_kernels(kernels, sceneCopy, rayCount)
+                if result['kernels'] != name:
+                    print(f"{fileName} ({layout}): {name} not supported by this CPU, skipped")
+                    continue
+                failed, grazes = compare(reference['hits'], result['hits'], watertight)
+                print(f"{fileName} ({layout}): {name} vs scalar, {rayCount} rays, {len(failed)} different hits, {grazes} tolerated edge grazes")
+                for i in failed[:5]:
+                    print(f"  ray {i}: scalar {reference['hits'][i]}, {name} {result['hits'][i]}")
+                ok = ok and not failed
+        finally:
+            os.remove(sceneCopy)
+    return ok
+
+
+if __name__ == '__main__':
+    if len(sys.argv) > 1 and sys.argv[1] == '--cast':
+        print(json.dumps(cast_hit_set(sys.argv[2], sys.argv[3], int(sys.argv[4]))))
+    elif len(sys.argv) < 2:
+        print("Usage: python check_simd_kernels.py <fileName> [ray_count]")
+    else:
+        rayCount = int(sys.argv[2]) if len(sys.argv) > 2 else 20000
+        sys.exit(0 if check_scene(sys.argv[1], rayCount) else 1)
@@ -26,9 +26,45 @@ VIEWPORT_HEIGHT = 1080
 VIEWPORT_CHANNELS = 4
 
 dll = ctypes.CDLL(RENDERER_LIB_FULL_PATH)
-dll.render.argtypes = [ctypes.POINTER(ctypes.c_float), ctypes.c_float]
-dll.renderCamera.argtypes = [ctypes.POINTER(ctypes.c_float)] + [ctypes.c_float] * 7
-dll.renderFile.argtypes = [ctypes.POINTER(ctypes.c_float), ctypes.c_char_p]
+dll.createRenderSession.argtypes = [ctypes.c_char_p, ctypes.c_int]
+dll.createRenderSession.restype = ctypes.c_void_p
+dll.destroyRenderSession.argtypes = [ctypes.c_void_p]
+dll.setSessionCamera.argtypes = [ctypes.c_void_p] + [ctypes.c_float] * 7
+dll.setSessionSettings.argtypes = [ctypes.c_void_p] + [ctypes.c_int] * 4
+dll.renderSession.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_float)]
+ProgressivePassCallback = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.POINTER(ctypes.c_float), ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_double, ctypes.c_double, ctypes.c_void_p)
+dll.renderSessionProgressive.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_float), ctypes.c_int, ProgressivePassCallback, ctypes.c_void_p]
+dll.getLastRenderStats.argtypes = [ctypes.POINTER(ctypes.c_double), ctypes.POINTER(ctypes.c_ulonglong), ctypes.POINTER(ctypes.c_ulonglong), ctypes.POINTER(ctypes.c_double)]
+dll.getLastRenderThreadStats.argtypes = [ctypes.c_int, ctypes.POINTER(ctypes.c_double)] + [ctypes.POINTER(ctypes.c_ulonglong)] * 3
+
+# The scene is loaded into a render session once, and its BVHs are kept, so slider drags only trace it again.
+# The session pays for the SAH builder once, for the fastest tracing.
+DEFAULT_SCENE = 'D:/dev/raytracing_2023/scenes/scene3.crtscene'
+BVH_BUILDER_SAH = 1
+INTEGRATOR_FROM_SCENE = -1
+
+# Renders are progressive, with this many GI rays per diffuse hit in each pass. Slider drags only show the first pass,
+# the Render button renders passes until one changes the image by less than PROGRESSIVE_STOP_RMS.
+PASS_GI_RAYS = 8
+PROGRESSIVE_STOP_RMS = 0.005
+
+
+def print_render_stats():
+    render_ms, shadow_ms = ctypes.c_double(), ctypes.c_double()
+    primary_rays, shadow_rays = ctypes.c_ulonglong(), ctypes.c_ulonglong()
+    dll.getLastRenderStats(ctypes.byref(render_ms), ctypes.byref(primary_rays), ctypes.byref(shadow_rays), ctypes.byref(shadow_ms))
+    # Shadow ray time is summed over the render threads
+    print(f'Render {render_ms.value:.0f} ms, {primary_rays.value} primary rays, '
+          f'{shadow_rays.value} shadow rays in {shadow_ms.value:.0f} ms of thread time')
+    busy_ms, buckets, steals, splits = ctypes.c_double(), ctypes.c_ulonglong(), ctypes.c_ulonglong(), ctypes.c_ulonglong()
+    utilization = []
+    total_steals, total_splits = 0, 0
+    for thread in range(dll.getLastRenderThreadCount()):
+        dll.getLastRenderThreadStats(thread, ctypes.byref(busy_ms), ctypes.byref(buckets), ctypes.byref(steals), ctypes.byref(splits))
+        utilization.append(f'{100 * busy_ms.value / max(render_ms.value, 1e-3):.0f}%')
+        total_steals += steals.value
+        total_splits += splits.value
+    print(f'Render threads busy {" ".join(utilization)}, {total_steals} buckets stolen, {total_splits} split')
 
 
 class CodeTimer:
@@ -88,17 +124,15 @@ class App(customtkinter.CTk):
         self.sidebar_button_2 = customtkinter.CTkButton(self.sidebar_frame, text='Load scene', command=self.load_scene_event)
         self.sidebar_button_2.grid(row=9, column=0, padx=20, pady=10)
 
-        with CodeTimer('renderCamera'):
-            self.c_buffer = (ctypes.c_float * (VIEWPORT_WIDTH * VIEWPORT_HEIGHT * VIEWPORT_CHANNELS))()
-            x = self.sliders['x'].slider.get()
-            y = self.sliders['y'].slider.get()
-            z = self.sliders['z'].slider.get()
-            fov = self.sliders['fov'].slider.get()
-            pan = self.sliders['pan'].slider.get()
-            tilt = self.sliders['tilt'].slider.get()
-            roll = self.sliders['roll'].slider.get()
+        self.session = None
+        with CodeTimer('createRenderSession'):
+            self.open_session(DEFAULT_SCENE)
 
-            dll.renderCamera(self.c_buffer, x, y, z, fov, pan, tilt, roll)
+        with CodeTimer('renderSession'):
+            self.c_buffer = (ctypes.c_float * (VIEWPORT_WIDTH * VIEWPORT_HEIGHT * VIEWPORT_CHANNELS))()
+            self.set_session_camera()
+            if self.session:
+                dll.renderSession(self.session, self.c_buffer)
 
             np_array = np.frombuffer(self.c_buffer, dtype=np.float32)
             np_array = np_array.reshape((VIEWPORT_HEIGHT, VIEWPORT_WIDTH, VIEWPORT_CHANNELS))
@@ -117,7 +151,7 @@ class App(customtkinter.CTk):
         slider.pack(padx=(20, 10), pady=(10, 10))
         def command(val):
             label.configure(require_redraw=True, text=f'{name}: {val:.0f}')
-            self.render_button_event()
+            self.render_camera(preview=True)
         slider.configure(command=command)
         slider.set(v)
         class Slider(object):
@@ -127,7 +161,19 @@ class App(customtkinter.CTk):
         slider_obj.label = label
         self.sliders[name] = slider_obj
 
-    def render_button_event(self):
+    def open_session(self, fileName):
+        if self.session:
+            dll.destroyRenderSession(self.session)
+        self.session = dll.createRenderSession(ctypes.c_char_p(bytes(fileName, sys.getfilesystemencoding())), BVH_BUILDER_SAH)
+        if not self.session:
+            print(f'Could not load {fileName}')
+            return
+        # Render into the viewport buffer, whatever the size in the scene file
+        dll.setSessionSettings(self.session, VIEWPORT_WIDTH, VIEWPORT_HEIGHT, INTEGRATOR_FROM_SCENE, 0)
+
+    def set_session_camera(self):
+        if not self.session:
+            return
         x = self.sliders['x'].slider.get()
         y = self.sliders['y'].slider.get()
         z = self.sliders['z'].slider.get()
@@ -135,10 +181,29 @@ class App(customtkinter.CTk):
         pan = self.sliders['pan'].slider.get()
         tilt = self.sliders['tilt'].slider.get()
         roll = self.sliders['roll'].slider.get()
+        dll.setSessionCamera(self.session, x, y, z, fov, pan, tilt, roll)
 
-        with CodeTimer('renderCamera'):
-            dll.renderCamera(self.c_buffer, x, y, z, fov, pan, tilt, roll)
-
+    def render_button_event(self):
+        self.render_camera(preview=False)
+
+    def render_camera(self, preview):
+        if not self.session:
+            return
+        self.set_session_camera()
+
+        # Runs on this thread between the passes
+        def on_pass(pixels, index, pass_count, gi_rays, pass_ms, rms_change, user_data):
+            self.show_buffer()
+            self.update_idletasks()
+            if not preview:
+                print(f'Pass {index + 1}/{pass_count}: {gi_rays} GI rays, {pass_ms:.0f} ms, changed by {rms_change:.4f}')
+            return int(not preview and (index == 0 or rms_change >= PROGRESSIVE_STOP_RMS))
+
+        with CodeTimer('renderSessionProgressive'):
+            dll.renderSessionProgressive(self.session, self.c_buffer, PASS_GI_RAYS, ProgressivePassCallback(on_pass), None)
+        print_render_stats()
+
+    def show_buffer(self):
         np_array = np.frombuffer(self.c_buffer, dtype=np.float32)
         np_array = np_array.reshape((VIEWPORT_HEIGHT, VIEWPORT_WIDTH, VIEWPORT_CHANNELS))
         np_array = np.clip(np_array, 0, 1)
@@ -156,14 +221,14 @@ class App(customtkinter.CTk):
             filetypes=filetypes
         )
 
+        # With the camera of the scene, until a slider is moved
+        with CodeTimer(f'Load {fileName}'):
+            self.open_session(fileName)
+        if not self.session:
+            return
         with CodeTimer(f'Render {fileName}'):
-            dll.renderFile(self.c_buffer, ctypes.c_char_p(bytes(fileName, sys.getfilesystemencoding())))
-
-        np_array = np.frombuffer(self.c_buffer, dtype=np.float32)
-        np_array = np_array.reshape((VIEWPORT_HEIGHT, VIEWPORT_WIDTH, VIEWPORT_CHANNELS))
-        np_array = np.clip(np_array, 0, 1)
-        self.pixels = Image.fromarray((np_array * 255).astype(np.uint8))
-        self.img.paste(self.pixels)
+            dll.renderSession(self.session, self.c_buffer)
+        self.show_buffer()
 
     def set_color_button_event(self):
         pick_color = AskColor() # Open the Color Picker
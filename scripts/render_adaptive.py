@@ -0,0 +1,68 @@
+import numpy as np
+from PIL import Image
+
+import ctypes
+import distutils.ccompiler
+import os
+import sys
+
+# Check for CHAOS_RAYTRACING_LIB_PATH env. variable, and use that if availbale
+# Otherwise, try to load from the default install location
+RENDERER_LIB_FNAME = 'renderer_lib' + distutils.ccompiler.new_compiler().shared_lib_extension
+RENDERER_LIB_PATH = os.path.abspath(os.getenv('CHAOS_RAYTRACING_LIB_PATH', default=os.path.join(os.path.dirname(__file__), os.path.pardir, 'install', 'lib')))
+RENDERER_LIB_FULL_PATH = os.path.join(RENDERER_LIB_PATH, RENDERER_LIB_FNAME)
+
+dll = ctypes.CDLL(RENDERER_LIB_FULL_PATH)
+dll.createRenderSession.argtypes = [ctypes.c_char_p, ctypes.c_int]
+dll.createRenderSession.restype = ctypes.c_void_p
+dll.destroyRenderSession.argtypes = [ctypes.c_void_p]
+dll.getSessionSize.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_int), ctypes.POINTER(ctypes.c_int)]
+dll.setSessionNoiseThreshold.argtypes = [ctypes.c_void_p, ctypes.c_float]
+ProgressivePassCallback = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.POINTER(ctypes.c_float), ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_double, ctypes.c_double, ctypes.c_void_p)
+dll.renderSessionProgressive2.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_float), ctypes.POINTER(ctypes.c_int), ctypes.c_int, ProgressivePassCallback, ctypes.c_void_p]
+
+BVH_BUILDER_FROM_SCENE = -1
+
+
+def render_adaptive(fileName, noise_threshold, pass_gi_rays):
+    """Render the scene with adaptive sampling, and save the image and the number of passes of every pixel next to it."""
+    session = dll.createRenderSession(ctypes.c_char_p(bytes(fileName, sys.getfilesystemencoding())), BVH_BUILDER_FROM_SCENE)
+    if not session:
+        print(f'Could not load {fileName}')
+        return
+    c_width, c_height = ctypes.c_int(), ctypes.c_int()
+    dll.getSessionSize(session, ctypes.byref(c_width), ctypes.byref(c_height))
+    width, height = c_width.value, c_height.value
+    if noise_threshold is not None:
+        dll.setSessionNoiseThreshold(session, noise_threshold)
+
+    def on_pass(pixels, index, pass_count, gi_rays, pass_ms, rms_change, user_data):
+        print(f'Pass {index + 1}/{pass_count}: {gi_rays} GI rays, {pass_ms:.0f} ms, changed by {rms_change:.4f}')
+        return 1
+
+    c_buffer = (ctypes.c_float * (width * height * 4))()
+    c_samples = (ctypes.c_int * (width * height))()
+    dll.renderSessionProgressive2(session, c_buffer, c_samples, pass_gi_rays, ProgressivePassCallback(on_pass), None)
+    dll.destroyRenderSession(session)
+
+    output_folder = os.path.join(os.path.dirname(fileName), 'output')
+    os.makedirs(output_folder, exist_ok=True)
+    output_name = os.path.join(output_folder, os.path.splitext(os.path.basename(fileName))[0])
+
+    np_array = np.frombuffer(c_buffer, dtype=np.float32).reshape((height, width, 4))
+    np_array = np.clip(np_array, 0, 1)
+    Image.fromarray((np_array * 255).astype(np.uint8)).save(output_name + '.png')
+
+    # Brightest where the most passes were rendered
+    samples = np.frombuffer(c_samples, dtype=np.int32).reshape((height, width))
+    print(f'Passes per pixel: {samples.min()} to {samples.max()}, {samples.mean():.1f} on average')
+    Image.fromarray((samples * 255 // max(samples.max(), 1)).astype(np.uint8)).save(output_name + '_samples.png')
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print("Usage: python render_adaptive.py <fileName> [noise_threshold] [pass_gi_rays]")
+    else:
+        noise_threshold = float(sys.argv[2]) if len(sys.argv) > 2 else None
+        pass_gi_rays = int(sys.argv[3]) if len(sys.argv) > 3 else 8
+        render_adaptive(sys.argv[1], noise_threshold, pass_gi_rays)
@@ -0,0 +1,369 @@
+#include "bvh_cache.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::string& fileName)
+{
+#ifdef _WIN32
+    HANDLE fileHandle = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (fileHandle == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    file = fileHandle;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0) {
+        return;
+    }
+    mapping = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping) {
+        return;
+    }
+    data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data) {
+        size = size_t(fileSize.QuadPart);
+    }
+#else
+    const int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == 0 && fileStat.st_size > 0) {
+        void* mapped = mmap(nullptr, size_t(fileStat.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            data = (const uint8_t*)mapped;
+            size = size_t(fileStat.st_size);
+        }
+    }
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+    if (data) UnmapViewOfFile(data);
+    if (mapping) CloseHandle(mapping);
+    if (file) CloseHandle(file);
+#else
+    if (data) munmap((void*)data, size);
+#endif
+}
+
+// Bump when the layout of the cache file or of the cached structures changes
+const uint32_t BVH_CACHE_VERSION = 4;
+const char BVH_CACHE_MAGIC[8] = { 'C', 'R', 'T', 'B', 'V', 'H', '\0', '\0' };
+
+// Sections start at multiples of this, so they are aligned for any of the cached structures
+const size_t BVH_CACHE_ALIGNMENT = 64;
+
+struct BVHCacheHeader {
+    char magic[8];
+    uint32_t version;
+    // Triangles per leaf pack
+    uint32_t packWidth;
+    uint64_t key;
+    uint64_t triangleCount;
+    uint64_t nodeCount;
+    // In LeafPackBlocks
+    uint64_t leafPackCount;
+    uint64_t wideNodeCount;
+    uint64_t compressedNodeCount;
+};
+
+size_t alignCacheOffset(size_t offset)
+{
+    return (offset + BVH_CACHE_ALIGNMENT - 1) / BVH_CACHE_ALIGNMENT * BVH_CACHE_ALIGNMENT;
+}
+
+std::string getCacheFileName(const std::string& directory, uint64_t key)
+{
+    std::ostringstream name;
+    name << std::hex << key << ".bvh";
+    return (std::filesystem::path(directory) / name.str()).string();
+}
+
+const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+const uint64_t FNV_PRIME = 1099511628211ull;
+
+uint64_t fnv1aHash(const void* data, size_t size, uint64_t hash)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+template <typename T>
+uint64_t fnv1aHash(const T& value, uint64_t hash)
+{
+    return fnv1aHash(&value, sizeof(T), hash);
+}
+
+std::string BVHCache::getDirectory(const BVHBuildSettings& settings)
+{
+    if (!settings.cacheDirectory.empty()) {
+        return settings.cacheDirectory;
+    }
+    const char* directory = std::getenv(DIRECTORY_ENV_VAR);
+    return directory ? directory : "";
+}
+
+uint64_t BVHCache::computeKey(const Object& object)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    // Vector has padding, hash only the coordinates
+    const uint64_t vertexCount = object.vertices.size();
+    hash = fnv1aHash(vertexCount, hash);
+    for (const Vector& v : object.vertices) {
+        hash = fnv1aHash(v.v, sizeof(v.v), hash);
+    }
+    const uint64_t triangleCount = object.triangles.size();
+    hash = fnv1aHash(triangleCount, hash);
+    hash = fnv1aHash(object.triangles.data(), object.triangles.size() * sizeof(Triangle), hash);
+
+    // The thread count, the refit threshold and the directory don't change the tree
+    const BVHBuildSettings& settings = object.buildSettings;
+    hash = fnv1aHash(settings.mode, hash);
+    hash = fnv1aHash(settings.binCount, hash);
+    hash = fnv1aHash(settings.traversalCost, hash);
+    hash = fnv1aHash(settings.intersectionCost, hash);
+    hash = fnv1aHash(settings.minLeafSize, hash);
+    hash = fnv1aHash(settings.maxLeafSize, hash);
+    hash = fnv1aHash(settings.wide, hash);
+    hash = fnv1aHash(settings.compressed, hash);
+    hash = fnv1aHash(settings.watertight, hash);
+
+    // The leaf sizes depend on the pack width of the SIMD kernels, keep the builds for each width apart
+    const int32_t packWidth = getSIMDKernels().packWidth;
+    hash = fnv1aHash(packWidth, hash);
+    return hash;
+}
+
+bool BVHCache::load(Object& object, const std::string& directory, uint64_t key)
+{
+    MappedFile file(getCacheFileName(directory, key));
+    if (!file.isOpen() || file.getSize() < sizeof(BVHCacheHeader)) {
+        return false;
+    }
+
+    BVHCacheHeader header;
+    std::memcpy(&header, file.getData(), sizeof(header));
+    if (std::memcmp(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != BVH_CACHE_VERSION ||
+        header.packWidth != uint32_t(getSIMDKernels().packWidth) ||
+        header.key != key ||
+        header.triangleCount != object.triangles.size()) {
+        return false;
+    }
+
+    // Validate the size before touching any of the sections
+    const size_t trianglesOffset = alignCacheOffset(sizeof(BVHCacheHeader));
+    const size_t nodesOffset = alignCacheOffset(trianglesOffset + header.triangleCount * sizeof(Triangle));
+    const size_t leafPacksOffset = alignCacheOffset(nodesOffset + header.nodeCount * sizeof(BVHNode));
+    const size_t wideNodesOffset = alignCacheOffset(leafPacksOffset + header.leafPackCount * sizeof(LeafPackBlock));
+    const size_t compressedNodesOffset = alignCacheOffset(wideNodesOffset + header.wideNodeCount * sizeof(WideBVHNode));
+    const size_t fileSize = compressedNodesOffset + header.compressedNodeCount * sizeof(CompressedWideBVHNode);
+    // The counts are checked against the file first, so that the offsets can't overflow
+    if (header.nodeCount > file.getSize() / sizeof(BVHNode) ||
+        header.leafPackCount > file.getSize() / sizeof(LeafPackBlock) ||
+        header.wideNodeCount > file.getSize() / sizeof(WideBVHNode) ||
+        header.compressedNodeCount > file.getSize() / sizeof(CompressedWideBVHNode) ||
+        file.getSize() < fileSize) {
+        return false;
+    }
+
+    // Kept to be restored if the file is rejected, the BVH is then built for the original order
+    std::vector<Triangle> builtTriangles = object.triangles;
+    const uint8_t* data = file.getData();
+    auto readSection = [&](auto& section, size_t offset, uint64_t count) {
+        section.resize(count);
+        if (count > 0) {
+            std::memcpy(section.data(), data + offset, count * sizeof(section[0]));
+        }
+    };
+    readSection(object.triangles, trianglesOffset, header.triangleCount);
+    readSection(object.bvh, nodesOffset, header.nodeCount);
+    readSection(object.leafPacks, leafPacksOffset, header.leafPackCount);
+    object.packWidth = int(header.packWidth);
+    readSection(object.wideBVH, wideNodesOffset, header.wideNodeCount);
+    readSection(object.compressedBVH, compressedNodesOffset, header.compressedNodeCount);
+
+    if (!isValid(object)) {
+        std::cerr << "Warning: Invalid BVH cache file " << getCacheFileName(directory, key) << ", rebuilding it\n";
+        object.triangles = std::move(builtTriangles);
+        object.bvh.clear();
+        object.leafPacks.clear();
+        object.wideBVH.clear();
+        object.compressedBVH.clear();
+        return false;
+    }
+    return true;
+}
+
+// Children must come after their parent and be reached once, so the trees have no cycles,
+// and be less than BVH_STACK_SIZE levels deep, so that the traversal stacks don't overflow
+template <typename Node, typename ForChildren>
+bool isValidTree(const std::vector<Node>& nodes, ForChildren forChildren)
+{
+    if (nodes.empty()) {
+        return true;
+    }
+    std::vector<int> depth(nodes.size(), -1);
+    depth[0] = 0;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (depth[i] < 0) {
+            continue;
+        }
+        const bool valid = forChildren(nodes[i], [&](int child) {
+            if (child <= int(i) || child >= int(nodes.size()) || depth[child] >= 0 || depth[i] + 1 >= BVH_STACK_SIZE) {
+                return false;
+            }
+            depth[child] = depth[i] + 1;
+            return true;
+        });
+        if (!valid) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BVHCache::isValid(const Object& object)
+{
+    const int vertexCount = int(object.vertices.size());
+    for (const Triangle& triangle : object.triangles) {
+        if (triangle.v1 < 0 || triangle.v1 >= vertexCount || triangle.v2 < 0 || triangle.v2 >= vertexCount ||
+            triangle.v3 < 0 || triangle.v3 >= vertexCount) {
+            return false;
+        }
+    }
+
+    // Traversal starts at node 0
+    if (object.bvh.empty()) {
+        return false;
+    }
+
+    // Every leaf, reached or not, since the wide nodes point to the leaves of the binary BVH
+    const int blocksPerPack = object.leafPackBlocks();
+    const int64_t blockCount = int64_t(object.leafPacks.size());
+    const int triangleCount = int(object.triangles.size());
+    for (const BVHNode& node : object.bvh) {
+        if (!node.isLeaf()) {
+            continue;
+        }
+        if (node.count > triangleCount || node.leftFirst < 0 || node.leftFirst + int64_t(object.leafPackCount(node.count)) * blocksPerPack > blockCount) {
+            return false;
+        }
+        for (int first = 0, block = node.leftFirst; first < node.count; first += object.packWidth, block += blocksPerPack) {
+            const LeafPackInfo info = object.getLeafPackInfo(block);
+            if (info.count < 1 || info.count > object.packWidth || info.firstTriangle < 0 || info.firstTriangle > triangleCount - info.count) {
+                return false;
+            }
+            // The kernels test every lane, the unused ones must repeat the last triangle so that they never report a hit of their own
+            const float* pack = object.leafPacks[block].data;
+            for (int lane = info.count; lane < object.packWidth; ++lane) {
+                for (int value = 0; value < 9; ++value) {
+                    const float* values = pack + value * object.packWidth;
+                    if (std::memcmp(&values[lane], &values[info.count - 1], sizeof(float)) != 0) {
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    const bool validBVH = isValidTree(object.bvh, [](const BVHNode& node, auto visitChild) {
+        return node.isLeaf() || (visitChild(node.leftFirst) && visitChild(node.leftFirst + 1));
+    });
+
+    // Leaf children are the bitwise negated index of a binary node, unused slots ~0
+    const int binaryNodeCount = int(object.bvh.size());
+    auto wideChildren = [&](const auto& node, auto visitChild) {
+        for (int child : node.child) {
+            if (child < 0 ? ~child >= binaryNodeCount : !visitChild(child)) {
+                return false;
+            }
+        }
+        return true;
+    };
+    return validBVH && isValidTree(object.wideBVH, wideChildren) && isValidTree(object.compressedBVH, wideChildren);
+}
+
+void BVHCache::save(const Object& object, const std::string& directory, uint64_t key)
+{
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+
+    BVHCacheHeader header{};
+    std::memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = BVH_CACHE_VERSION;
+    header.packWidth = uint32_t(object.packWidth);
+    header.key = key;
+    header.triangleCount = object.triangles.size();
+    header.nodeCount = object.bvh.size();
+    header.leafPackCount = object.leafPacks.size();
+    header.wideNodeCount = object.wideBVH.size();
+    header.compressedNodeCount = object.compressedBVH.size();
+
+    // Write to a temporary file and rename it, so that concurrent renders
+    // never map a partially written file
+    const std::string fileName = getCacheFileName(directory, key);
+    std::ostringstream tempFileName;
+    tempFileName << fileName << '.' << std::hash<std::thread::id>{}(std::this_thread::get_id())
+        << '.' << std::chrono::steady_clock::now().time_since_epoch().count();
+
+    {
+        std::ofstream out(tempFileName.str(), std::ios::binary);
+        if (!out) {
+            std::cerr << "Warning: Can't write BVH cache file " << tempFileName.str() << '\n';
+            return;
+        }
+        size_t offset = 0;
+        auto writeSection = [&](const void* data, size_t size) {
+            static const char padding[BVH_CACHE_ALIGNMENT] = {};
+            const size_t alignedOffset = alignCacheOffset(offset);
+            out.write(padding, alignedOffset - offset);
+            out.write((const char*)data, size);
+            offset = alignedOffset + size;
+        };
+        writeSection(&header, sizeof(header));
+        writeSection(object.triangles.data(), object.triangles.size() * sizeof(Triangle));
+        writeSection(object.bvh.data(), object.bvh.size() * sizeof(BVHNode));
+        writeSection(object.leafPacks.data(), object.leafPacks.size() * sizeof(LeafPackBlock));
+        writeSection(object.wideBVH.data(), object.wideBVH.size() * sizeof(WideBVHNode));
+        writeSection(object.compressedBVH.data(), object.compressedBVH.size() * sizeof(CompressedWideBVHNode));
+        if (!out) {
+            out.close();
+            std::filesystem::remove(tempFileName.str(), error);
+            std::cerr << "Warning: Can't write BVH cache file " << tempFileName.str() << '\n';
+            return;
+        }
+    }
+
+    std::filesystem::rename(tempFileName.str(), fileName, error);
+    if (error) {
+        std::filesystem::remove(tempFileName.str(), error);
+    }
+}
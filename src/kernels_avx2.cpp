@@ -0,0 +1,331 @@
+#include "simd_kernels.h"
+
+#include <immintrin.h>
+
+// 8-wide kernels, leaf packs of 8 triangles and wide nodes at once.
+// Constants are created inside the functions, a global __m256 would be
+// initialized with AVX instructions at load time, even on CPUs without AVX.
+
+const float KERNEL_EPSILON = 1e-9f;
+
+static void cross8(__m256 result[3], const __m256 a[3], const __m256 b[3])
+{
+    result[0] = _mm256_fmsub_ps(a[1], b[2], _mm256_mul_ps(b[1], a[2]));
+    result[1] = _mm256_fmsub_ps(a[2], b[0], _mm256_mul_ps(b[2], a[0]));
+    result[2] = _mm256_fmsub_ps(a[0], b[1], _mm256_mul_ps(b[0], a[1]));
+}
+
+static __m256 dot8(const __m256 a[3], const __m256 b[3])
+{
+    return _mm256_fmadd_ps(a[2], b[2], _mm256_fmadd_ps(a[1], b[1], _mm256_mul_ps(a[0], b[0])));
+}
+
+// Moller-Trumbore test of 8 ray-triangle pairs, returns the mask of pairs not hit before maxT
+static __m256 missedAVX2(const __m256 origin[3], const __m256 dir[3], const __m256 v0[3], const __m256 e1[3], const __m256 e2[3],
+    bool backface, __m256 maxT, __m256& t, __m256& u, __m256& v)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 backfaceMask = backface ? zero : _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+    __m256 h[3];
+    cross8(h, dir, e2);
+    const __m256 d = dot8(e1, h);
+    const __m256 f = _mm256_div_ps(one, d);
+    const __m256 s[3] = { _mm256_sub_ps(origin[0], v0[0]), _mm256_sub_ps(origin[1], v0[1]), _mm256_sub_ps(origin[2], v0[2]) };
+    u = _mm256_mul_ps(f, dot8(s, h));
+    __m256 q[3];
+    cross8(q, s, e1);
+    v = _mm256_mul_ps(f, dot8(dir, q));
+    t = _mm256_mul_ps(f, dot8(e2, q));
+
+    // Parallel to the triangle, or hitting its back side when culling back faces
+    __m256 failed = _mm256_and_ps(
+        _mm256_or_ps(_mm256_cmp_ps(d, _mm256_set1_ps(-KERNEL_EPSILON), _CMP_GT_OQ), backfaceMask),
+        _mm256_cmp_ps(d, _mm256_set1_ps(KERNEL_EPSILON), _CMP_LT_OQ));
+    failed = _mm256_or_ps(failed, _mm256_cmp_ps(u, zero, _CMP_LT_OQ));
+    failed = _mm256_or_ps(failed, _mm256_cmp_ps(v, zero, _CMP_LT_OQ));
+    failed = _mm256_or_ps(failed, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_GT_OQ));
+    failed = _mm256_or_ps(failed, _mm256_cmp_ps(t, zero, _CMP_LT_OQ));
+    failed = _mm256_or_ps(failed, _mm256_cmp_ps(t, maxT, _CMP_GE_OQ));
+    return failed;
+}
+
+// The ray against the 8 lanes of a pack
+static __m256 missedLanesAVX2(const KernelRay& ray, const float* pack, bool backface, float maxT, __m256& t, __m256& u, __m256& v)
+{
+    const __m256 origin[3] = { _mm256_set1_ps(ray.origin[0]), _mm256_set1_ps(ray.origin[1]), _mm256_set1_ps(ray.origin[2]) };
+    const __m256 dir[3] = { _mm256_set1_ps(ray.dir[0]), _mm256_set1_ps(ray.dir[1]), _mm256_set1_ps(ray.dir[2]) };
+    const __m256 v0[3] = { _mm256_load_ps(pack), _mm256_load_ps(pack + 8), _mm256_load_ps(pack + 16) };
+    const __m256 e1[3] = { _mm256_load_ps(pack + 24), _mm256_load_ps(pack + 32), _mm256_load_ps(pack + 40) };
+    const __m256 e2[3] = { _mm256_load_ps(pack + 48), _mm256_load_ps(pack + 56), _mm256_load_ps(pack + 64) };
+    return missedAVX2(origin, dir, v0, e1, e2, backface, _mm256_set1_ps(maxT), t, u, v);
+}
+
+static bool intersectLeafPackAVX2(const KernelRay& ray, const float* pack, int /*count*/, bool backface, KernelHit& hit)
+{
+    __m256 t, u, v;
+    const __m256 failed = missedLanesAVX2(ray, pack, backface, hit.t, t, u, v);
+    if (_mm256_movemask_ps(failed) == 0xFF) {
+        return false;
+    }
+    // Failed lanes are pushed past any hit, so the closest lane wins
+    alignas(32) float tLanes[8], uLanes[8], vLanes[8];
+    _mm256_store_ps(tLanes, _mm256_blendv_ps(t, _mm256_set1_ps(1e30f), failed));
+    _mm256_store_ps(uLanes, u);
+    _mm256_store_ps(vLanes, v);
+    bool found = false;
+    for (int i = 0; i < 8; ++i) {
+        if (tLanes[i] < hit.t) {
+            hit = { tLanes[i], uLanes[i], vLanes[i], i };
+            found = true;
+        }
+    }
+    return found;
+}
+
+static bool occludedLeafPackAVX2(const KernelRay& ray, const float* pack, int /*count*/, bool backface, float maxT)
+{
+    __m256 t, u, v;
+    return _mm256_movemask_ps(missedLanesAVX2(ray, pack, backface, maxT, t, u, v)) != 0xFF;
+}
+
+// Watertight test of the ray against the 8 lanes of a vertex pack, returns the mask of lanes not hit before maxT.
+// No FMA, see SIMDKernels::intersectLeafPackWatertight
+static __m256 missedLanesWatertightAVX2(const KernelRay& ray, const float* pack, bool backface, float maxT, __m256& t, __m256& u, __m256& v)
+{
+    const int kx = ray.shearAxes[0];
+    const int ky = ray.shearAxes[1];
+    const int kz = ray.shearAxes[2];
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 originX = _mm256_set1_ps(ray.origin[kx]);
+    const __m256 originY = _mm256_set1_ps(ray.origin[ky]);
+    const __m256 originZ = _mm256_set1_ps(ray.origin[kz]);
+    const __m256 shearX = _mm256_set1_ps(ray.shear[0]);
+    const __m256 shearY = _mm256_set1_ps(ray.shear[1]);
+
+    // The vertices relative to the origin, sheared so that the ray is the +z axis
+    const __m256 az = _mm256_sub_ps(_mm256_load_ps(pack + kz * 8), originZ);
+    const __m256 bz = _mm256_sub_ps(_mm256_load_ps(pack + 24 + kz * 8), originZ);
+    const __m256 cz = _mm256_sub_ps(_mm256_load_ps(pack + 48 + kz * 8), originZ);
+    const __m256 ax = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(pack + kx * 8), originX), _mm256_mul_ps(shearX, az));
+    const __m256 ay = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(pack + ky * 8), originY), _mm256_mul_ps(shearY, az));
+    const __m256 bx = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(pack + 24 + kx * 8), originX), _mm256_mul_ps(shearX, bz));
+    const __m256 by = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(pack + 24 + ky * 8), originY), _mm256_mul_ps(shearY, bz));
+    const __m256 cx = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(pack + 48 + kx * 8), originX), _mm256_mul_ps(shearX, cz));
+    const __m256 cy = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(pack + 48 + ky * 8), originY), _mm256_mul_ps(shearY, cz));
+
+    // Edge functions, the barycentrics scaled by det. The ray misses if they have different signs
+    const __m256 e0 = _mm256_sub_ps(_mm256_mul_ps(cx, by), _mm256_mul_ps(cy, bx));
+    const __m256 e1 = _mm256_sub_ps(_mm256_mul_ps(ax, cy), _mm256_mul_ps(ay, cx));
+    const __m256 e2 = _mm256_sub_ps(_mm256_mul_ps(bx, ay), _mm256_mul_ps(by, ax));
+    const __m256 anyNegative = _mm256_or_ps(_mm256_or_ps(
+        _mm256_cmp_ps(e0, zero, _CMP_LT_OQ), _mm256_cmp_ps(e1, zero, _CMP_LT_OQ)), _mm256_cmp_ps(e2, zero, _CMP_LT_OQ));
+    const __m256 anyPositive = _mm256_or_ps(_mm256_or_ps(
+        _mm256_cmp_ps(e0, zero, _CMP_GT_OQ), _mm256_cmp_ps(e1, zero, _CMP_GT_OQ)), _mm256_cmp_ps(e2, zero, _CMP_GT_OQ));
+    __m256 failed = _mm256_and_ps(anyNegative, anyPositive);
+
+    // Parallel to the triangle, or hitting its back side when culling back faces
+    const __m256 det = _mm256_add_ps(_mm256_add_ps(e0, e1), e2);
+    failed = _mm256_or_ps(failed, backface ? _mm256_cmp_ps(det, zero, _CMP_EQ_OQ) : _mm256_cmp_ps(det, zero, _CMP_LE_OQ));
+
+    const __m256 f = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+    const __m256 tScaled = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e0, az), _mm256_mul_ps(e1, bz)), _mm256_mul_ps(e2, cz));
+    t = _mm256_mul_ps(_mm256_mul_ps(tScaled, _mm256_set1_ps(ray.shear[2])), f);
+    u = _mm256_mul_ps(e1, f);
+    v = _mm256_mul_ps(e2, f);
+    // Not greater or equal, so a NaN distance fails too
+    failed = _mm256_or_ps(failed, _mm256_cmp_ps(t, zero, _CMP_NGE_UQ));
+    failed = _mm256_or_ps(failed, _mm256_cmp_ps(t, _mm256_set1_ps(maxT), _CMP_GE_OQ));
+    return failed;
+}
+
+static bool intersectLeafPackWatertightAVX2(const KernelRay& ray, const float* pack, int /*count*/, bool backface, KernelHit& hit)
+{
+    __m256 t, u, v;
+    const __m256 failed = missedLanesWatertightAVX2(ray, pack, backface, hit.t, t, u, v);
+    if (_mm256_movemask_ps(failed) == 0xFF) {
+        return false;
+    }
+    alignas(32) float tLanes[8], uLanes[8], vLanes[8];
+    _mm256_store_ps(tLanes, _mm256_blendv_ps(t, _mm256_set1_ps(1e30f), failed));
+    _mm256_store_ps(uLanes, u);
+    _mm256_store_ps(vLanes, v);
+    bool found = false;
+    for (int i = 0; i < 8; ++i) {
+        if (tLanes[i] < hit.t) {
+            hit = { tLanes[i], uLanes[i], vLanes[i], i };
+            found = true;
+        }
+    }
+    return found;
+}
+
+static bool occludedLeafPackWatertightAVX2(const KernelRay& ray, const float* pack, int /*count*/, bool backface, float maxT)
+{
+    __m256 t, u, v;
+    return _mm256_movemask_ps(missedLanesWatertightAVX2(ray, pack, backface, maxT, t, u, v)) != 0xFF;
+}
+
+static int intersectWideNodeAVX2(const KernelRay& ray, const WideBVHNode& node, float maxT, float tNear[8])
+{
+    const __m256 nearX = _mm256_load_ps(ray.negativeDir[0] ? node.maxX : node.minX);
+    const __m256 nearY = _mm256_load_ps(ray.negativeDir[1] ? node.maxY : node.minY);
+    const __m256 nearZ = _mm256_load_ps(ray.negativeDir[2] ? node.maxZ : node.minZ);
+    const __m256 farX = _mm256_load_ps(ray.negativeDir[0] ? node.minX : node.maxX);
+    const __m256 farY = _mm256_load_ps(ray.negativeDir[1] ? node.minY : node.maxY);
+    const __m256 farZ = _mm256_load_ps(ray.negativeDir[2] ? node.minZ : node.maxZ);
+
+    // (plane - origin) * invDir == plane * invDir - origin * invDir
+    const __m256 invDirX = _mm256_set1_ps(ray.invDir[0]);
+    const __m256 invDirY = _mm256_set1_ps(ray.invDir[1]);
+    const __m256 invDirZ = _mm256_set1_ps(ray.invDir[2]);
+    const __m256 originInvDirX = _mm256_set1_ps(ray.originInvDir[0]);
+    const __m256 originInvDirY = _mm256_set1_ps(ray.originInvDir[1]);
+    const __m256 originInvDirZ = _mm256_set1_ps(ray.originInvDir[2]);
+    const __m256 tNearX = _mm256_fmsub_ps(nearX, invDirX, originInvDirX);
+    const __m256 tNearY = _mm256_fmsub_ps(nearY, invDirY, originInvDirY);
+    const __m256 tNearZ = _mm256_fmsub_ps(nearZ, invDirZ, originInvDirZ);
+    const __m256 tFarX = _mm256_fmsub_ps(farX, invDirX, originInvDirX);
+    const __m256 tFarY = _mm256_fmsub_ps(farY, invDirY, originInvDirY);
+    const __m256 tFarZ = _mm256_fmsub_ps(farZ, invDirZ, originInvDirZ);
+
+    // Clamp the interval to [0, maxT], so boxes behind the ray or beyond the closest hit are missed
+    const __m256 tMin = _mm256_max_ps(_mm256_max_ps(tNearX, tNearY), _mm256_max_ps(tNearZ, _mm256_setzero_ps()));
+    const __m256 tMax = _mm256_min_ps(_mm256_min_ps(tFarX, tFarY), _mm256_min_ps(tFarZ, _mm256_set1_ps(maxT)));
+    _mm256_storeu_ps(tNear, tMin);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tMin, tMax, _CMP_LE_OQ));
+}
+
+// The 8 quantized planes, dequantized. The products are exact, see CompressedWideBVHNode
+static __m256 dequantize8(const unsigned char q[8], __m256 origin, __m256 scale)
+{
+    const __m256i lanes = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)q));
+    return _mm256_fmadd_ps(_mm256_cvtepi32_ps(lanes), scale, origin);
+}
+
+// Also used by the AVX-512 kernels, 8 children fit in an AVX2 register
+int intersectCompressedWideNodeAVX2(const KernelRay& ray, const CompressedWideBVHNode& node, float maxT, float tNear[8])
+{
+    const __m256 originX = _mm256_set1_ps(node.origin[0]);
+    const __m256 originY = _mm256_set1_ps(node.origin[1]);
+    const __m256 originZ = _mm256_set1_ps(node.origin[2]);
+    const __m256 scaleX = _mm256_set1_ps(node.scale[0]);
+    const __m256 scaleY = _mm256_set1_ps(node.scale[1]);
+    const __m256 scaleZ = _mm256_set1_ps(node.scale[2]);
+    const __m256 nearX = dequantize8(ray.negativeDir[0] ? node.qMax[0] : node.qMin[0], originX, scaleX);
+    const __m256 nearY = dequantize8(ray.negativeDir[1] ? node.qMax[1] : node.qMin[1], originY, scaleY);
+    const __m256 nearZ = dequantize8(ray.negativeDir[2] ? node.qMax[2] : node.qMin[2], originZ, scaleZ);
+    const __m256 farX = dequantize8(ray.negativeDir[0] ? node.qMin[0] : node.qMax[0], originX, scaleX);
+    const __m256 farY = dequantize8(ray.negativeDir[1] ? node.qMin[1] : node.qMax[1], originY, scaleY);
+    const __m256 farZ = dequantize8(ray.negativeDir[2] ? node.qMin[2] : node.qMax[2], originZ, scaleZ);
+
+    const __m256 invDirX = _mm256_set1_ps(ray.invDir[0]);
+    const __m256 invDirY = _mm256_set1_ps(ray.invDir[1]);
+    const __m256 invDirZ = _mm256_set1_ps(ray.invDir[2]);
+    const __m256 originInvDirX = _mm256_set1_ps(ray.originInvDir[0]);
+    const __m256 originInvDirY = _mm256_set1_ps(ray.originInvDir[1]);
+    const __m256 originInvDirZ = _mm256_set1_ps(ray.originInvDir[2]);
+    const __m256 tNearX = _mm256_fmsub_ps(nearX, invDirX, originInvDirX);
+    const __m256 tNearY = _mm256_fmsub_ps(nearY, invDirY, originInvDirY);
+    const __m256 tNearZ = _mm256_fmsub_ps(nearZ, invDirZ, originInvDirZ);
+    const __m256 tFarX = _mm256_fmsub_ps(farX, invDirX, originInvDirX);
+    const __m256 tFarY = _mm256_fmsub_ps(farY, invDirY, originInvDirY);
+    const __m256 tFarZ = _mm256_fmsub_ps(farZ, invDirZ, originInvDirZ);
+
+    const __m256 tMin = _mm256_max_ps(_mm256_max_ps(tNearX, tNearY), _mm256_max_ps(tNearZ, _mm256_setzero_ps()));
+    const __m256 tMax = _mm256_min_ps(_mm256_min_ps(tFarX, tFarY), _mm256_min_ps(tFarZ, _mm256_set1_ps(maxT)));
+    _mm256_storeu_ps(tNear, tMin);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tMin, tMax, _CMP_LE_OQ));
+}
+
+// Also used by the AVX-512 kernels, whose packets are 8 rays too
+int intersectPacketAABBAVX2(const KernelRayPacket& packet, const float boundsMin[3], const float boundsMax[3], const float tMax[RAY_PACKET_SIZE], int activeMask, float tNear[RAY_PACKET_SIZE])
+{
+    __m256 tEnter = _mm256_setzero_ps();
+    __m256 tExit = _mm256_loadu_ps(tMax);
+    for (int axis = 0; axis < 3; ++axis) {
+        const __m256 invDir = _mm256_load_ps(packet.invDir[axis]);
+        const __m256 originInvDir = _mm256_load_ps(packet.originInvDir[axis]);
+        const __m256 t0 = _mm256_fmsub_ps(_mm256_set1_ps(boundsMin[axis]), invDir, originInvDir);
+        const __m256 t1 = _mm256_fmsub_ps(_mm256_set1_ps(boundsMax[axis]), invDir, originInvDir);
+        tEnter = _mm256_max_ps(tEnter, _mm256_min_ps(t0, t1));
+        tExit = _mm256_min_ps(tExit, _mm256_max_ps(t0, t1));
+    }
+    _mm256_storeu_ps(tNear, tEnter);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tEnter, tExit, _CMP_LE_OQ)) & activeMask;
+}
+
+// Every triangle of a pack of the given width against the 8 rays
+static int intersectPacketLeafPack(const KernelRayPacket& packet, const float* pack, int packWidth, int count, bool backface, int activeMask, KernelPacketHit& hits)
+{
+    const __m256 allLanes = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    const __m256 active = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(activeMask), bits), bits));
+    const __m256 inactive = _mm256_andnot_ps(active, allLanes);
+    const __m256 origin[3] = { _mm256_load_ps(packet.origin[0]), _mm256_load_ps(packet.origin[1]), _mm256_load_ps(packet.origin[2]) };
+    const __m256 dir[3] = { _mm256_load_ps(packet.dir[0]), _mm256_load_ps(packet.dir[1]), _mm256_load_ps(packet.dir[2]) };
+    __m256 bestT = _mm256_load_ps(hits.t);
+    __m256 bestU = _mm256_load_ps(hits.u);
+    __m256 bestV = _mm256_load_ps(hits.v);
+    __m256 bestLane = _mm256_castsi256_ps(_mm256_load_si256((const __m256i*)hits.lane));
+    __m256 hit = _mm256_setzero_ps();
+
+    const float* v0Pack = pack;
+    const float* e1Pack = pack + 3 * packWidth;
+    const float* e2Pack = pack + 6 * packWidth;
+    for (int lane = 0; lane < count; ++lane) {
+        const __m256 v0[3] = { _mm256_set1_ps(v0Pack[lane]), _mm256_set1_ps(v0Pack[packWidth + lane]), _mm256_set1_ps(v0Pack[2 * packWidth + lane]) };
+        const __m256 e1[3] = { _mm256_set1_ps(e1Pack[lane]), _mm256_set1_ps(e1Pack[packWidth + lane]), _mm256_set1_ps(e1Pack[2 * packWidth + lane]) };
+        const __m256 e2[3] = { _mm256_set1_ps(e2Pack[lane]), _mm256_set1_ps(e2Pack[packWidth + lane]), _mm256_set1_ps(e2Pack[2 * packWidth + lane]) };
+        __m256 t, u, v;
+        const __m256 failed = _mm256_or_ps(missedAVX2(origin, dir, v0, e1, e2, backface, bestT, t, u, v), inactive);
+        bestT = _mm256_blendv_ps(t, bestT, failed);
+        bestU = _mm256_blendv_ps(u, bestU, failed);
+        bestV = _mm256_blendv_ps(v, bestV, failed);
+        bestLane = _mm256_blendv_ps(_mm256_castsi256_ps(_mm256_set1_epi32(lane)), bestLane, failed);
+        hit = _mm256_or_ps(hit, _mm256_andnot_ps(failed, allLanes));
+    }
+
+    _mm256_store_ps(hits.t, bestT);
+    _mm256_store_ps(hits.u, bestU);
+    _mm256_store_ps(hits.v, bestV);
+    _mm256_store_si256((__m256i*)hits.lane, _mm256_castps_si256(bestLane));
+    return _mm256_movemask_ps(hit);
+}
+
+static int intersectPacketLeafPackAVX2(const KernelRayPacket& packet, const float* pack, int count, bool backface, int activeMask, KernelPacketHit& hits)
+{
+    return intersectPacketLeafPack(packet, pack, 8, count, backface, activeMask, hits);
+}
+
+// For the 16-wide packs of the AVX-512 kernels
+int intersectPacketLeafPack16AVX2(const KernelRayPacket& packet, const float* pack, int count, bool backface, int activeMask, KernelPacketHit& hits)
+{
+    return intersectPacketLeafPack(packet, pack, 16, count, backface, activeMask, hits);
+}
+
+int intersectPacketLeafPackByRay(const KernelRayPacket& packet, const float* pack, int count, bool backface, int activeMask, KernelPacketHit& hits,
+    bool (*intersectLeafPack)(const KernelRay& ray, const float* pack, int count, bool backface, KernelHit& hit));
+
+static int intersectPacketLeafPackWatertightAVX2(const KernelRayPacket& packet, const float* pack, int count, bool backface, int activeMask, KernelPacketHit& hits)
+{
+    return intersectPacketLeafPackByRay(packet, pack, count, backface, activeMask, hits, intersectLeafPackWatertightAVX2);
+}
+
+bool intersectAABBSSE41(const KernelRay& ray, const float boundsMin[3], const float boundsMax[3], float& tNear);
+
+const SIMDKernels avx2Kernels = {
+    "AVX2+FMA",
+    8,
+    intersectLeafPackAVX2,
+    occludedLeafPackAVX2,
+    intersectWideNodeAVX2,
+    intersectCompressedWideNodeAVX2,
+    intersectAABBSSE41,
+    intersectPacketAABBAVX2,
+    intersectPacketLeafPackAVX2,
+    intersectLeafPackWatertightAVX2,
+    occludedLeafPackWatertightAVX2,
+    intersectPacketLeafPackWatertightAVX2,
+};
@@ -0,0 +1,217 @@
+#include "simd_kernels.h"
+
+#include <immintrin.h>
+
+// 16-wide leaf packs, wide nodes on AVX-512VL. The lanes that fail a test are tracked in
+// a mask register instead of a vector, which saves the or-ing of compare results.
+// Ray packets are 8 rays and compressed wide nodes 8 children, they use the AVX2 kernels.
+// Constants are created inside the functions, see kernels_avx2.cpp.
+
+const float KERNEL_EPSILON = 1e-9f;
+
+static void cross16(__m512 result[3], const __m512 a[3], const __m512 b[3])
+{
+    result[0] = _mm512_fmsub_ps(a[1], b[2], _mm512_mul_ps(b[1], a[2]));
+    result[1] = _mm512_fmsub_ps(a[2], b[0], _mm512_mul_ps(b[2], a[0]));
+    result[2] = _mm512_fmsub_ps(a[0], b[1], _mm512_mul_ps(b[0], a[1]));
+}
+
+static __m512 dot16(const __m512 a[3], const __m512 b[3])
+{
+    return _mm512_fmadd_ps(a[2], b[2], _mm512_fmadd_ps(a[1], b[1], _mm512_mul_ps(a[0], b[0])));
+}
+
+// Moller-Trumbore test of the 16 lanes of a pack, returns the mask of lanes not hit before maxT
+static __mmask16 missedLanesAVX512(const KernelRay& ray, const float* pack, bool backface, float maxT, __m512& t, __m512& u, __m512& v)
+{
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512 origin[3] = { _mm512_set1_ps(ray.origin[0]), _mm512_set1_ps(ray.origin[1]), _mm512_set1_ps(ray.origin[2]) };
+    const __m512 dir[3] = { _mm512_set1_ps(ray.dir[0]), _mm512_set1_ps(ray.dir[1]), _mm512_set1_ps(ray.dir[2]) };
+    const __m512 v0[3] = { _mm512_load_ps(pack), _mm512_load_ps(pack + 16), _mm512_load_ps(pack + 32) };
+    const __m512 e1[3] = { _mm512_load_ps(pack + 48), _mm512_load_ps(pack + 64), _mm512_load_ps(pack + 80) };
+    const __m512 e2[3] = { _mm512_load_ps(pack + 96), _mm512_load_ps(pack + 112), _mm512_load_ps(pack + 128) };
+
+    __m512 h[3];
+    cross16(h, dir, e2);
+    const __m512 d = dot16(e1, h);
+    const __m512 f = _mm512_div_ps(one, d);
+    const __m512 s[3] = { _mm512_sub_ps(origin[0], v0[0]), _mm512_sub_ps(origin[1], v0[1]), _mm512_sub_ps(origin[2], v0[2]) };
+    u = _mm512_mul_ps(f, dot16(s, h));
+    __m512 q[3];
+    cross16(q, s, e1);
+    v = _mm512_mul_ps(f, dot16(dir, q));
+    t = _mm512_mul_ps(f, dot16(e2, q));
+
+    // Parallel to the triangle, or hitting its back side when culling back faces
+    __mmask16 failed = _mm512_cmp_ps_mask(d, _mm512_set1_ps(KERNEL_EPSILON), _CMP_LT_OQ);
+    if (backface) {
+        failed &= _mm512_cmp_ps_mask(d, _mm512_set1_ps(-KERNEL_EPSILON), _CMP_GT_OQ);
+    }
+    failed |= _mm512_cmp_ps_mask(u, zero, _CMP_LT_OQ);
+    failed |= _mm512_cmp_ps_mask(v, zero, _CMP_LT_OQ);
+    failed |= _mm512_cmp_ps_mask(_mm512_add_ps(u, v), one, _CMP_GT_OQ);
+    failed |= _mm512_cmp_ps_mask(t, zero, _CMP_LT_OQ);
+    failed |= _mm512_cmp_ps_mask(t, _mm512_set1_ps(maxT), _CMP_GE_OQ);
+    return failed;
+}
+
+static bool intersectLeafPackAVX512(const KernelRay& ray, const float* pack, int /*count*/, bool backface, KernelHit& hit)
+{
+    __m512 t, u, v;
+    const __mmask16 failed = missedLanesAVX512(ray, pack, backface, hit.t, t, u, v);
+    if (failed == 0xFFFF) {
+        return false;
+    }
+    // Failed lanes are pushed past any hit, so the closest lane wins
+    alignas(64) float tLanes[16], uLanes[16], vLanes[16];
+    _mm512_store_ps(tLanes, _mm512_mask_blend_ps(failed, t, _mm512_set1_ps(1e30f)));
+    _mm512_store_ps(uLanes, u);
+    _mm512_store_ps(vLanes, v);
+    bool found = false;
+    for (int i = 0; i < 16; ++i) {
+        if (tLanes[i] < hit.t) {
+            hit = { tLanes[i], uLanes[i], vLanes[i], i };
+            found = true;
+        }
+    }
+    return found;
+}
+
+static bool occludedLeafPackAVX512(const KernelRay& ray, const float* pack, int /*count*/, bool backface, float maxT)
+{
+    __m512 t, u, v;
+    return missedLanesAVX512(ray, pack, backface, maxT, t, u, v) != 0xFFFF;
+}
+
+// Watertight test of the ray against the 16 lanes of a vertex pack, returns the mask of lanes not hit before maxT.
+// No FMA, see SIMDKernels::intersectLeafPackWatertight
+static __mmask16 missedLanesWatertightAVX512(const KernelRay& ray, const float* pack, bool backface, float maxT, __m512& t, __m512& u, __m512& v)
+{
+    const int kx = ray.shearAxes[0];
+    const int ky = ray.shearAxes[1];
+    const int kz = ray.shearAxes[2];
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 originX = _mm512_set1_ps(ray.origin[kx]);
+    const __m512 originY = _mm512_set1_ps(ray.origin[ky]);
+    const __m512 originZ = _mm512_set1_ps(ray.origin[kz]);
+    const __m512 shearX = _mm512_set1_ps(ray.shear[0]);
+    const __m512 shearY = _mm512_set1_ps(ray.shear[1]);
+
+    // The vertices relative to the origin, sheared so that the ray is the +z axis
+    const __m512 az = _mm512_sub_ps(_mm512_load_ps(pack + kz * 16), originZ);
+    const __m512 bz = _mm512_sub_ps(_mm512_load_ps(pack + 48 + kz * 16), originZ);
+    const __m512 cz = _mm512_sub_ps(_mm512_load_ps(pack + 96 + kz * 16), originZ);
+    const __m512 ax = _mm512_sub_ps(_mm512_sub_ps(_mm512_load_ps(pack + kx * 16), originX), _mm512_mul_ps(shearX, az));
+    const __m512 ay = _mm512_sub_ps(_mm512_sub_ps(_mm512_load_ps(pack + ky * 16), originY), _mm512_mul_ps(shearY, az));
+    const __m512 bx = _mm512_sub_ps(_mm512_sub_ps(_mm512_load_ps(pack + 48 + kx * 16), originX), _mm512_mul_ps(shearX, bz));
+    const __m512 by = _mm512_sub_ps(_mm512_sub_ps(_mm512_load_ps(pack + 48 + ky * 16), originY), _mm512_mul_ps(shearY, bz));
+    const __m512 cx = _mm512_sub_ps(_mm512_sub_ps(_mm512_load_ps(pack + 96 + kx * 16), originX), _mm512_mul_ps(shearX, cz));
+    const __m512 cy = _mm512_sub_ps(_mm512_sub_ps(_mm512_load_ps(pack + 96 + ky * 16), originY), _mm512_mul_ps(shearY, cz));
+
+    // Edge functions, the barycentrics scaled by det. The ray misses if they have different signs
+    const __m512 e0 = _mm512_sub_ps(_mm512_mul_ps(cx, by), _mm512_mul_ps(cy, bx));
+    const __m512 e1 = _mm512_sub_ps(_mm512_mul_ps(ax, cy), _mm512_mul_ps(ay, cx));
+    const __m512 e2 = _mm512_sub_ps(_mm512_mul_ps(bx, ay), _mm512_mul_ps(by, ax));
+    const __mmask16 anyNegative = _mm512_cmp_ps_mask(e0, zero, _CMP_LT_OQ) | _mm512_cmp_ps_mask(e1, zero, _CMP_LT_OQ) | _mm512_cmp_ps_mask(e2, zero, _CMP_LT_OQ);
+    const __mmask16 anyPositive = _mm512_cmp_ps_mask(e0, zero, _CMP_GT_OQ) | _mm512_cmp_ps_mask(e1, zero, _CMP_GT_OQ) | _mm512_cmp_ps_mask(e2, zero, _CMP_GT_OQ);
+    __mmask16 failed = anyNegative & anyPositive;
+
+    // Parallel to the triangle, or hitting its back side when culling back faces
+    const __m512 det = _mm512_add_ps(_mm512_add_ps(e0, e1), e2);
+    failed |= backface ? _mm512_cmp_ps_mask(det, zero, _CMP_EQ_OQ) : _mm512_cmp_ps_mask(det, zero, _CMP_LE_OQ);
+
+    const __m512 f = _mm512_div_ps(_mm512_set1_ps(1.0f), det);
+    const __m512 tScaled = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e0, az), _mm512_mul_ps(e1, bz)), _mm512_mul_ps(e2, cz));
+    t = _mm512_mul_ps(_mm512_mul_ps(tScaled, _mm512_set1_ps(ray.shear[2])), f);
+    u = _mm512_mul_ps(e1, f);
+    v = _mm512_mul_ps(e2, f);
+    // Not greater or equal, so a NaN distance fails too
+    failed |= _mm512_cmp_ps_mask(t, zero, _CMP_NGE_UQ);
+    failed |= _mm512_cmp_ps_mask(t, _mm512_set1_ps(maxT), _CMP_GE_OQ);
+    return failed;
+}
+
+static bool intersectLeafPackWatertightAVX512(const KernelRay& ray, const float* pack, int /*count*/, bool backface, KernelHit& hit)
+{
+    __m512 t, u, v;
+    const __mmask16 failed = missedLanesWatertightAVX512(ray, pack, backface, hit.t, t, u, v);
+    if (failed == 0xFFFF) {
+        return false;
+    }
+    alignas(64) float tLanes[16], uLanes[16], vLanes[16];
+    _mm512_store_ps(tLanes, _mm512_mask_blend_ps(failed, t, _mm512_set1_ps(1e30f)));
+    _mm512_store_ps(uLanes, u);
+    _mm512_store_ps(vLanes, v);
+    bool found = false;
+    for (int i = 0; i < 16; ++i) {
+        if (tLanes[i] < hit.t) {
+            hit = { tLanes[i], uLanes[i], vLanes[i], i };
+            found = true;
+        }
+    }
+    return found;
+}
+
+static bool occludedLeafPackWatertightAVX512(const KernelRay& ray, const float* pack, int /*count*/, bool backface, float maxT)
+{
+    __m512 t, u, v;
+    return missedLanesWatertightAVX512(ray, pack, backface, maxT, t, u, v) != 0xFFFF;
+}
+
+static int intersectWideNodeAVX512(const KernelRay& ray, const WideBVHNode& node, float maxT, float tNear[8])
+{
+    const __m256 nearX = _mm256_load_ps(ray.negativeDir[0] ? node.maxX : node.minX);
+    const __m256 nearY = _mm256_load_ps(ray.negativeDir[1] ? node.maxY : node.minY);
+    const __m256 nearZ = _mm256_load_ps(ray.negativeDir[2] ? node.maxZ : node.minZ);
+    const __m256 farX = _mm256_load_ps(ray.negativeDir[0] ? node.minX : node.maxX);
+    const __m256 farY = _mm256_load_ps(ray.negativeDir[1] ? node.minY : node.maxY);
+    const __m256 farZ = _mm256_load_ps(ray.negativeDir[2] ? node.minZ : node.maxZ);
+
+    // (plane - origin) * invDir == plane * invDir - origin * invDir
+    const __m256 invDirX = _mm256_set1_ps(ray.invDir[0]);
+    const __m256 invDirY = _mm256_set1_ps(ray.invDir[1]);
+    const __m256 invDirZ = _mm256_set1_ps(ray.invDir[2]);
+    const __m256 originInvDirX = _mm256_set1_ps(ray.originInvDir[0]);
+    const __m256 originInvDirY = _mm256_set1_ps(ray.originInvDir[1]);
+    const __m256 originInvDirZ = _mm256_set1_ps(ray.originInvDir[2]);
+    const __m256 tNearX = _mm256_fmsub_ps(nearX, invDirX, originInvDirX);
+    const __m256 tNearY = _mm256_fmsub_ps(nearY, invDirY, originInvDirY);
+    const __m256 tNearZ = _mm256_fmsub_ps(nearZ, invDirZ, originInvDirZ);
+    const __m256 tFarX = _mm256_fmsub_ps(farX, invDirX, originInvDirX);
+    const __m256 tFarY = _mm256_fmsub_ps(farY, invDirY, originInvDirY);
+    const __m256 tFarZ = _mm256_fmsub_ps(farZ, invDirZ, originInvDirZ);
+
+    // Clamp the interval to [0, maxT], so boxes behind the ray or beyond the closest hit are missed
+    const __m256 tMin = _mm256_max_ps(_mm256_max_ps(tNearX, tNearY), _mm256_max_ps(tNearZ, _mm256_setzero_ps()));
+    const __m256 tMax = _mm256_min_ps(_mm256_min_ps(tFarX, tFarY), _mm256_min_ps(tFarZ, _mm256_set1_ps(maxT)));
+    _mm256_storeu_ps(tNear, tMin);
+    return _mm256_cmp_ps_mask(tMin, tMax, _CMP_LE_OQ);
+}
+
+int intersectCompressedWideNodeAVX2(const KernelRay& ray, const CompressedWideBVHNode& node, float maxT, float tNear[8]);
+bool intersectAABBSSE41(const KernelRay& ray, const float boundsMin[3], const float boundsMax[3], float& tNear);
+int intersectPacketAABBAVX2(const KernelRayPacket& packet, const float boundsMin[3], const float boundsMax[3], const float tMax[RAY_PACKET_SIZE], int activeMask, float tNear[RAY_PACKET_SIZE]);
+int intersectPacketLeafPack16AVX2(const KernelRayPacket& packet, const float* pack, int count, bool backface, int activeMask, KernelPacketHit& hits);
+int intersectPacketLeafPackByRay(const KernelRayPacket& packet, const float* pack, int count, bool backface, int activeMask, KernelPacketHit& hits,
+    bool (*intersectLeafPack)(const KernelRay& ray, const float* pack, int count, bool backface, KernelHit& hit));
+
+static int intersectPacketLeafPackWatertightAVX512(const KernelRayPacket& packet, const float* pack, int count, bool backface, int activeMask, KernelPacketHit& hits)
+{
+    return intersectPacketLeafPackByRay(packet, pack, count, backface, activeMask, hits, intersectLeafPackWatertightAVX512);
+}
+
+const SIMDKernels avx512Kernels = {
+    "AVX-512",
+    16,
+    intersectLeafPackAVX512,
+    occludedLeafPackAVX512,
+    intersectWideNodeAVX512,
+    intersectCompressedWideNodeAVX2,
+    intersectAABBSSE41,
+    intersectPacketAABBAVX2,
+    intersectPacketLeafPack16AVX2,
+    intersectLeafPackWatertightAVX512,
+    occludedLeafPackWatertightAVX512,
+    intersectPacketLeafPackWatertightAVX512,
+};
@@ -0,0 +1,313 @@
+#include "simd_kernels.h"
+
+// Baseline kernels, one triangle or box slab at a time
+
+const float KERNEL_EPSILON = 1e-9f;
+
+// Same layout as the SSE4.1 kernels, so the two share cached BVHs.
+// Only the used lanes are tested
+const int SCALAR_PACK_WIDTH = 4;
+
+// The lane tests are instantiated for both values of backface, so the loops over the lanes don't branch on it
+
+// Moller-Trumbore test of one lane of a pack, hit is updated if it is hit before hit.t
+template <bool backface>
+static bool intersectLaneScalar(const KernelRay& ray, const float* pack, int lane, KernelHit& hit)
+{
+    const float* v0 = pack;
+    const float* e1Pack = pack + 3 * SCALAR_PACK_WIDTH;
+    const float* e2Pack = pack + 6 * SCALAR_PACK_WIDTH;
+    const float e1[3] = { e1Pack[lane], e1Pack[SCALAR_PACK_WIDTH + lane], e1Pack[2 * SCALAR_PACK_WIDTH + lane] };
+    const float e2[3] = { e2Pack[lane], e2Pack[SCALAR_PACK_WIDTH + lane], e2Pack[2 * SCALAR_PACK_WIDTH + lane] };
+
+    const float h[3] = {
+        ray.dir[1] * e2[2] - ray.dir[2] * e2[1],
+        ray.dir[2] * e2[0] - ray.dir[0] * e2[2],
+        ray.dir[0] * e2[1] - ray.dir[1] * e2[0],
+    };
+    const float d = e1[0] * h[0] + e1[1] * h[1] + e1[2] * h[2];
+
+    // Parallel to the triangle, or hitting its back side when culling back faces
+    if ((backface ? (d < 0 ? -d : d) : d) < KERNEL_EPSILON) {
+        return false;
+    }
+    const float f = 1 / d;
+
+    const float s[3] = {
+        ray.origin[0] - v0[lane],
+        ray.origin[1] - v0[SCALAR_PACK_WIDTH + lane],
+        ray.origin[2] - v0[2 * SCALAR_PACK_WIDTH + lane],
+    };
+    const float u = f * (s[0] * h[0] + s[1] * h[1] + s[2] * h[2]);
+    if (u < 0.0f || u > 1.0f) {
+        return false;
+    }
+
+    const float q[3] = {
+        s[1] * e1[2] - s[2] * e1[1],
+        s[2] * e1[0] - s[0] * e1[2],
+        s[0] * e1[1] - s[1] * e1[0],
+    };
+    const float v = f * (ray.dir[0] * q[0] + ray.dir[1] * q[1] + ray.dir[2] * q[2]);
+    if (v < 0.0f || u + v > 1.0f) {
+        return false;
+    }
+
+    const float t = f * (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]);
+    if (t < 0 || t >= hit.t) {
+        return false;
+    }
+
+    hit = { t, u, v, lane };
+    return true;
+}
+
+// Watertight test of one lane of a vertex pack, hit is updated if it is hit before hit.t
+template <bool backface>
+static bool intersectLaneWatertightScalar(const KernelRay& ray, const float* pack, int lane, KernelHit& hit)
+{
+    const int kx = ray.shearAxes[0];
+    const int ky = ray.shearAxes[1];
+    const int kz = ray.shearAxes[2];
+    const float* v0 = pack;
+    const float* v1 = pack + 3 * SCALAR_PACK_WIDTH;
+    const float* v2 = pack + 6 * SCALAR_PACK_WIDTH;
+
+    // The vertices relative to the origin, sheared so that the ray is the +z axis
+    const float az = v0[kz * SCALAR_PACK_WIDTH + lane] - ray.origin[kz];
+    const float bz = v1[kz * SCALAR_PACK_WIDTH + lane] - ray.origin[kz];
+    const float cz = v2[kz * SCALAR_PACK_WIDTH + lane] - ray.origin[kz];
+    const float ax = v0[kx * SCALAR_PACK_WIDTH + lane] - ray.origin[kx] - ray.shear[0] * az;
+    const float ay = v0[ky * SCALAR_PACK_WIDTH + lane] - ray.origin[ky] - ray.shear[1] * az;
+    const float bx = v1[kx * SCALAR_PACK_WIDTH + lane] - ray.origin[kx] - ray.shear[0] * bz;
+    const float by = v1[ky * SCALAR_PACK_WIDTH + lane] - ray.origin[ky] - ray.shear[1] * bz;
+    const float cx = v2[kx * SCALAR_PACK_WIDTH + lane] - ray.origin[kx] - ray.shear[0] * cz;
+    const float cy = v2[ky * SCALAR_PACK_WIDTH + lane] - ray.origin[ky] - ray.shear[1] * cz;
+
+    // Edge functions, the barycentrics scaled by det. The ray misses if they have different signs
+    const float e0 = cx * by - cy * bx;
+    const float e1 = ax * cy - ay * cx;
+    const float e2 = bx * ay - by * ax;
+    if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0)) {
+        return false;
+    }
+
+    // Parallel to the triangle, or hitting its back side when culling back faces
+    const float det = e0 + e1 + e2;
+    if (det == 0 || (!backface && det < 0)) {
+        return false;
+    }
+
+    const float f = 1 / det;
+    const float t = (e0 * az + e1 * bz + e2 * cz) * ray.shear[2] * f;
+    if (!(t >= 0) || t >= hit.t) {
+        return false;
+    }
+
+    hit = { t, e1 * f, e2 * f, lane };
+    return true;
+}
+
+template <bool (*intersectLane)(const KernelRay& ray, const float* pack, int lane, KernelHit& hit)>
+static bool intersectLanesScalar(const KernelRay& ray, const float* pack, int count, KernelHit& hit)
+{
+    bool found = false;
+    for (int lane = 0; lane < count; ++lane) {
+        found |= intersectLane(ray, pack, lane, hit);
+    }
+    return found;
+}
+
+template <bool (*intersectLane)(const KernelRay& ray, const float* pack, int lane, KernelHit& hit)>
+static bool occludedLanesScalar(const KernelRay& ray, const float* pack, int count, float maxT)
+{
+    KernelHit hit{ maxT, 0, 0, 0 };
+    for (int lane = 0; lane < count; ++lane) {
+        if (intersectLane(ray, pack, lane, hit)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool intersectLeafPackScalar(const KernelRay& ray, const float* pack, int count, bool backface, KernelHit& hit)
+{
+    return backface ?
+        intersectLanesScalar<intersectLaneScalar<true>>(ray, pack, count, hit) :
+        intersectLanesScalar<intersectLaneScalar<false>>(ray, pack, count, hit);
+}
+
+static bool occludedLeafPackScalar(const KernelRay& ray, const float* pack, int count, bool backface, float maxT)
+{
+    return backface ?
+        occludedLanesScalar<intersectLaneScalar<true>>(ray, pack, count, maxT) :
+        occludedLanesScalar<intersectLaneScalar<false>>(ray, pack, count, maxT);
+}
+
+static bool intersectLeafPackWatertightScalar(const KernelRay& ray, const float* pack, int count, bool backface, KernelHit& hit)
+{
+    return backface ?
+        intersectLanesScalar<intersectLaneWatertightScalar<true>>(ray, pack, count, hit) :
+        intersectLanesScalar<intersectLaneWatertightScalar<false>>(ray, pack, count, hit);
+}
+
+static bool occludedLeafPackWatertightScalar(const KernelRay& ray, const float* pack, int count, bool backface, float maxT)
+{
+    return backface ?
+        occludedLanesScalar<intersectLaneWatertightScalar<true>>(ray, pack, count, maxT) :
+        occludedLanesScalar<intersectLaneWatertightScalar<false>>(ray, pack, count, maxT);
+}
+
+static int intersectWideNodeScalar(const KernelRay& ray, const WideBVHNode& node, float maxT, float tNear[8])
+{
+    const float* nearPlanes[3] = {
+        ray.negativeDir[0] ? node.maxX : node.minX,
+        ray.negativeDir[1] ? node.maxY : node.minY,
+        ray.negativeDir[2] ? node.maxZ : node.minZ,
+    };
+    const float* farPlanes[3] = {
+        ray.negativeDir[0] ? node.minX : node.maxX,
+        ray.negativeDir[1] ? node.minY : node.maxY,
+        ray.negativeDir[2] ? node.minZ : node.maxZ,
+    };
+
+    int mask = 0;
+    for (int i = 0; i < 8; ++i) {
+        float tMin = 0;
+        float tMax = maxT;
+        for (int axis = 0; axis < 3; ++axis) {
+            const float t0 = nearPlanes[axis][i] * ray.invDir[axis] - ray.originInvDir[axis];
+            const float t1 = farPlanes[axis][i] * ray.invDir[axis] - ray.originInvDir[axis];
+            tMin = t0 > tMin ? t0 : tMin;
+            tMax = t1 < tMax ? t1 : tMax;
+        }
+        tNear[i] = tMin;
+        if (tMin <= tMax) {
+            mask |= 1 << i;
+        }
+    }
+    return mask;
+}
+
+static int intersectCompressedWideNodeScalar(const KernelRay& ray, const CompressedWideBVHNode& node, float maxT, float tNear[8])
+{
+    int mask = 0;
+    for (int i = 0; i < 8; ++i) {
+        float tMin = 0;
+        float tMax = maxT;
+        for (int axis = 0; axis < 3; ++axis) {
+            const int qNear = ray.negativeDir[axis] ? node.qMax[axis][i] : node.qMin[axis][i];
+            const int qFar = ray.negativeDir[axis] ? node.qMin[axis][i] : node.qMax[axis][i];
+            const float nearPlane = node.origin[axis] + float(qNear) * node.scale[axis];
+            const float farPlane = node.origin[axis] + float(qFar) * node.scale[axis];
+            const float t0 = nearPlane * ray.invDir[axis] - ray.originInvDir[axis];
+            const float t1 = farPlane * ray.invDir[axis] - ray.originInvDir[axis];
+            tMin = t0 > tMin ? t0 : tMin;
+            tMax = t1 < tMax ? t1 : tMax;
+        }
+        tNear[i] = tMin;
+        if (tMin <= tMax) {
+            mask |= 1 << i;
+        }
+    }
+    return mask;
+}
+
+static bool intersectAABBScalar(const KernelRay& ray, const float boundsMin[3], const float boundsMax[3], float& tNear)
+{
+    float tMin = -1e30f;
+    float tMax = 1e30f;
+    for (int axis = 0; axis < 3; ++axis) {
+        float t0 = (boundsMin[axis] - ray.origin[axis]) * ray.invDir[axis];
+        float t1 = (boundsMax[axis] - ray.origin[axis]) * ray.invDir[axis];
+        if (t0 > t1) {
+            const float tmp = t0;
+            t0 = t1;
+            t1 = tmp;
+        }
+        tMin = t0 > tMin ? t0 : tMin;
+        tMax = t1 < tMax ? t1 : tMax;
+    }
+    tNear = tMin;
+    return tMin <= tMax && tMax >= 0;
+}
+
+static int intersectPacketAABBScalar(const KernelRayPacket& packet, const float boundsMin[3], const float boundsMax[3], const float tMax[RAY_PACKET_SIZE], int activeMask, float tNear[RAY_PACKET_SIZE])
+{
+    int mask = 0;
+    for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+        float tEnter = 0;
+        float tExit = tMax[i];
+        for (int axis = 0; axis < 3; ++axis) {
+            float t0 = boundsMin[axis] * packet.invDir[axis][i] - packet.originInvDir[axis][i];
+            float t1 = boundsMax[axis] * packet.invDir[axis][i] - packet.originInvDir[axis][i];
+            if (t0 > t1) {
+                const float tmp = t0;
+                t0 = t1;
+                t1 = tmp;
+            }
+            tEnter = t0 > tEnter ? t0 : tEnter;
+            tExit = t1 < tExit ? t1 : tExit;
+        }
+        tNear[i] = tEnter;
+        if (tEnter <= tExit) {
+            mask |= 1 << i;
+        }
+    }
+    return mask & activeMask;
+}
+
+// Packet kernel from a single ray leaf pack kernel, for the kernels that have no packet form.
+// Also used by the other instruction sets, their single ray kernels test a pack at once
+int intersectPacketLeafPackByRay(const KernelRayPacket& packet, const float* pack, int count, bool backface, int activeMask, KernelPacketHit& hits,
+    bool (*intersectLeafPack)(const KernelRay& ray, const float* pack, int count, bool backface, KernelHit& hit))
+{
+    int updated = 0;
+    for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+        if (!(activeMask & (1 << i))) {
+            continue;
+        }
+        // Only what the triangle tests use
+        KernelRay ray;
+        for (int axis = 0; axis < 3; ++axis) {
+            ray.origin[axis] = packet.origin[axis][i];
+            ray.dir[axis] = packet.dir[axis][i];
+            ray.shearAxes[axis] = packet.shearAxes[axis][i];
+            ray.shear[axis] = packet.shear[axis][i];
+        }
+        KernelHit hit{ hits.t[i], 0, 0, 0 };
+        if (intersectLeafPack(ray, pack, count, backface, hit)) {
+            hits.t[i] = hit.t;
+            hits.u[i] = hit.u;
+            hits.v[i] = hit.v;
+            hits.lane[i] = hit.lane;
+            updated |= 1 << i;
+        }
+    }
+    return updated;
+}
+
+static int intersectPacketLeafPackScalar(const KernelRayPacket& packet, const float* pack, int count, bool backface, int activeMask, KernelPacketHit& hits)
+{
+    return intersectPacketLeafPackByRay(packet, pack, count, backface, activeMask, hits, intersectLeafPackScalar);
+}
+
+static int intersectPacketLeafPackWatertightScalar(const KernelRayPacket& packet, const float* pack, int count, bool backface, int activeMask, KernelPacketHit& hits)
+{
+    return intersectPacketLeafPackByRay(packet, pack, count, backface, activeMask, hits, intersectLeafPackWatertightScalar);
+}
+
+const SIMDKernels scalarKernels = {
+    "scalar",
+    SCALAR_PACK_WIDTH,
+    intersectLeafPackScalar,
+    occludedLeafPackScalar,
+    intersectWideNodeScalar,
+    intersectCompressedWideNodeScalar,
+    intersectAABBScalar,
+    intersectPacketAABBScalar,
+    intersectPacketLeafPackScalar,
+    intersectLeafPackWatertightScalar,
+    occludedLeafPackWatertightScalar,
+    intersectPacketLeafPackWatertightScalar,
+};
@@ -0,0 +1,346 @@
+#include "simd_kernels.h"
+
+#include <smmintrin.h>
+
+// 4-wide kernels, leaf packs of 4 triangles. A wide node is processed in two halves
+
+const float KERNEL_EPSILON = 1e-9f;
+
+static void cross4(__m128 result[3], const __m128 a[3], const __m128 b[3])
+{
+    result[0] = _mm_sub_ps(_mm_mul_ps(a[1], b[2]), _mm_mul_ps(b[1], a[2]));
+    result[1] = _mm_sub_ps(_mm_mul_ps(a[2], b[0]), _mm_mul_ps(b[2], a[0]));
+    result[2] = _mm_sub_ps(_mm_mul_ps(a[0], b[1]), _mm_mul_ps(b[0], a[1]));
+}
+
+static __m128 dot4(const __m128 a[3], const __m128 b[3])
+{
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
+}
+
+// Moller-Trumbore test of 4 ray-triangle pairs, returns the mask of pairs not hit before maxT
+static __m128 missedSSE41(const __m128 origin[3], const __m128 dir[3], const __m128 v0[3], const __m128 e1[3], const __m128 e2[3],
+    bool backface, __m128 maxT, __m128& t, __m128& u, __m128& v)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 backfaceMask = backface ? zero : _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+    __m128 h[3];
+    cross4(h, dir, e2);
+    const __m128 d = dot4(e1, h);
+    const __m128 f = _mm_div_ps(one, d);
+    const __m128 s[3] = { _mm_sub_ps(origin[0], v0[0]), _mm_sub_ps(origin[1], v0[1]), _mm_sub_ps(origin[2], v0[2]) };
+    u = _mm_mul_ps(f, dot4(s, h));
+    __m128 q[3];
+    cross4(q, s, e1);
+    v = _mm_mul_ps(f, dot4(dir, q));
+    t = _mm_mul_ps(f, dot4(e2, q));
+
+    // Parallel to the triangle, or hitting its back side when culling back faces
+    __m128 failed = _mm_and_ps(
+        _mm_or_ps(_mm_cmpgt_ps(d, _mm_set1_ps(-KERNEL_EPSILON)), backfaceMask),
+        _mm_cmplt_ps(d, _mm_set1_ps(KERNEL_EPSILON)));
+    failed = _mm_or_ps(failed, _mm_cmplt_ps(u, zero));
+    failed = _mm_or_ps(failed, _mm_cmplt_ps(v, zero));
+    failed = _mm_or_ps(failed, _mm_cmpgt_ps(_mm_add_ps(u, v), one));
+    failed = _mm_or_ps(failed, _mm_cmplt_ps(t, zero));
+    failed = _mm_or_ps(failed, _mm_cmpge_ps(t, maxT));
+    return failed;
+}
+
+// The ray against the 4 lanes of a pack
+static __m128 missedLanesSSE41(const KernelRay& ray, const float* pack, bool backface, float maxT, __m128& t, __m128& u, __m128& v)
+{
+    const __m128 origin[3] = { _mm_set1_ps(ray.origin[0]), _mm_set1_ps(ray.origin[1]), _mm_set1_ps(ray.origin[2]) };
+    const __m128 dir[3] = { _mm_set1_ps(ray.dir[0]), _mm_set1_ps(ray.dir[1]), _mm_set1_ps(ray.dir[2]) };
+    const __m128 v0[3] = { _mm_load_ps(pack), _mm_load_ps(pack + 4), _mm_load_ps(pack + 8) };
+    const __m128 e1[3] = { _mm_load_ps(pack + 12), _mm_load_ps(pack + 16), _mm_load_ps(pack + 20) };
+    const __m128 e2[3] = { _mm_load_ps(pack + 24), _mm_load_ps(pack + 28), _mm_load_ps(pack + 32) };
+    return missedSSE41(origin, dir, v0, e1, e2, backface, _mm_set1_ps(maxT), t, u, v);
+}
+
+static bool intersectLeafPackSSE41(const KernelRay& ray, const float* pack, int /*count*/, bool backface, KernelHit& hit)
+{
+    __m128 t, u, v;
+    const __m128 failed = missedLanesSSE41(ray, pack, backface, hit.t, t, u, v);
+    if (_mm_movemask_ps(failed) == 0xF) {
+        return false;
+    }
+    // Failed lanes are pushed past any hit, so the closest lane wins
+    alignas(16) float tLanes[4], uLanes[4], vLanes[4];
+    _mm_store_ps(tLanes, _mm_blendv_ps(t, _mm_set1_ps(1e30f), failed));
+    _mm_store_ps(uLanes, u);
+    _mm_store_ps(vLanes, v);
+    bool found = false;
+    for (int i = 0; i < 4; ++i) {
+        if (tLanes[i] < hit.t) {
+            hit = { tLanes[i], uLanes[i], vLanes[i], i };
+            found = true;
+        }
+    }
+    return found;
+}
+
+static bool occludedLeafPackSSE41(const KernelRay& ray, const float* pack, int /*count*/, bool backface, float maxT)
+{
+    __m128 t, u, v;
+    return _mm_movemask_ps(missedLanesSSE41(ray, pack, backface, maxT, t, u, v)) != 0xF;
+}
+
+// Watertight test of the ray against the 4 lanes of a vertex pack, returns the mask of lanes not hit before maxT
+static __m128 missedLanesWatertightSSE41(const KernelRay& ray, const float* pack, bool backface, float maxT, __m128& t, __m128& u, __m128& v)
+{
+    const int kx = ray.shearAxes[0];
+    const int ky = ray.shearAxes[1];
+    const int kz = ray.shearAxes[2];
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 originX = _mm_set1_ps(ray.origin[kx]);
+    const __m128 originY = _mm_set1_ps(ray.origin[ky]);
+    const __m128 originZ = _mm_set1_ps(ray.origin[kz]);
+    const __m128 shearX = _mm_set1_ps(ray.shear[0]);
+    const __m128 shearY = _mm_set1_ps(ray.shear[1]);
+
+    // The vertices relative to the origin, sheared so that the ray is the +z axis
+    const __m128 az = _mm_sub_ps(_mm_load_ps(pack + kz * 4), originZ);
+    const __m128 bz = _mm_sub_ps(_mm_load_ps(pack + 12 + kz * 4), originZ);
+    const __m128 cz = _mm_sub_ps(_mm_load_ps(pack + 24 + kz * 4), originZ);
+    const __m128 ax = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(pack + kx * 4), originX), _mm_mul_ps(shearX, az));
+    const __m128 ay = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(pack + ky * 4), originY), _mm_mul_ps(shearY, az));
+    const __m128 bx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(pack + 12 + kx * 4), originX), _mm_mul_ps(shearX, bz));
+    const __m128 by = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(pack + 12 + ky * 4), originY), _mm_mul_ps(shearY, bz));
+    const __m128 cx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(pack + 24 + kx * 4), originX), _mm_mul_ps(shearX, cz));
+    const __m128 cy = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(pack + 24 + ky * 4), originY), _mm_mul_ps(shearY, cz));
+
+    // Edge functions, the barycentrics scaled by det. The ray misses if they have different signs
+    const __m128 e0 = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+    const __m128 e1 = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+    const __m128 e2 = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+    const __m128 anyNegative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(e0, zero), _mm_cmplt_ps(e1, zero)), _mm_cmplt_ps(e2, zero));
+    const __m128 anyPositive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(e0, zero), _mm_cmpgt_ps(e1, zero)), _mm_cmpgt_ps(e2, zero));
+    __m128 failed = _mm_and_ps(anyNegative, anyPositive);
+
+    // Parallel to the triangle, or hitting its back side when culling back faces
+    const __m128 det = _mm_add_ps(_mm_add_ps(e0, e1), e2);
+    failed = _mm_or_ps(failed, backface ? _mm_cmpeq_ps(det, zero) : _mm_cmple_ps(det, zero));
+
+    const __m128 f = _mm_div_ps(_mm_set1_ps(1.0f), det);
+    const __m128 tScaled = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0, az), _mm_mul_ps(e1, bz)), _mm_mul_ps(e2, cz));
+    t = _mm_mul_ps(_mm_mul_ps(tScaled, _mm_set1_ps(ray.shear[2])), f);
+    u = _mm_mul_ps(e1, f);
+    v = _mm_mul_ps(e2, f);
+    // Not greater or equal, so a NaN distance fails too
+    failed = _mm_or_ps(failed, _mm_cmpnge_ps(t, zero));
+    failed = _mm_or_ps(failed, _mm_cmpge_ps(t, _mm_set1_ps(maxT)));
+    return failed;
+}
+
+static bool intersectLeafPackWatertightSSE41(const KernelRay& ray, const float* pack, int /*count*/, bool backface, KernelHit& hit)
+{
+    __m128 t, u, v;
+    const __m128 failed = missedLanesWatertightSSE41(ray, pack, backface, hit.t, t, u, v);
+    if (_mm_movemask_ps(failed) == 0xF) {
+        return false;
+    }
+    alignas(16) float tLanes[4], uLanes[4], vLanes[4];
+    _mm_store_ps(tLanes, _mm_blendv_ps(t, _mm_set1_ps(1e30f), failed));
+    _mm_store_ps(uLanes, u);
+    _mm_store_ps(vLanes, v);
+    bool found = false;
+    for (int i = 0; i < 4; ++i) {
+        if (tLanes[i] < hit.t) {
+            hit = { tLanes[i], uLanes[i], vLanes[i], i };
+            found = true;
+        }
+    }
+    return found;
+}
+
+static bool occludedLeafPackWatertightSSE41(const KernelRay& ray, const float* pack, int /*count*/, bool backface, float maxT)
+{
+    __m128 t, u, v;
+    return _mm_movemask_ps(missedLanesWatertightSSE41(ray, pack, backface, maxT, t, u, v)) != 0xF;
+}
+
+static int intersectWideNodeSSE41(const KernelRay& ray, const WideBVHNode& node, float maxT, float tNear[8])
+{
+    const __m128 invDir[3] = { _mm_set1_ps(ray.invDir[0]), _mm_set1_ps(ray.invDir[1]), _mm_set1_ps(ray.invDir[2]) };
+    const __m128 originInvDir[3] = { _mm_set1_ps(ray.originInvDir[0]), _mm_set1_ps(ray.originInvDir[1]), _mm_set1_ps(ray.originInvDir[2]) };
+    const float* nearX = ray.negativeDir[0] ? node.maxX : node.minX;
+    const float* nearY = ray.negativeDir[1] ? node.maxY : node.minY;
+    const float* nearZ = ray.negativeDir[2] ? node.maxZ : node.minZ;
+    const float* farX = ray.negativeDir[0] ? node.minX : node.maxX;
+    const float* farY = ray.negativeDir[1] ? node.minY : node.maxY;
+    const float* farZ = ray.negativeDir[2] ? node.minZ : node.maxZ;
+
+    int mask = 0;
+    for (int half = 0; half < 8; half += 4) {
+        // (plane - origin) * invDir == plane * invDir - origin * invDir
+        const __m128 tNearX = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(nearX + half), invDir[0]), originInvDir[0]);
+        const __m128 tNearY = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(nearY + half), invDir[1]), originInvDir[1]);
+        const __m128 tNearZ = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(nearZ + half), invDir[2]), originInvDir[2]);
+        const __m128 tFarX = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(farX + half), invDir[0]), originInvDir[0]);
+        const __m128 tFarY = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(farY + half), invDir[1]), originInvDir[1]);
+        const __m128 tFarZ = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(farZ + half), invDir[2]), originInvDir[2]);
+
+        // Clamp the interval to [0, maxT], so boxes behind the ray or beyond the closest hit are missed
+        const __m128 tMin = _mm_max_ps(_mm_max_ps(tNearX, tNearY), _mm_max_ps(tNearZ, _mm_setzero_ps()));
+        const __m128 tMax = _mm_min_ps(_mm_min_ps(tFarX, tFarY), _mm_min_ps(tFarZ, _mm_set1_ps(maxT)));
+        _mm_storeu_ps(tNear + half, tMin);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(tMin, tMax)) << half;
+    }
+    return mask;
+}
+
+// 4 quantized planes starting at lane half, dequantized. The products are exact, see CompressedWideBVHNode
+static __m128 dequantize4(const unsigned char q[8], int half, __m128 origin, __m128 scale)
+{
+    const __m128i bytes = _mm_loadl_epi64((const __m128i*)q);
+    const __m128i lanes = _mm_cvtepu8_epi32(half ? _mm_srli_si128(bytes, 4) : bytes);
+    return _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(lanes), scale));
+}
+
+static int intersectCompressedWideNodeSSE41(const KernelRay& ray, const CompressedWideBVHNode& node, float maxT, float tNear[8])
+{
+    const __m128 invDir[3] = { _mm_set1_ps(ray.invDir[0]), _mm_set1_ps(ray.invDir[1]), _mm_set1_ps(ray.invDir[2]) };
+    const __m128 originInvDir[3] = { _mm_set1_ps(ray.originInvDir[0]), _mm_set1_ps(ray.originInvDir[1]), _mm_set1_ps(ray.originInvDir[2]) };
+    const __m128 origin[3] = { _mm_set1_ps(node.origin[0]), _mm_set1_ps(node.origin[1]), _mm_set1_ps(node.origin[2]) };
+    const __m128 scale[3] = { _mm_set1_ps(node.scale[0]), _mm_set1_ps(node.scale[1]), _mm_set1_ps(node.scale[2]) };
+    const unsigned char* nearX = ray.negativeDir[0] ? node.qMax[0] : node.qMin[0];
+    const unsigned char* nearY = ray.negativeDir[1] ? node.qMax[1] : node.qMin[1];
+    const unsigned char* nearZ = ray.negativeDir[2] ? node.qMax[2] : node.qMin[2];
+    const unsigned char* farX = ray.negativeDir[0] ? node.qMin[0] : node.qMax[0];
+    const unsigned char* farY = ray.negativeDir[1] ? node.qMin[1] : node.qMax[1];
+    const unsigned char* farZ = ray.negativeDir[2] ? node.qMin[2] : node.qMax[2];
+
+    int mask = 0;
+    for (int half = 0; half < 8; half += 4) {
+        const __m128 tNearX = _mm_sub_ps(_mm_mul_ps(dequantize4(nearX, half, origin[0], scale[0]), invDir[0]), originInvDir[0]);
+        const __m128 tNearY = _mm_sub_ps(_mm_mul_ps(dequantize4(nearY, half, origin[1], scale[1]), invDir[1]), originInvDir[1]);
+        const __m128 tNearZ = _mm_sub_ps(_mm_mul_ps(dequantize4(nearZ, half, origin[2], scale[2]), invDir[2]), originInvDir[2]);
+        const __m128 tFarX = _mm_sub_ps(_mm_mul_ps(dequantize4(farX, half, origin[0], scale[0]), invDir[0]), originInvDir[0]);
+        const __m128 tFarY = _mm_sub_ps(_mm_mul_ps(dequantize4(farY, half, origin[1], scale[1]), invDir[1]), originInvDir[1]);
+        const __m128 tFarZ = _mm_sub_ps(_mm_mul_ps(dequantize4(farZ, half, origin[2], scale[2]), invDir[2]), originInvDir[2]);
+
+        const __m128 tMin = _mm_max_ps(_mm_max_ps(tNearX, tNearY), _mm_max_ps(tNearZ, _mm_setzero_ps()));
+        const __m128 tMax = _mm_min_ps(_mm_min_ps(tFarX, tFarY), _mm_min_ps(tFarZ, _mm_set1_ps(maxT)));
+        _mm_storeu_ps(tNear + half, tMin);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(tMin, tMax)) << half;
+    }
+    return mask;
+}
+
+// Also used by the newer instruction sets, which have no faster way to test a single box
+bool intersectAABBSSE41(const KernelRay& ray, const float boundsMin[3], const float boundsMax[3], float& tNear)
+{
+    // The fourth lane loaded after the bounds is ignored
+    const __m128 origin = _mm_loadu_ps(ray.origin);
+    const __m128 invDir = _mm_loadu_ps(ray.invDir);
+    const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(boundsMin), origin), invDir);
+    const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(boundsMax), origin), invDir);
+
+    // The ray is inside the box between the last entry and the first exit
+    const __m128 tMin = _mm_min_ps(t0, t1);
+    const __m128 tMax = _mm_max_ps(t0, t1);
+    const __m128 tMinYZX = _mm_shuffle_ps(tMin, tMin, _MM_SHUFFLE(3, 0, 2, 1));
+    const __m128 tMinZXY = _mm_shuffle_ps(tMin, tMin, _MM_SHUFFLE(3, 1, 0, 2));
+    const __m128 tMaxYZX = _mm_shuffle_ps(tMax, tMax, _MM_SHUFFLE(3, 0, 2, 1));
+    const __m128 tMaxZXY = _mm_shuffle_ps(tMax, tMax, _MM_SHUFFLE(3, 1, 0, 2));
+    const float entry = _mm_cvtss_f32(_mm_max_ss(_mm_max_ss(tMin, tMinYZX), tMinZXY));
+    const float exit = _mm_cvtss_f32(_mm_min_ss(_mm_min_ss(tMax, tMaxYZX), tMaxZXY));
+
+    tNear = entry;
+    return entry <= exit && exit >= 0;
+}
+
+// Bits of the lanes of a 4-wide vector, to expand a lane mask to a vector mask
+static __m128 laneMask4(int mask)
+{
+    const __m128i bits = _mm_setr_epi32(1, 2, 4, 8);
+    return _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(mask), bits), bits));
+}
+
+static int intersectPacketAABBSSE41(const KernelRayPacket& packet, const float boundsMin[3], const float boundsMax[3], const float tMax[RAY_PACKET_SIZE], int activeMask, float tNear[RAY_PACKET_SIZE])
+{
+    int mask = 0;
+    for (int half = 0; half < RAY_PACKET_SIZE; half += 4) {
+        __m128 tEnter = _mm_setzero_ps();
+        __m128 tExit = _mm_loadu_ps(tMax + half);
+        for (int axis = 0; axis < 3; ++axis) {
+            const __m128 invDir = _mm_load_ps(packet.invDir[axis] + half);
+            const __m128 originInvDir = _mm_load_ps(packet.originInvDir[axis] + half);
+            const __m128 t0 = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(boundsMin[axis]), invDir), originInvDir);
+            const __m128 t1 = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(boundsMax[axis]), invDir), originInvDir);
+            tEnter = _mm_max_ps(tEnter, _mm_min_ps(t0, t1));
+            tExit = _mm_min_ps(tExit, _mm_max_ps(t0, t1));
+        }
+        _mm_storeu_ps(tNear + half, tEnter);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(tEnter, tExit)) << half;
+    }
+    return mask & activeMask;
+}
+
+static int intersectPacketLeafPackSSE41(const KernelRayPacket& packet, const float* pack, int count, bool backface, int activeMask, KernelPacketHit& hits)
+{
+    const __m128 allLanes = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    int updated = 0;
+    for (int half = 0; half < RAY_PACKET_SIZE; half += 4) {
+        const int halfMask = (activeMask >> half) & 0xF;
+        if (halfMask == 0) {
+            continue;
+        }
+        const __m128 origin[3] = { _mm_load_ps(packet.origin[0] + half), _mm_load_ps(packet.origin[1] + half), _mm_load_ps(packet.origin[2] + half) };
+        const __m128 dir[3] = { _mm_load_ps(packet.dir[0] + half), _mm_load_ps(packet.dir[1] + half), _mm_load_ps(packet.dir[2] + half) };
+        const __m128 inactive = _mm_andnot_ps(laneMask4(halfMask), allLanes);
+        __m128 bestT = _mm_load_ps(hits.t + half);
+        __m128 bestU = _mm_load_ps(hits.u + half);
+        __m128 bestV = _mm_load_ps(hits.v + half);
+        __m128 bestLane = _mm_castsi128_ps(_mm_load_si128((const __m128i*)(hits.lane + half)));
+        __m128 hit = _mm_setzero_ps();
+
+        // Every triangle of the pack against the 4 rays
+        for (int lane = 0; lane < count; ++lane) {
+            const __m128 v0[3] = { _mm_set1_ps(pack[lane]), _mm_set1_ps(pack[4 + lane]), _mm_set1_ps(pack[8 + lane]) };
+            const __m128 e1[3] = { _mm_set1_ps(pack[12 + lane]), _mm_set1_ps(pack[16 + lane]), _mm_set1_ps(pack[20 + lane]) };
+            const __m128 e2[3] = { _mm_set1_ps(pack[24 + lane]), _mm_set1_ps(pack[28 + lane]), _mm_set1_ps(pack[32 + lane]) };
+            __m128 t, u, v;
+            const __m128 failed = _mm_or_ps(missedSSE41(origin, dir, v0, e1, e2, backface, bestT, t, u, v), inactive);
+            bestT = _mm_blendv_ps(t, bestT, failed);
+            bestU = _mm_blendv_ps(u, bestU, failed);
+            bestV = _mm_blendv_ps(v, bestV, failed);
+            bestLane = _mm_blendv_ps(_mm_castsi128_ps(_mm_set1_epi32(lane)), bestLane, failed);
+            hit = _mm_or_ps(hit, _mm_andnot_ps(failed, allLanes));
+        }
+
+        _mm_store_ps(hits.t + half, bestT);
+        _mm_store_ps(hits.u + half, bestU);
+        _mm_store_ps(hits.v + half, bestV);
+        _mm_store_si128((__m128i*)(hits.lane + half), _mm_castps_si128(bestLane));
+        updated |= _mm_movemask_ps(hit) << half;
+    }
+    return updated;
+}
+
+int intersectPacketLeafPackByRay(const KernelRayPacket& packet, const float* pack, int count, bool backface, int activeMask, KernelPacketHit& hits,
+    bool (*intersectLeafPack)(const KernelRay& ray, const float* pack, int count, bool backface, KernelHit& hit));
+
+static int intersectPacketLeafPackWatertightSSE41(const KernelRayPacket& packet, const float* pack, int count, bool backface, int activeMask, KernelPacketHit& hits)
+{
+    return intersectPacketLeafPackByRay(packet, pack, count, backface, activeMask, hits, intersectLeafPackWatertightSSE41);
+}
+
+const SIMDKernels sse41Kernels = {
+    "SSE4.1",
+    4,
+    intersectLeafPackSSE41,
+    occludedLeafPackSSE41,
+    intersectWideNodeSSE41,
+    intersectCompressedWideNodeSSE41,
+    intersectAABBSSE41,
+    intersectPacketAABBSSE41,
+    intersectPacketLeafPackSSE41,
+    intersectLeafPackWatertightSSE41,
+    occludedLeafPackWatertightSSE41,
+    intersectPacketLeafPackWatertightSSE41,
+};
+
@@ -4,30 +4,72 @@
 #include "scene_object.h"
 #include "camera.h"
 #include "scene.h"
+#include "material.h"
 
 #include <algorithm>
+#include <iostream>
+#include <mutex>
+#include <optional>
+
+// Of the render call that finished last, for getLastRenderStats. Renders on other threads can finish while it is
+// read, so it is only accessed under the mutex, and every render fills stats of its own and copies them in at the end
+static RenderStats lastRenderStats;
+static std::mutex lastRenderStatsMutex;
+
+static void setLastRenderStats(RenderStats&& stats)
+{
+    std::lock_guard<std::mutex> lock(lastRenderStatsMutex);
+    lastRenderStats = std::move(stats);
+}
+
+static void renderImageKeepStats(void* pixels, const Scene& scene, RenderCostMap* costs = nullptr)
+{
+    RenderStats stats;
+    renderImage((Color*)pixels, scene, &stats, costs);
+    setLastRenderStats(std::move(stats));
+}
+
+std::optional<BVHBuildMode> getBVHBuildMode(int bvhBuilder)
+{
+    switch (bvhBuilder) {
+    case BVH_BUILDER_MEDIAN: return BVHBuildMode::Median;
+    case BVH_BUILDER_SAH: return BVHBuildMode::SAH;
+    case BVH_BUILDER_LBVH: return BVHBuildMode::LBVH;
+    default: return std::nullopt;
+    }
+}
 
 ChaosRendererAPI void render(void* pixels, float t)
 {
     Scene scene("D:/dev/raytracing_2023/scenes/scene3.crtscene");
-    renderImage((Color*)pixels, scene);
+    renderImageKeepStats(pixels, scene);
 }
 
 ChaosRendererAPI void renderCamera(void* pixels, float x, float y, float z, float fov, float pan, float tilt, float roll)
 {
-    Scene scene("D:/dev/raytracing_2023/scenes/scene3.crtscene");
+    renderCamera2(pixels, x, y, z, fov, pan, tilt, roll, BVH_BUILDER_FROM_SCENE);
+}
+
+static void setCamera(Scene& scene, float x, float y, float z, float fov, float pan, float tilt, float roll)
+{
     scene.camera = Camera({ x, y, z });
     scene.camera.setFOV(fov);
     scene.camera.setPan(pan);
     scene.camera.setTilt(tilt);
     scene.camera.setRoll(roll);
-    renderImage((Color*)pixels, scene);
+}
+
+ChaosRendererAPI void renderCamera2(void* pixels, float x, float y, float z, float fov, float pan, float tilt, float roll, int bvhBuilder)
+{
+    Scene scene("D:/dev/raytracing_2023/scenes/scene3.crtscene", getBVHBuildMode(bvhBuilder));
+    setCamera(scene, x, y, z, fov, pan, tilt, roll);
+    renderImageKeepStats(pixels, scene);
 }
 
 ChaosRendererAPI void renderFile(void* pixels, const char* fileName)
 {
     Scene scene(fileName);
-    renderImage((Color*)pixels, scene);
+    renderImageKeepStats(pixels, scene);
 }
 
 ChaosRendererAPI void renderFile2(void* pixels, const char* fileName, int width, int height)
@@ -35,7 +77,150 @@ ChaosRendererAPI void renderFile2(void* pixels, const char* fileName, int width,
     Scene scene(fileName);
     if (width) scene.settings.width = width;
     if (height) scene.settings.height = height;
-    renderImage((Color*)pixels, scene);
+    renderImageKeepStats(pixels, scene);
+}
+
+ChaosRendererAPI void renderFile3(void* pixels, const char* fileName, int width, int height, int bvhBuilder)
+{
+    Scene scene(fileName, getBVHBuildMode(bvhBuilder));
+    if (width) scene.settings.width = width;
+    if (height) scene.settings.height = height;
+    renderImageKeepStats(pixels, scene);
+}
+
+ChaosRendererAPI void renderFile4(void* pixels, const char* fileName, int width, int height, int bvhBuilder, int integrator)
+{
+    renderFile5(pixels, fileName, width, height, bvhBuilder, integrator, 0);
+}
+
+ChaosRendererAPI void renderFile5(void* pixels, const char* fileName, int width, int height, int bvhBuilder, int integrator, int renderThreads)
+{
+    Scene scene(fileName, getBVHBuildMode(bvhBuilder));
+    if (width) scene.settings.width = width;
+    if (height) scene.settings.height = height;
+    if (integrator == INTEGRATOR_RECURSIVE) scene.settings.integrator = Integrator::Recursive;
+    if (integrator == INTEGRATOR_WAVEFRONT) scene.settings.integrator = Integrator::Wavefront;
+    if (renderThreads > 0) scene.settings.renderThreads = renderThreads;
+    renderImageKeepStats(pixels, scene);
+}
+
+struct RenderSession {
+    Scene scene;
+    // Of the previous render, to order and split the buckets of the next one
+    RenderCostMap costs;
+};
+
+RenderSession* createRenderSession(const char* fileName, int bvhBuilder)
+{
+    RenderSession* session = new RenderSession{ Scene(fileName, getBVHBuildMode(bvhBuilder)), {} };
+    if (session->scene.objects.empty()) {
+        destroyRenderSession(session);
+        return nullptr;
+    }
+    return session;
+}
+
+void destroyRenderSession(RenderSession* session)
+{
+    if (!session) {
+        return;
+    }
+    // The scene doesn't own its materials
+    for (Material* material : session->scene.materials) {
+        delete material;
+    }
+    delete session;
+}
+
+void setSessionCamera(RenderSession* session, float x, float y, float z, float fov, float pan, float tilt, float roll)
+{
+    setCamera(session->scene, x, y, z, fov, pan, tilt, roll);
+}
+
+void setSessionSettings(RenderSession* session, int width, int height, int integrator, int renderThreads)
+{
+    SceneSettings& settings = session->scene.settings;
+    if (width > 0) settings.width = width;
+    if (height > 0) settings.height = height;
+    if (integrator == INTEGRATOR_RECURSIVE) settings.integrator = Integrator::Recursive;
+    if (integrator == INTEGRATOR_WAVEFRONT) settings.integrator = Integrator::Wavefront;
+    if (renderThreads > 0) settings.renderThreads = renderThreads;
+}
+
+// The albedo of the material, null for a material type without one
+static Color* getAlbedo(Material* material)
+{
+    if (auto* constant = dynamic_cast<ConstantMaterial*>(material)) return &constant->albedo;
+    if (auto* diffuse = dynamic_cast<DiffuseMaterial*>(material)) return &diffuse->albedo;
+    if (auto* reflective = dynamic_cast<ReflectiveMaterial*>(material)) return &reflective->albedo;
+    if (auto* refractive = dynamic_cast<RefractiveMaterial*>(material)) return &refractive->albedo;
+    return nullptr;
+}
+
+int setSessionMaterialAlbedo(RenderSession* session, int material, float r, float g, float b)
+{
+    std::vector<Material*>& materials = session->scene.materials;
+    Color* albedo = material >= 0 && material < int(materials.size()) ? getAlbedo(materials[material]) : nullptr;
+    if (!albedo) {
+        return 0;
+    }
+    *albedo = Color{ r, g, b, albedo->a };
+    return 1;
+}
+
+int setSessionMaterialIOR(RenderSession* session, int material, float ior)
+{
+    std::vector<Material*>& materials = session->scene.materials;
+    auto* refractive = material >= 0 && material < int(materials.size()) ? dynamic_cast<RefractiveMaterial*>(materials[material]) : nullptr;
+    if (!refractive) {
+        return 0;
+    }
+    refractive->IOR = ior;
+    return 1;
+}
+
+void renderSession(RenderSession* session, void* pixels)
+{
+    renderImageKeepStats(pixels, session->scene, &session->costs);
+}
+
+int renderSessionProgressive(RenderSession* session, void* pixels, int passGIRays, ProgressivePassCallback callback, void* userData)
+{
+    return renderSessionProgressive2(session, pixels, nullptr, passGIRays, callback, userData);
+}
+
+int renderSessionProgressive2(RenderSession* session, void* pixels, int* sampleCounts, int passGIRays, ProgressivePassCallback callback, void* userData)
+{
+    RenderStats stats;
+    const int passes = renderProgressive((Color*)pixels, session->scene, passGIRays,
+        [&](const Color* image, const ProgressivePass& pass) {
+            return !callback || callback((const float*)image, pass.index, pass.passCount, pass.giRays, pass.passMs, pass.rmsChange, userData) != 0;
+        },
+        &stats, sampleCounts);
+    setLastRenderStats(std::move(stats));
+    return passes;
+}
+
+void setSessionNoiseThreshold(RenderSession* session, float noiseThreshold)
+{
+    session->scene.settings.noiseThreshold = std::max(noiseThreshold, 0.0f);
+}
+
+void setSessionBuckets(RenderSession* session, int bucketSize, int bucketOrder, int adaptiveBuckets)
+{
+    SceneSettings& settings = session->scene.settings;
+    if (bucketSize > 0) settings.bucketSize = bucketSize;
+    if (bucketOrder == BUCKET_ORDER_RASTER) settings.bucketOrder = BucketOrder::Raster;
+    if (bucketOrder == BUCKET_ORDER_SPIRAL) settings.bucketOrder = BucketOrder::Spiral;
+    if (bucketOrder == BUCKET_ORDER_HILBERT) settings.bucketOrder = BucketOrder::Hilbert;
+    if (bucketOrder == BUCKET_ORDER_COST) settings.bucketOrder = BucketOrder::Cost;
+    if (adaptiveBuckets >= 0) settings.adaptiveBuckets = adaptiveBuckets != 0;
+}
+
+void getSessionSize(RenderSession* session, int* width, int* height)
+{
+    if (width) *width = int(session->scene.settings.width);
+    if (height) *height = int(session->scene.settings.height);
 }
 
 ChaosRendererAPI void render2(void* pixels, const float* vertices, const int* triangleIndices, int trianglesCount)
@@ -61,11 +246,108 @@ ChaosRendererAPI void render2(void* pixels, const float* vertices, const int* tr
 
     Object obj(std::move(ob_vertices), std::move(ob_indices));
     Scene scene;
-    scene.objects.push_back(std::move(obj));
-    renderImage((Color*)pixels, scene);
+    scene.addObject(std::move(obj));
+    scene.buildTLAS();
+    renderImageKeepStats(pixels, scene);
 }
 
 void getSizeFromFile(const char* fileName, int* width, int* height)
 {
     Scene::getSizeFromFile(fileName, *width, *height);
 }
+
+void printSceneStats(const char* fileName)
+{
+    Scene scene(fileName);
+    scene.printStats(std::cout);
+}
+
+void benchmarkRayPackets(const char* fileName, int repeats)
+{
+    Scene scene(fileName);
+    const PrimaryRayBenchmark result = benchmarkPrimaryRays(scene, repeats);
+    const double rays = double(result.rays);
+    std::cout << fileName << " (" << getSIMDKernels().name << ")\n"
+        << "  single rays: " << result.singleMs << " ms, " << rays / result.singleMs / 1000 << " Mrays/s\n"
+        << "  packets:     " << result.packetMs << " ms, " << rays / result.packetMs / 1000 << " Mrays/s, "
+        << 100 * result.packetRays / std::max<uint64_t>(result.rays, 1) << "% of the rays in packets\n"
+        << "  speedup:     " << result.singleMs / result.packetMs << "x, " << result.mismatches << " pixels with different hits\n";
+}
+
+void benchmarkCompressedBVH(const char* fileName, int repeats)
+{
+    Scene scene(fileName);
+    const CompressedBVHBenchmark result = benchmarkCompressedBVH(scene, repeats);
+    const double rays = double(result.rays);
+    const double floatNodesKB = result.wideNodeCount * sizeof(WideBVHNode) / 1024.0;
+    const double compressedNodesKB = result.wideNodeCount * sizeof(CompressedWideBVHNode) / 1024.0;
+    std::cout << fileName << " (" << getSIMDKernels().name << ")\n"
+        << "  wide nodes: " << result.wideNodeCount << ", " << floatNodesKB << " KB float, "
+        << compressedNodesKB << " KB compressed\n"
+        << "  BVH memory: " << result.floatBytes / 1024.0 << " KB float, " << result.compressedBytes / 1024.0 << " KB compressed ("
+        << 100.0 * result.compressedBytes / std::max<size_t>(result.floatBytes, 1) << "%)\n"
+        << "  float:      " << result.floatMs << " ms, " << rays / result.floatMs / 1000 << " Mrays/s\n"
+        << "  compressed: " << result.compressedMs << " ms, " << rays / result.compressedMs / 1000 << " Mrays/s\n"
+        << "  speedup:    " << result.floatMs / result.compressedMs << "x, " << result.mismatches << " pixels with different hits\n";
+}
+
+const char* getSIMDKernelsName()
+{
+    return getSIMDKernels().name;
+}
+
+int castSceneHitSet(const char* fileName, int rayCount, int* objects, int* instances, int* triangles, float* t, float* u, float* v, int* occluded)
+{
+    Scene scene(fileName);
+    if (scene.objects.empty()) {
+        return 0;
+    }
+    const std::vector<HitSetEntry> hits = castHitSet(scene, rayCount);
+    for (size_t i = 0; i < hits.size(); ++i) {
+        objects[i] = hits[i].object;
+        instances[i] = hits[i].instance;
+        triangles[3 * i + 0] = hits[i].triangle.v1;
+        triangles[3 * i + 1] = hits[i].triangle.v2;
+        triangles[3 * i + 2] = hits[i].triangle.v3;
+        t[i] = hits[i].t;
+        u[i] = hits[i].u;
+        v[i] = hits[i].v;
+        occluded[i] = hits[i].occluded;
+    }
+    return 1;
+}
+
+void getLastRenderStats(double* renderMs, unsigned long long* primaryRays, unsigned long long* shadowRays, double* shadowMs)
+{
+    std::lock_guard<std::mutex> lock(lastRenderStatsMutex);
+    if (renderMs) *renderMs = lastRenderStats.renderMs;
+    if (primaryRays) *primaryRays = lastRenderStats.primaryRays;
+    if (shadowRays) *shadowRays = lastRenderStats.shadowRays;
+    if (shadowMs) *shadowMs = lastRenderStats.shadowMs;
+}
+
+double getLastRenderRaysPerSecond()
+{
+    std::lock_guard<std::mutex> lock(lastRenderStatsMutex);
+    const uint64_t rays = lastRenderStats.primaryRays + lastRenderStats.secondaryRays + lastRenderStats.shadowRays;
+    return lastRenderStats.renderMs > 0 ? rays / lastRenderStats.renderMs * 1000 : 0;
+}
+
+int getLastRenderThreadCount()
+{
+    std::lock_guard<std::mutex> lock(lastRenderStatsMutex);
+    return int(lastRenderStats.threads.size());
+}
+
+void getLastRenderThreadStats(int thread, double* busyMs, unsigned long long* buckets, unsigned long long* steals, unsigned long long* splits)
+{
+    std::lock_guard<std::mutex> lock(lastRenderStatsMutex);
+    if (thread < 0 || thread >= int(lastRenderStats.threads.size())) {
+        return;
+    }
+    const RenderThreadStats& stats = lastRenderStats.threads[thread];
+    if (busyMs) *busyMs = stats.busyMs;
+    if (buckets) *buckets = stats.buckets;
+    if (steals) *steals = stats.steals;
+    if (splits) *splits = stats.splits;
+}
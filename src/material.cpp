@@ -1,23 +1,27 @@
 #include "material.h"
 #include "scene.h"
 #include "scene_object.h"
+#include "renderer_lib.h"
 
 #include <random>
+#include <chrono>
 
 const int MAX_DEPTH = 8;
 
 Color ConstantMaterial::shade(const Scene& scene, const Ray& ray, const IntersectionData& idata, int depth) const
 {
-    IntersectionData idataSmooth = smooth_shading ?
-        idata.object->smoothIntersection(idata) :
-        idata;
+    const HitAttributes hit = scene.finalizeHit(ray, idata, smooth_shading);
 
-    const real_t theta = dot(-ray.dir, idataSmooth.normal);
+    const real_t theta = dot(-ray.dir, hit.smoothNormal);
     const real_t val = theta / 3 * 2 + 1.0f / 3;
     return val * albedo;
 }
 
-const int GI_RAYS = 128;
+void ConstantMaterial::queueRays(const Scene& scene, const PathRay& path, const IntersectionData& idata, WavefrontQueue& queue) const
+{
+    queue.pixels[path.pixel] += path.weight * shade(scene, path.ray, idata, path.depth);
+}
+
 const int GI_DEPTH = 1;
 thread_local std::random_device rd;
 thread_local std::mt19937 gen(rd());
@@ -32,69 +36,111 @@ Vector randomUnitVector()
     return { r * std::cos(theta), r * std::sin(theta), z };
 }
 
-Ray generateGIRay(const Ray& incomingRay, const IntersectionData& idata)
+Ray generateGIRay(const Ray& incomingRay, const HitAttributes& hit)
 {
-    Vector reflectedDirection = reflect(incomingRay.dir, idata.normal);
+    Vector reflectedDirection = reflect(incomingRay.dir, hit.smoothNormal);
     Vector newDirection = reflectedDirection + randomUnitVector();
-    return { idata.ip, newDirection, incomingRay.giDepth + 1 };
+    return { hit.smoothIp, newDirection, incomingRay.giDepth + 1 };
+}
+
+// GI rays to trace from a diffuse hit, see SceneSettings::passGIRays
+static int tracedGIRays(const SceneSettings& settings)
+{
+    return settings.passGIRays > 0 ? std::min(settings.passGIRays, settings.giRays) : settings.giRays;
 }
 
 Color DiffuseMaterial::shade(const Scene& scene, const Ray& ray, const IntersectionData& idata, int depth) const
 {
-    IntersectionData idataSmooth = smooth_shading ?
-        idata.object->smoothIntersection(idata) :
-        idata;
+    const HitAttributes hit = scene.finalizeHit(ray, idata, smooth_shading);
 
-    Vector ip = idataSmooth.ip + idataSmooth.normal * shadowBias;
+    Vector ip = hit.smoothIp + hit.smoothNormal * shadowBias;
 
     IntersectionData idata2;
     Color finalColor = { 0,0,0,1 };
 
+    // The whole light loop is timed, a clock read per shadow ray costs about as much as the ray
+    const auto shadowStart = std::chrono::steady_clock::now();
     for (const Light& l : scene.lights) {
         const Vector lightDir = l.position - ip;
         const Ray shadowRay = { ip, normalized(lightDir) };
         bool shadow = scene.intersect(shadowRay, idata2, true, true, lightDir.length());
         if (!shadow) {
-            const real_t cosLaw = std::max(.0f, dot(shadowRay.dir, idataSmooth.normal));
+            const real_t cosLaw = std::max(.0f, dot(shadowRay.dir, hit.smoothNormal));
             const real_t rSqr = lightDir.lengthSqr();
             const real_t area = 4 * PI * rSqr;
             const Color contribution = (l.intensity / area * cosLaw) * albedo;
             finalColor += contribution;
         }
     }
+    RenderStats& stats = threadRenderStats();
+    stats.shadowRays += scene.lights.size();
+    stats.shadowMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - shadowStart).count();
 
     Color giColor = { 0,0,0,1 };
-    int giTraced = 0;
-    if (ray.giDepth < GI_DEPTH) {
-        for (int i = 0; i < GI_RAYS; ++i) {
-            IntersectionData idataGI;
-            const Ray giRay = generateGIRay(ray, idataSmooth);
-            bool intersect = scene.intersect(giRay, idataGI);
-            if (intersect && idataGI.object && idataGI.object->getMaterial()) {
-                giColor += idataGI.object->getMaterial()->shade(scene, giRay, idataGI, depth + 1);
-            }
-            giTraced++;
+    const int giRays = ray.giDepth < GI_DEPTH ? scene.settings.giRays : 0;
+    const int giTraced = giRays ? tracedGIRays(scene.settings) : 0;
+    for (int i = 0; i < giTraced; ++i) {
+        IntersectionData idataGI;
+        const Ray giRay = generateGIRay(ray, hit);
+        bool intersect = scene.intersect(giRay, idataGI);
+        ++threadRenderStats().secondaryRays;
+        if (intersect && idataGI.object && scene.getMaterial(idataGI)) {
+            giColor += scene.getMaterial(idataGI)->shade(scene, giRay, idataGI, depth + 1);
         }
     }
 
     if (scene.lights.empty()) {
-        const real_t theta = dot(-ray.dir, idataSmooth.normal);
+        const real_t theta = dot(-ray.dir, hit.smoothNormal);
         const real_t val = theta / 3 * 2 + 1.0f / 3;
         return val * albedo;
     }
 
-    return (1.0f / (giTraced + 1)) * (finalColor + giColor);
+    // The traced GI rays stand for all giRays
+    const real_t giScale = giTraced ? real_t(giRays) / giTraced : 1;
+    return (1.0f / (giRays + 1)) * (finalColor + giScale * giColor);
+}
+
+void DiffuseMaterial::queueRays(const Scene& scene, const PathRay& path, const IntersectionData& idata, WavefrontQueue& queue) const
+{
+    const HitAttributes hit = scene.finalizeHit(path.ray, idata, smooth_shading);
+
+    if (scene.lights.empty()) {
+        const real_t theta = dot(-path.ray.dir, hit.smoothNormal);
+        const real_t val = theta / 3 * 2 + 1.0f / 3;
+        queue.pixels[path.pixel] += path.weight * (val * albedo);
+        return;
+    }
+
+    // The direct light and every GI ray make the same share of the color. The traced GI rays stand for all giRays
+    const int giRays = path.ray.giDepth < GI_DEPTH ? scene.settings.giRays : 0;
+    const int giTraced = giRays ? tracedGIRays(scene.settings) : 0;
+    const Color weight = (1.0f / (giRays + 1)) * path.weight;
+    const Color giWeight = (giTraced ? real_t(giRays) / giTraced : 1) * weight;
+
+    Vector ip = hit.smoothIp + hit.smoothNormal * shadowBias;
+    for (const Light& l : scene.lights) {
+        const Vector lightDir = l.position - ip;
+        const Ray shadowRay = { ip, normalized(lightDir) };
+        const real_t cosLaw = std::max(.0f, dot(shadowRay.dir, hit.smoothNormal));
+        const real_t rSqr = lightDir.lengthSqr();
+        const real_t area = 4 * PI * rSqr;
+        const Color contribution = (l.intensity / area * cosLaw) * albedo;
+        queue.shadowRays.push_back({ shadowRay, lightDir.length(), weight * contribution, path.pixel });
+    }
+
+    // GI rays that hit nothing add nothing
+    for (int i = 0; i < giTraced; ++i) {
+        queue.rays.push_back({ generateGIRay(path.ray, hit), giWeight, path.pixel, path.depth + 1, false, false });
+    }
 }
 
 Color ReflectiveMaterial::shade(const Scene& scene, const Ray& ray, const IntersectionData& idata, int depth) const
 {
-    IntersectionData idataSmooth = smooth_shading ?
-        idata.object->smoothIntersection(idata) :
-        idata;
+    const HitAttributes hit = scene.finalizeHit(ray, idata, smooth_shading);
 
-    Vector ip = idataSmooth.ip + idataSmooth.normal * shadowBias;
+    Vector ip = hit.smoothIp + hit.smoothNormal * shadowBias;
 
-    const Vector reflectedDir = reflect(ray.dir, idataSmooth.normal);
+    const Vector reflectedDir = reflect(ray.dir, hit.smoothNormal);
     const Ray reflectedRay = { ip, reflectedDir, ray.giDepth };
     IntersectionData idata2;
 
@@ -102,36 +148,72 @@ Color ReflectiveMaterial::shade(const Scene& scene, const Ray& ray, const Inters
     Color reflectedColor = scene.settings.background;
     if (depth < MAX_DEPTH) {
         bool hit = scene.intersect(reflectedRay, idata2);
+        ++threadRenderStats().secondaryRays;
         if (hit && idata2.object) {
-            reflectedColor = idata2.object->getMaterial()->shade(scene, reflectedRay, idata2, depth + 1);
+            reflectedColor = scene.getMaterial(idata2)->shade(scene, reflectedRay, idata2, depth + 1);
         }
     }
 
     return reflectedColor * albedo;
 }
 
-Color RefractiveMaterial::shade(const Scene& scene, const Ray& ray, const IntersectionData& idata, int depth) const
+void ReflectiveMaterial::queueRays(const Scene& scene, const PathRay& path, const IntersectionData& idata, WavefrontQueue& queue) const
 {
-    IntersectionData idataSmooth = smooth_shading ?
-        idata.object->smoothIntersection(idata) :
-        idata;
+    const HitAttributes hit = scene.finalizeHit(path.ray, idata, smooth_shading);
 
-    const bool inside = dot(ray.dir, idata.normal) > 0;
-    const Vector ipIn = idata.ip - idataSmooth.normal * shadowBias;
-    const Vector ipOut = idataSmooth.ip + idataSmooth.normal * shadowBias;
-    const Vector normal = inside ? -idataSmooth.normal : idataSmooth.normal;
-    const real_t ior = inside ? this->IOR : 1 / this->IOR;
+    const Color weight = path.weight * albedo;
+    if (path.depth >= MAX_DEPTH) {
+        queue.pixels[path.pixel] += weight * scene.settings.background;
+        return;
+    }
+
+    Vector ip = hit.smoothIp + hit.smoothNormal * shadowBias;
+    const Ray reflectedRay = { ip, reflect(path.ray.dir, hit.smoothNormal), path.ray.giDepth };
+    queue.rays.push_back({ reflectedRay, weight, path.pixel, path.depth + 1, false, true });
+}
+
+// Secondary rays of a hit on a refractive material
+struct RefractionRays {
+    Ray reflected;
+    Ray refracted;
+    // Share of the reflected ray in the color
+    real_t fresnel;
+};
+
+static RefractionRays refractionRays(const Ray& ray, const HitAttributes& hit, real_t IOR)
+{
+    const bool inside = dot(ray.dir, hit.normal) > 0;
+    const Vector ipIn = hit.ip - hit.smoothNormal * shadowBias;
+    const Vector ipOut = hit.smoothIp + hit.smoothNormal * shadowBias;
+    const Vector normal = inside ? -hit.smoothNormal : hit.smoothNormal;
+    const real_t ior = inside ? IOR : 1 / IOR;
 
-    Color reflectedColor;
     const Vector reflectedDir = normalized(reflect(ray.dir, normal));
     const Ray reflectedRay = { inside ? ipIn : ipOut, reflectedDir, ray.giDepth };
 
+    bool totalInternalReflection = false;
+    const Vector refractedDir = normalized(refract(ray.dir, normal, ior, totalInternalReflection));
+    const Vector refractedRayStart = (inside && !totalInternalReflection) ? ipOut : ipIn;
+    const Ray refractedRay = { refractedRayStart, refractedDir, ray.giDepth };
+
+    const real_t fresnel = 0.5f * std::powf((1 + dot(ray.dir, normal)), 5);
+    return { reflectedRay, refractedRay, fresnel };
+}
+
+Color RefractiveMaterial::shade(const Scene& scene, const Ray& ray, const IntersectionData& idata, int depth) const
+{
+    const HitAttributes hit = scene.finalizeHit(ray, idata, smooth_shading);
+
+    const RefractionRays rays = refractionRays(ray, hit, IOR);
+
+    Color reflectedColor;
     // No point in tracing reflections too deep inside
     if (depth < 2) {
         IntersectionData idata2;
-        bool hit = scene.intersect(reflectedRay, idata2, true);
+        bool hit = scene.intersect(rays.reflected, idata2, true);
+        ++threadRenderStats().secondaryRays;
         if (hit && idata2.object) {
-            reflectedColor = idata2.object->getMaterial()->shade(scene, reflectedRay, idata2, depth + 1);
+            reflectedColor = scene.getMaterial(idata2)->shade(scene, rays.reflected, idata2, depth + 1);
         }
         if (!hit) {
             reflectedColor = scene.settings.background;
@@ -139,23 +221,32 @@ Color RefractiveMaterial::shade(const Scene& scene, const Ray& ray, const Inters
     }
 
     Color refractedColor;
-    bool totalInternalReflection = false;
-    const Vector refractedDir = normalized(refract(ray.dir, normal, ior, totalInternalReflection));
-    const Vector refractedRayStart = (inside && !totalInternalReflection) ? ipOut : ipIn;
-    const Ray refractedRay = { refractedRayStart, refractedDir, ray.giDepth };
-
     if (depth < MAX_DEPTH) {
         IntersectionData idata3;
-        bool hit = scene.intersect(refractedRay, idata3, true);
+        bool hit = scene.intersect(rays.refracted, idata3, true);
+        ++threadRenderStats().secondaryRays;
         if (hit && idata3.object) {
-            refractedColor = idata3.object->getMaterial()->shade(scene, refractedRay, idata3, depth + 1);
+            refractedColor = scene.getMaterial(idata3)->shade(scene, rays.refracted, idata3, depth + 1);
         }
         if (!hit) {
             refractedColor = scene.settings.background;
         }
     }
 
-    const real_t fresnel = 0.5f * std::powf((1 + dot(ray.dir, normal)), 5);
-    Color r = (fresnel * reflectedColor) + (1 - fresnel) * refractedColor;
+    Color r = (rays.fresnel * reflectedColor) + (1 - rays.fresnel) * refractedColor;
     return r * albedo;
 }
+
+void RefractiveMaterial::queueRays(const Scene& scene, const PathRay& path, const IntersectionData& idata, WavefrontQueue& queue) const
+{
+    const HitAttributes hit = scene.finalizeHit(path.ray, idata, smooth_shading);
+
+    const RefractionRays rays = refractionRays(path.ray, hit, IOR);
+    const Color weight = path.weight * albedo;
+    if (path.depth < 2) {
+        queue.rays.push_back({ rays.reflected, rays.fresnel * weight, path.pixel, path.depth + 1, true, true });
+    }
+    if (path.depth < MAX_DEPTH) {
+        queue.rays.push_back({ rays.refracted, (1 - rays.fresnel) * weight, path.pixel, path.depth + 1, true, true });
+    }
+}
@@ -0,0 +1,199 @@
+#include "render_thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+
+// Halves smaller than this are not worth the cost of a bucket
+const size_t MIN_SPLIT_PIXELS = 64;
+
+RenderThreadPool::RenderThreadPool(unsigned threadCount)
+{
+    if (threadCount == 0) {
+        threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    threadStats.resize(threadCount);
+    for (unsigned i = 0; i < threadCount; ++i) {
+        queues.push_back(std::make_unique<BucketQueue>());
+    }
+    for (unsigned i = 0; i < threadCount; ++i) {
+        threads.emplace_back(&RenderThreadPool::threadMain, this, i);
+    }
+}
+
+RenderThreadPool::~RenderThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    startCondition.notify_all();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+std::vector<RenderThreadStats> RenderThreadPool::run(const std::vector<Bucket>& buckets, size_t tileWidth, size_t tileHeight, bool interleaved, const BucketWork& work)
+{
+    std::lock_guard<std::mutex> runLock(runMutex);
+
+    // Contiguous runs, so that each thread starts on its own part of the image, unless interleaved
+    const size_t threadCount = threads.size();
+    for (size_t i = 0; i < threadCount; ++i) {
+        BucketQueue& queue = *queues[i];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (interleaved) {
+            queue.buckets.clear();
+            for (size_t j = i; j < buckets.size(); j += threadCount) {
+                queue.buckets.push_back(buckets[j]);
+            }
+        }
+        else {
+            queue.buckets.assign(buckets.begin() + buckets.size() * i / threadCount, buckets.begin() + buckets.size() * (i + 1) / threadCount);
+        }
+    }
+    threadStats.assign(threadCount, {});
+    unfinishedBuckets = buckets.size();
+    queuedBuckets = buckets.size();
+    this->work = &work;
+    this->tileWidth = std::max<size_t>(tileWidth, 1);
+    this->tileHeight = std::max<size_t>(tileHeight, 1);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finishedThreads = 0;
+    ++runIndex;
+    startCondition.notify_all();
+    doneCondition.wait(lock, [&] { return finishedThreads == threadCount; });
+    this->work = nullptr;
+    return threadStats;
+}
+
+void RenderThreadPool::threadMain(unsigned index)
+{
+    uint64_t lastRun = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            startCondition.wait(lock, [&] { return stopping || runIndex != lastRun; });
+            if (stopping) {
+                return;
+            }
+            lastRun = runIndex;
+        }
+        runBuckets(index);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (++finishedThreads == threads.size()) {
+                doneCondition.notify_one();
+            }
+        }
+    }
+}
+
+void RenderThreadPool::runBuckets(unsigned index)
+{
+    RenderThreadStats& stats = threadStats[index];
+    while (unfinishedBuckets.load() > 0) {
+        Bucket bucket;
+        bool stolen = false;
+        if (!popBucket(index, bucket)) {
+            stolen = stealBucket(index, bucket);
+            if (!stolen) {
+                // The last buckets are still being rendered, and may be split yet
+                std::unique_lock<std::mutex> lock(idleMutex);
+                idleCondition.wait(lock, [&] { return queuedBuckets.load() > 0 || unfinishedBuckets.load() == 0; });
+                continue;
+            }
+        }
+        stats.steals += stolen;
+
+        // Some threads will find the queues empty before this bucket is done, leave them halves of it
+        // while it is big enough
+        Bucket half;
+        bool split = false;
+        while (queuedBuckets.load() < threads.size() && splitBucket(bucket, half, tileWidth, tileHeight)) {
+            ++unfinishedBuckets;
+            BucketQueue& queue = *queues[index];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.buckets.push_back(half);
+            // Counted once in the queue, so that a waiting thread that sees it can take it
+            ++queuedBuckets;
+            ++stats.splits;
+            split = true;
+        }
+        if (split) {
+            notifyIdleThreads();
+        }
+
+        const auto startTime = std::chrono::steady_clock::now();
+        (*work)(bucket, index);
+        stats.busyMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+        ++stats.buckets;
+        if (--unfinishedBuckets == 0) {
+            notifyIdleThreads();
+        }
+    }
+}
+
+void RenderThreadPool::notifyIdleThreads()
+{
+    // The counters the waiting threads check are changed outside of the mutex. Taking it here makes sure that a thread
+    // that has checked them before the change is already waiting, and gets the notification
+    {
+        std::lock_guard<std::mutex> lock(idleMutex);
+    }
+    idleCondition.notify_all();
+}
+
+bool RenderThreadPool::popBucket(unsigned index, Bucket& bucket)
+{
+    BucketQueue& queue = *queues[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.buckets.empty()) {
+        return false;
+    }
+    bucket = queue.buckets.front();
+    queue.buckets.pop_front();
+    --queuedBuckets;
+    return true;
+}
+
+// From the back of the next queues in turn, the buckets there are the farthest from where their thread works
+bool RenderThreadPool::stealBucket(unsigned index, Bucket& bucket)
+{
+    const size_t threadCount = queues.size();
+    for (size_t i = 1; i < threadCount; ++i) {
+        BucketQueue& queue = *queues[(index + i) % threadCount];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.buckets.empty()) {
+            bucket = queue.buckets.back();
+            queue.buckets.pop_back();
+            --queuedBuckets;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool splitBucket(Bucket& bucket, Bucket& half, size_t tileWidth, size_t tileHeight)
+{
+    const bool splitWidth = bucket.w >= bucket.h;
+    const size_t side = splitWidth ? bucket.w : bucket.h;
+    const size_t tile = splitWidth ? tileWidth : tileHeight;
+    const size_t first = side / 2 / tile * tile;
+    const size_t otherSide = splitWidth ? bucket.h : bucket.w;
+    if (first == 0 || std::min(first, side - first) * otherSide < MIN_SPLIT_PIXELS) {
+        return false;
+    }
+    half = bucket;
+    if (splitWidth) {
+        half.x += first;
+        half.w -= first;
+        bucket.w = first;
+    }
+    else {
+        half.y += first;
+        half.h -= first;
+        bucket.h = first;
+    }
+    return true;
+}
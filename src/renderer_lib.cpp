@@ -4,11 +4,17 @@
 #include "scene_object.h"
 #include "camera.h"
 #include "scene.h"
+#include "material.h"
+#include "render_thread_pool.h"
 
 #include <vector>
 #include <cmath>
 #include <algorithm>
 #include <execution>
+#include <chrono>
+#include <mutex>
+#include <tuple>
+#include <random>
 
 std::vector<Bucket> generate_buckets(const Scene& scene)
 {
@@ -66,47 +72,764 @@ std::vector<Bucket> generate_buckets(const Scene& scene)
     return buckets;
 }
 
-void renderBucket(Color* pixels, const Bucket& bucket, const Scene& scene)
+RenderStats& threadRenderStats()
+{
+    thread_local RenderStats stats;
+    return stats;
+}
+
+static void addRenderStats(RenderStats& total, const RenderStats& stats)
+{
+    total.primaryRays += stats.primaryRays;
+    total.packetRays += stats.packetRays;
+    total.secondaryRays += stats.secondaryRays;
+    total.shadowRays += stats.shadowRays;
+    total.shadowMs += stats.shadowMs;
+}
+
+// Camera rays are traced in tiles of pixels, one packet per tile
+const int PACKET_TILE_WIDTH = 4;
+const int PACKET_TILE_HEIGHT = RAY_PACKET_SIZE / PACKET_TILE_WIDTH;
+
+static unsigned renderThreadCount(const Scene& scene)
+{
+    return scene.settings.renderThreads ? scene.settings.renderThreads : std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+/// <summary>
+/// Call work for every bucket on the render threads, see RenderThreadPool::run. The threads are kept
+/// for the next calls, and started again only when the thread count of the scene changes
+/// </summary>
+/// <param name="tileWidth, tileHeight"> The pool splits buckets only at multiples of this size from their corner </param>
+static std::vector<RenderThreadStats> runOnRenderThreads(const Scene& scene, const std::vector<Bucket>& buckets, bool interleaved, const RenderThreadPool::BucketWork& work,
+    size_t tileWidth = PACKET_TILE_WIDTH, size_t tileHeight = PACKET_TILE_HEIGHT)
+{
+    static std::mutex poolMutex;
+    // Never destroyed: joining threads while the library is unloaded can deadlock on Windows
+    static RenderThreadPool* pool = nullptr;
+
+    std::lock_guard<std::mutex> lock(poolMutex);
+    const unsigned threadCount = renderThreadCount(scene);
+    if (!pool || pool->getThreadCount() != threadCount) {
+        delete pool;
+        pool = new RenderThreadPool(threadCount);
+    }
+    return pool->run(buckets, tileWidth, tileHeight, interleaved, work);
+}
+
+// Rays with directions in the same octant enter the boxes through the same planes,
+// so they visit mostly the same nodes in the same order
+static bool coherentRays(const Ray rays[RAY_PACKET_SIZE], int mask)
+{
+    int first = -1;
+    for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+        if (!(mask & (1 << i))) {
+            continue;
+        }
+        if (first < 0) {
+            first = i;
+            continue;
+        }
+        for (int axis = 0; axis < 3; ++axis) {
+            if ((rays[i].dir[axis] < 0) != (rays[first].dir[axis] < 0)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/// <summary>
+/// Closest hits of the camera rays of the tile of pixels at (x, y), traced as a packet if they are coherent
+/// </summary>
+/// <param name="activePixels"> Flags of the pixels of the image to trace, null to trace all </param>
+/// <param name="activeMask"> Set to the mask of the pixels of the tile inside the bucket that are traced </param>
+/// <param name="packet"> Set to whether the rays were traced as a packet </param>
+/// <returns> Mask of the pixels whose rays hit something </returns>
+static int traceCameraTile(const Scene& scene, const Bucket& bucket, size_t x, size_t y, bool packets, const char* activePixels,
+    Ray rays[RAY_PACKET_SIZE], IntersectionData idata[RAY_PACKET_SIZE], int& activeMask, bool& packet)
+{
+    const size_t WIDTH = scene.settings.width;
+    const size_t HEIGHT = scene.settings.height;
+    activeMask = 0;
+    for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+        const size_t px = x + i % PACKET_TILE_WIDTH;
+        const size_t py = y + i / PACKET_TILE_WIDTH;
+        if (px >= bucket.x + bucket.w || py >= bucket.y + bucket.h) {
+            continue;
+        }
+        if (activePixels && !activePixels[py * WIDTH + px]) {
+            continue;
+        }
+        #ifndef NDEBUG
+        if (py != HEIGHT / 2 || px != WIDTH / 2) continue;
+        #endif
+        rays[i] = scene.camera.generateCameraRay(WIDTH, HEIGHT, int(px), int(py));
+        activeMask |= 1 << i;
+    }
+
+    packet = packets && coherentRays(rays, activeMask);
+    if (packet) {
+        return scene.intersectPacket(rays, idata, activeMask);
+    }
+    int hitMask = 0;
+    for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+        if ((activeMask & (1 << i)) && scene.intersect(rays[i], idata[i])) {
+            hitMask |= 1 << i;
+        }
+    }
+    return hitMask;
+}
+
+// activePixels as in traceCameraTile
+void renderBucket(Color* pixels, const Bucket& bucket, const Scene& scene, const char* activePixels)
+{
+    const size_t WIDTH = scene.settings.width;
+    RenderStats& stats = threadRenderStats();
+    for (size_t y = bucket.y; y < bucket.y + bucket.h; y += PACKET_TILE_HEIGHT) {
+        for (size_t x = bucket.x; x < bucket.x + bucket.w; x += PACKET_TILE_WIDTH) {
+            Ray rays[RAY_PACKET_SIZE];
+            IntersectionData idata[RAY_PACKET_SIZE];
+            int activeMask;
+            bool packet;
+            const int hitMask = traceCameraTile(scene, bucket, x, y, scene.settings.rayPackets, activePixels, rays, idata, activeMask, packet);
+            for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+                if (!(activeMask & (1 << i))) {
+                    continue;
+                }
+                Color& pixel = pixels[(y + i / PACKET_TILE_WIDTH) * WIDTH + x + i % PACKET_TILE_WIDTH];
+                pixel = (hitMask & (1 << i)) ? scene.shade(rays[i], idata[i]) : scene.settings.background;
+                ++stats.primaryRays;
+                stats.packetRays += packet;
+            }
+        }
+    }
+}
+
+// Wavefront integrator
+
+// Morton code of the origin cell, at 9 bits per axis, then the octant of the direction. Rays with close keys
+// start near each other and go the same way, so they visit mostly the same nodes and triangles
+static uint32_t raySortKey(const Ray& ray, const AABB& sceneBounds)
+{
+    real_t cell[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        const real_t extent = sceneBounds.max[axis] - sceneBounds.min[axis];
+        cell[axis] = extent > 0 ? (ray.origin[axis] - sceneBounds.min[axis]) / extent : 0;
+    }
+    const uint32_t octant = (ray.dir.x < 0 ? 4 : 0) | (ray.dir.y < 0 ? 2 : 0) | (ray.dir.z < 0 ? 1 : 0);
+    return (mortonCode(cell[0], cell[1], cell[2]) & ~7u) | octant;
+}
+
+// Sort PathRays or ShadowRays by raySortKey
+template <typename QueuedRay>
+static void sortRays(std::vector<QueuedRay>& rays, const AABB& sceneBounds)
+{
+    std::vector<uint64_t> keys(rays.size());
+    for (size_t i = 0; i < rays.size(); ++i) {
+        keys[i] = (uint64_t(raySortKey(rays[i].ray, sceneBounds)) << 32) | i;
+    }
+    // A bucket's rays are sorted on its own render thread
+    radixSortMortonKeys(keys, 1);
+    std::vector<QueuedRay> sorted(rays.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        sorted[i] = rays[uint32_t(keys[i])];
+    }
+    rays.swap(sorted);
+}
+
+// Closest hits of a stream of rays. Runs of coherent rays are traced as packets
+static void tracePathRays(const Scene& scene, const std::vector<PathRay>& rays, std::vector<IntersectionData>& idata, std::vector<char>& hit)
+{
+    idata.resize(rays.size());
+    hit.assign(rays.size(), false);
+    for (size_t first = 0; first < rays.size(); first += RAY_PACKET_SIZE) {
+        const int count = int(std::min<size_t>(RAY_PACKET_SIZE, rays.size() - first));
+        Ray packet[RAY_PACKET_SIZE];
+        bool sameBackface = true;
+        for (int i = 0; i < count; ++i) {
+            packet[i] = rays[first + i].ray;
+            sameBackface = sameBackface && rays[first + i].backface == rays[first].backface;
+        }
+        const int activeMask = (1 << count) - 1;
+        if (scene.settings.rayPackets && count > 1 && sameBackface && coherentRays(packet, activeMask)) {
+            // The packet uses all of its lanes, the last one of the stream may be shorter
+            IntersectionData packetIdata[RAY_PACKET_SIZE];
+            const int hitMask = scene.intersectPacket(packet, packetIdata, activeMask, rays[first].backface);
+            for (int i = 0; i < count; ++i) {
+                idata[first + i] = packetIdata[i];
+                hit[first + i] = (hitMask & (1 << i)) != 0;
+            }
+            continue;
+        }
+        for (int i = 0; i < count; ++i) {
+            hit[first + i] = scene.intersect(packet[i], idata[first + i], rays[first + i].backface);
+        }
+    }
+}
+
+/// <summary>
+/// Render a bucket with the wavefront integrator. All rays of a generation (camera rays, then the rays
+/// their hits spawn, and so on) are traced before any of the next, sorted by raySortKey, and their hits
+/// are shaded grouped by material. Gives the same image as renderBucket, up to the noise of the GI rays
+/// </summary>
+/// <param name="sceneBounds"> Bounds of the scene instances, for sorting the rays </param>
+/// <param name="activePixels"> As in traceCameraTile </param>
+static void renderBucketWavefront(Color* pixels, const Bucket& bucket, const Scene& scene, const AABB& sceneBounds, const char* activePixels)
 {
     const size_t WIDTH = scene.settings.width;
     const size_t HEIGHT = scene.settings.height;
-    IntersectionData idata;
-    for (int y = int(bucket.y); y < bucket.y + bucket.h; y++) {
-        for (int x = int(bucket.x); x < bucket.x + bucket.w; x++) {
+    RenderStats& stats = threadRenderStats();
+
+    WavefrontQueue queue;
+    queue.pixels.assign(bucket.w * bucket.h, Color{ 0, 0, 0, 1 });
+    for (size_t y = 0; y < bucket.h; ++y) {
+        for (size_t x = 0; x < bucket.w; ++x) {
             #ifndef NDEBUG
-            if (y != HEIGHT / 2) break;
-            if (x != WIDTH / 2) continue;
+            if (bucket.y + y != HEIGHT / 2 || bucket.x + x != WIDTH / 2) continue;
             #endif
-            Ray ray = scene.camera.generateCameraRay(WIDTH, HEIGHT, x, y);
-            const bool intersection = scene.intersect(ray, idata);
-            if (intersection) {
-                pixels[y * WIDTH + x] = scene.shade(ray, idata);
+            if (activePixels && !activePixels[(bucket.y + y) * WIDTH + bucket.x + x]) {
+                continue;
             }
-            else {
-                pixels[y * WIDTH + x] = scene.settings.background;
+            const Ray ray = scene.camera.generateCameraRay(WIDTH, HEIGHT, int(bucket.x + x), int(bucket.y + y));
+            queue.rays.push_back({ ray, Color{ 1, 1, 1, 1 }, int(y * bucket.w + x), 0, false, true });
+        }
+    }
+    stats.primaryRays += queue.rays.size();
+
+    std::vector<PathRay> rays;
+    std::vector<ShadowRay> shadowRays;
+    std::vector<IntersectionData> idata;
+    std::vector<char> hit;
+    std::vector<std::pair<const Material*, int>> shadeOrder;
+    for (int generation = 0; !queue.rays.empty(); ++generation) {
+        rays.swap(queue.rays);
+        queue.rays.clear();
+        // Camera rays are generated in scanline order, which is coherent already
+        if (generation > 0) {
+            sortRays(rays, sceneBounds);
+            stats.secondaryRays += rays.size();
+        }
+        tracePathRays(scene, rays, idata, hit);
+
+        // Shade grouped by material, so runs of hits go through the same code with the same material data
+        shadeOrder.clear();
+        for (int i = 0; i < int(rays.size()); ++i) {
+            const PathRay& path = rays[i];
+            if (!hit[i]) {
+                if (path.missBackground) {
+                    queue.pixels[path.pixel] += path.weight * scene.settings.background;
+                }
+                continue;
+            }
+            const Material* material = scene.getMaterial(idata[i]);
+            if (material) {
+                shadeOrder.push_back({ material, i });
+            }
+            else if (path.depth == 0) {
+                // As in Scene::shade
+                queue.pixels[path.pixel] += Color{ 1, 0, 1, 1 };
+            }
+        }
+        std::stable_sort(shadeOrder.begin(), shadeOrder.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        for (const auto& [material, i] : shadeOrder) {
+            material->queueRays(scene, rays[i], idata[i], queue);
+        }
+
+        // Shadow rays of the hits of this generation
+        const auto shadowStart = std::chrono::steady_clock::now();
+        shadowRays.swap(queue.shadowRays);
+        queue.shadowRays.clear();
+        sortRays(shadowRays, sceneBounds);
+        IntersectionData shadowIdata;
+        for (const ShadowRay& shadowRay : shadowRays) {
+            if (!scene.intersect(shadowRay.ray, shadowIdata, true, true, shadowRay.maxT)) {
+                queue.pixels[shadowRay.pixel] += shadowRay.contribution;
+            }
+        }
+        stats.shadowRays += shadowRays.size();
+        stats.shadowMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - shadowStart).count();
+    }
+
+    for (size_t y = 0; y < bucket.h; ++y) {
+        for (size_t x = 0; x < bucket.w; ++x) {
+            const size_t pixel = (bucket.y + y) * WIDTH + bucket.x + x;
+            if (!activePixels || activePixels[pixel]) {
+                pixels[pixel] = queue.pixels[y * bucket.w + x];
             }
         }
     }
 }
 
+// Closest hit of a pixel, and whether it was traced in a packet
+struct PixelHit {
+    const Object* object = nullptr;
+    const Instance* instance = nullptr;
+    int triangle = -1;
+    real_t t = 0;
+    bool packet = false;
+};
 
-void renderImage(Color* pixels, const Scene& scene)
+static bool sameHit(const PixelHit& a, const PixelHit& b)
+{
+    return a.object == b.object && a.instance == b.instance && a.triangle == b.triangle &&
+        std::abs(a.t - b.t) <= 1e-4f * std::max(a.t, real_t(1));
+}
+
+// Closest hits of the camera rays of every pixel, without shading
+static void traceCameraRays(const Scene& scene, const std::vector<Bucket>& buckets, bool packets, std::vector<PixelHit>& hits)
+{
+    const size_t WIDTH = scene.settings.width;
+    runOnRenderThreads(
+        scene,
+        buckets,
+        false,
+        [&](const Bucket& bucket, unsigned) {
+            for (size_t y = bucket.y; y < bucket.y + bucket.h; y += PACKET_TILE_HEIGHT) {
+                for (size_t x = bucket.x; x < bucket.x + bucket.w; x += PACKET_TILE_WIDTH) {
+                    Ray rays[RAY_PACKET_SIZE];
+                    IntersectionData idata[RAY_PACKET_SIZE];
+                    int activeMask;
+                    bool packet;
+                    const int hitMask = traceCameraTile(scene, bucket, x, y, packets, nullptr, rays, idata, activeMask, packet);
+                    for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+                        if (!(activeMask & (1 << i))) {
+                            continue;
+                        }
+                        PixelHit& hit = hits[(y + i / PACKET_TILE_WIDTH) * WIDTH + x + i % PACKET_TILE_WIDTH];
+                        hit = {};
+                        hit.packet = packet;
+                        if (hitMask & (1 << i)) {
+                            hit = { idata[i].object, idata[i].instance, idata[i].triangle_index, idata[i].t, packet };
+                        }
+                    }
+                }
+            }
+        }
+    );
+}
+
+// The fastest of the repeats of traceCameraRays, the first one also warms up the caches
+static double timeCameraRays(const Scene& scene, const std::vector<Bucket>& buckets, bool packets, int repeats, std::vector<PixelHit>& hits)
+{
+    hits.resize(scene.settings.width * scene.settings.height);
+    double bestMs = 1e30;
+    for (int i = 0; i < std::max(repeats, 1); ++i) {
+        const auto startTime = std::chrono::steady_clock::now();
+        traceCameraRays(scene, buckets, packets, hits);
+        bestMs = std::min(bestMs, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count());
+    }
+    return bestMs;
+}
+
+PrimaryRayBenchmark benchmarkPrimaryRays(const Scene& scene, int repeats)
+{
+    const std::vector<Bucket> buckets = generate_buckets(scene);
+
+    std::vector<PixelHit> singleHits;
+    std::vector<PixelHit> packetHits;
+    PrimaryRayBenchmark result;
+    result.singleMs = timeCameraRays(scene, buckets, false, repeats, singleHits);
+    result.packetMs = timeCameraRays(scene, buckets, true, repeats, packetHits);
+    for (size_t i = 0; i < singleHits.size(); ++i) {
+        ++result.rays;
+        result.packetRays += packetHits[i].packet;
+        result.mismatches += !sameHit(singleHits[i], packetHits[i]);
+    }
+    return result;
+}
+
+CompressedBVHBenchmark benchmarkCompressedBVH(Scene& scene, int repeats)
+{
+    const std::vector<Bucket> buckets = generate_buckets(scene);
+
+    // Restored at the end
+    std::vector<std::pair<bool, bool>> layouts;
+    for (const Object& object : scene.objects) {
+        layouts.push_back({ object.getBVHStats().wideNodeCount > 0, object.getBVHStats().compressed });
+    }
+
+    auto setLayout = [&](bool compressed, size_t& memoryBytes) {
+        memoryBytes = 0;
+        for (Object& object : scene.objects) {
+            object.setWideBVHLayout(true, compressed);
+            memoryBytes += object.getBVHStats().memoryBytes;
+        }
+    };
+
+    // One ray at a time, packets traverse the binary BVH
+    CompressedBVHBenchmark result;
+    std::vector<PixelHit> floatHits;
+    std::vector<PixelHit> compressedHits;
+    setLayout(false, result.floatBytes);
+    result.floatMs = timeCameraRays(scene, buckets, false, repeats, floatHits);
+    setLayout(true, result.compressedBytes);
+    result.compressedMs = timeCameraRays(scene, buckets, false, repeats, compressedHits);
+    for (const Object& object : scene.objects) {
+        result.wideNodeCount += object.getBVHStats().wideNodeCount;
+    }
+    for (size_t i = 0; i < floatHits.size(); ++i) {
+        ++result.rays;
+        result.mismatches += !sameHit(floatHits[i], compressedHits[i]);
+    }
+
+    for (size_t i = 0; i < scene.objects.size(); ++i) {
+        scene.objects[i].setWideBVHLayout(layouts[i].first, layouts[i].second);
+    }
+    return result;
+}
+
+std::vector<HitSetEntry> castHitSet(const Scene& scene, int rayCount)
+{
+    AABB sceneBounds;
+    for (const Instance& instance : scene.instances) {
+        sceneBounds.expand(instance.bounds);
+    }
+    std::vector<HitSetEntry> hits(std::max(rayCount, 0));
+    if (scene.instances.empty()) {
+        return hits;
+    }
+    const Vector center = (sceneBounds.min + sceneBounds.max) * 0.5f;
+    const real_t radius = std::max(distance(sceneBounds.min, sceneBounds.max), real_t(1e-3f));
+
+    std::mt19937 generator(2023);
+    std::uniform_real_distribution<real_t> unit(0, 1);
+    auto pointInBounds = [&]() {
+        return Vector{
+            sceneBounds.min.x + unit(generator) * (sceneBounds.max.x - sceneBounds.min.x),
+            sceneBounds.min.y + unit(generator) * (sceneBounds.max.y - sceneBounds.min.y),
+            sceneBounds.min.z + unit(generator) * (sceneBounds.max.z - sceneBounds.min.z),
+        };
+    };
+    auto randomDirection = [&]() {
+        const real_t z = 2 * unit(generator) - 1;
+        const real_t angle = 2 * PI * unit(generator);
+        const real_t r = std::sqrt(std::max(1 - z * z, real_t(0)));
+        return Vector{ r * std::cos(angle), r * std::sin(angle), z };
+    };
+
+    for (size_t i = 0; i < hits.size(); ++i) {
+        Ray ray;
+        real_t length;
+        if (i % 2 == 0) {
+            ray.origin = center + randomDirection() * radius;
+            const Vector target = pointInBounds();
+            length = distance(ray.origin, target);
+            ray.dir = normalized(target - ray.origin);
+        }
+        else {
+            ray.origin = pointInBounds();
+            ray.dir = randomDirection();
+            length = radius;
+        }
+
+        HitSetEntry& hit = hits[i];
+        IntersectionData idata;
+        if (scene.intersect(ray, idata)) {
+            hit.object = int(idata.object - scene.objects.data());
+            hit.instance = idata.instance ? int(idata.instance - scene.instances.data()) : -1;
+            hit.triangle = idata.object->getTriangle(idata.triangle_index);
+            hit.t = idata.t;
+            hit.u = idata.u;
+            hit.v = idata.v;
+        }
+        IntersectionData occlusion;
+        hit.occluded = scene.intersect(ray, occlusion, false, true, length);
+    }
+    return hits;
+}
+
+// Bucket scheduling
+
+// A bucket is split until it is expected to take at most this share of the time of a render thread
+const double ADAPTIVE_BUCKET_SHARE = 1.0 / 16;
+
+static size_t costColumns(size_t width)
+{
+    return (width + RENDER_COST_CELL_SIZE - 1) / RENDER_COST_CELL_SIZE;
+}
+
+static size_t costRows(size_t height)
+{
+    return (height + RENDER_COST_CELL_SIZE - 1) / RENDER_COST_CELL_SIZE;
+}
+
+static void resetRenderCosts(RenderCostMap& costs, const Scene& scene)
+{
+    costs.width = scene.settings.width;
+    costs.height = scene.settings.height;
+    costs.cellMs.assign(costColumns(costs.width) * costRows(costs.height), 0);
+}
+
+/// <summary>
+/// Call visit(cell, share) for the cells of the cost map the bucket overlaps,
+/// with the share of the pixels of the cell that are in the bucket
+/// </summary>
+template <typename Visit>
+static void visitCostCells(const RenderCostMap& costs, const Bucket& bucket, Visit visit)
+{
+    const size_t columns = costColumns(costs.width);
+    for (size_t row = bucket.y / RENDER_COST_CELL_SIZE; row * RENDER_COST_CELL_SIZE < bucket.y + bucket.h; ++row) {
+        for (size_t column = bucket.x / RENDER_COST_CELL_SIZE; column * RENDER_COST_CELL_SIZE < bucket.x + bucket.w; ++column) {
+            const size_t x0 = column * RENDER_COST_CELL_SIZE;
+            const size_t y0 = row * RENDER_COST_CELL_SIZE;
+            const size_t x1 = std::min(x0 + RENDER_COST_CELL_SIZE, costs.width);
+            const size_t y1 = std::min(y0 + RENDER_COST_CELL_SIZE, costs.height);
+            const size_t overlapWidth = std::min(x1, bucket.x + bucket.w) - std::max(x0, bucket.x);
+            const size_t overlapHeight = std::min(y1, bucket.y + bucket.h) - std::max(y0, bucket.y);
+            visit(row * columns + column, double(overlapWidth * overlapHeight) / double((x1 - x0) * (y1 - y0)));
+        }
+    }
+}
+
+static double bucketCost(const RenderCostMap& costs, const Bucket& bucket)
+{
+    double ms = 0;
+    visitCostCells(costs, bucket, [&](size_t cell, double share) { ms += share * costs.cellMs[cell]; });
+    return ms;
+}
+
+// Spread the time of a bucket over its cells, by their share of its pixels
+static void addBucketCost(RenderCostMap& costs, const Bucket& bucket, double ms)
+{
+    const double pixelMs = ms / double(std::max<size_t>(bucket.w * bucket.h, 1));
+    visitCostCells(costs, bucket, [&](size_t cell, double share) {
+        const size_t column = cell % costColumns(costs.width);
+        const size_t row = cell / costColumns(costs.width);
+        const size_t cellPixels = (std::min((column + 1) * RENDER_COST_CELL_SIZE, costs.width) - column * RENDER_COST_CELL_SIZE) *
+            (std::min((row + 1) * RENDER_COST_CELL_SIZE, costs.height) - row * RENDER_COST_CELL_SIZE);
+        costs.cellMs[cell] += pixelMs * share * cellPixels;
+    });
+}
+
+/// <summary>
+/// Estimate the cost of every cell by shading the pixel at its center, on the render threads. It costs about
+/// one pixel in RENDER_COST_CELL_SIZE squared of the render, and doesn't need a previous render of the scene
+/// </summary>
+static RenderCostMap estimateRenderCosts(const Scene& scene)
 {
     const size_t WIDTH = scene.settings.width;
     const size_t HEIGHT = scene.settings.height;
+    RenderCostMap costs;
+    resetRenderCosts(costs, scene);
+
+    // A row of cells at a time. The pool splits the last rows of the run for idle threads, at cell boundaries,
+    // so every cell is in one bucket only
+    std::vector<Bucket> rows;
+    for (size_t y = 0; y < HEIGHT; y += RENDER_COST_CELL_SIZE) {
+        rows.push_back({ 0, y, WIDTH, std::min(RENDER_COST_CELL_SIZE, HEIGHT - y) });
+    }
+    runOnRenderThreads(
+        scene,
+        rows,
+        false,
+        [&](const Bucket& row, unsigned) {
+            for (size_t x = row.x; x < row.x + row.w; x += RENDER_COST_CELL_SIZE) {
+                const Bucket cell{ x, row.y, std::min(RENDER_COST_CELL_SIZE, WIDTH - x), row.h };
+                const auto startTime = std::chrono::steady_clock::now();
+                const Ray ray = scene.camera.generateCameraRay(WIDTH, HEIGHT, int(cell.x + cell.w / 2), int(cell.y + cell.h / 2));
+                IntersectionData idata;
+                if (scene.intersect(ray, idata)) {
+                    scene.shade(ray, idata);
+                }
+                const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+                costs.cellMs[(cell.y / RENDER_COST_CELL_SIZE) * costColumns(WIDTH) + x / RENDER_COST_CELL_SIZE] = ms * cell.w * cell.h;
+            }
+        },
+        RENDER_COST_CELL_SIZE,
+        RENDER_COST_CELL_SIZE
+    );
+    return costs;
+}
+
+// Split the buckets that are expected to take longer than ADAPTIVE_BUCKET_SHARE of the time of a thread
+static void splitCostlyBuckets(std::vector<Bucket>& buckets, const RenderCostMap& costs, unsigned threadCount)
+{
+    double totalMs = 0;
+    for (const Bucket& bucket : buckets) {
+        totalMs += bucketCost(costs, bucket);
+    }
+    const double maxMs = totalMs / std::max(threadCount, 1u) * ADAPTIVE_BUCKET_SHARE;
+
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        Bucket half;
+        while (bucketCost(costs, buckets[i]) > maxMs && splitBucket(buckets[i], half, PACKET_TILE_WIDTH, PACKET_TILE_HEIGHT)) {
+            buckets.push_back(half);
+        }
+    }
+}
+
+// Index of cell (x, y) along the Hilbert curve that fills a grid of size x size cells, size a power of 2
+static uint64_t hilbertIndex(uint32_t size, uint32_t x, uint32_t y)
+{
+    uint64_t index = 0;
+    for (uint32_t s = size / 2; s > 0; s /= 2) {
+        const uint32_t rx = (x & s) > 0;
+        const uint32_t ry = (y & s) > 0;
+        index += uint64_t(s) * s * ((3 * rx) ^ ry);
+        // Rotate the quadrant, so that the curve in it starts next to where the previous one ended
+        if (ry == 0) {
+            if (rx == 1) {
+                x = size - 1 - x;
+                y = size - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return index;
+}
+
+/// <summary>
+/// Sort the buckets in the order of the scene settings
+/// </summary>
+/// <param name="costs"> Needed for BucketOrder::Cost </param>
+/// <returns> Whether the buckets should be dealt to the render threads in turn, see RenderThreadPool::run </returns>
+static bool orderBuckets(std::vector<Bucket>& buckets, const Scene& scene, const RenderCostMap* costs)
+{
+    auto sortBy = [&](auto key) {
+        std::vector<std::pair<decltype(key(buckets[0])), size_t>> keys(buckets.size());
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            keys[i] = { key(buckets[i]), i };
+        }
+        std::sort(keys.begin(), keys.end());
+        std::vector<Bucket> sorted(buckets.size());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            sorted[i] = buckets[keys[i].second];
+        }
+        buckets.swap(sorted);
+    };
+    if (buckets.empty()) {
+        return false;
+    }
+
+    const double centerX = scene.settings.width / 2.0;
+    const double centerY = scene.settings.height / 2.0;
+    switch (scene.settings.bucketOrder) {
+    case BucketOrder::Raster:
+        // Split buckets were added at the end
+        sortBy([](const Bucket& bucket) { return std::make_pair(bucket.y, bucket.x); });
+        return false;
+    case BucketOrder::Spiral:
+        // Rings of one bucket size around the center, each one clockwise
+        sortBy([&](const Bucket& bucket) {
+            const double dx = bucket.x + bucket.w / 2.0 - centerX;
+            const double dy = bucket.y + bucket.h / 2.0 - centerY;
+            const size_t ring = size_t(std::max(std::abs(dx), std::abs(dy)) / std::max<size_t>(scene.settings.bucketSize, 1));
+            return std::make_pair(ring, std::atan2(dy, dx));
+        });
+        return true;
+    case BucketOrder::Hilbert: {
+        uint32_t size = 1;
+        while (size < costColumns(scene.settings.width) || size < costRows(scene.settings.height)) {
+            size *= 2;
+        }
+        sortBy([&](const Bucket& bucket) {
+            return hilbertIndex(size, uint32_t((bucket.x + bucket.w / 2) / RENDER_COST_CELL_SIZE), uint32_t((bucket.y + bucket.h / 2) / RENDER_COST_CELL_SIZE));
+        });
+        return false;
+    }
+    case BucketOrder::Cost:
+        sortBy([&](const Bucket& bucket) { return std::make_tuple(-bucketCost(*costs, bucket), bucket.y, bucket.x); });
+        return true;
+    }
+    return false;
+}
+
+// Whether any pixel of the bucket is flagged in activePixels
+static bool hasActivePixels(const Bucket& bucket, size_t width, const char* activePixels)
+{
+    for (size_t y = bucket.y; y < bucket.y + bucket.h; ++y) {
+        for (size_t x = bucket.x; x < bucket.x + bucket.w; ++x) {
+            if (activePixels[y * width + x]) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/// <summary>
+/// renderImage for the pixels flagged in activePixels, the others are left as they are.
+/// Buckets without any of them are skipped
+/// </summary>
+static void renderPixels(Color* pixels, const Scene& scene, const char* activePixels, RenderStats* stats, RenderCostMap* costs)
+{
+    const size_t WIDTH = scene.settings.width;
+    const size_t HEIGHT = scene.settings.height;
+    const auto startTime = std::chrono::steady_clock::now();
+    if (stats) {
+        *stats = {};
+    }
 
 #if 1 // Buckets
 
     std::vector<Bucket> buckets = generate_buckets(scene);
+    if (activePixels) {
+        buckets.erase(std::remove_if(buckets.begin(), buckets.end(), [&](const Bucket& bucket) { return !hasActivePixels(bucket, WIDTH, activePixels); }), buckets.end());
+    }
 
-    std::for_each(
-        std::execution::par,
-        buckets.begin(),
-        buckets.end(),
-        [&](const Bucket& bucket) {
-            renderBucket(pixels, bucket, scene);
+    // The costs of the previous render, if it had the same size, or estimated now if the settings need them
+    const unsigned threadCount = renderThreadCount(scene);
+    const bool needCosts = scene.settings.bucketOrder == BucketOrder::Cost || scene.settings.adaptiveBuckets;
+    RenderCostMap estimatedCosts;
+    const RenderCostMap* bucketCosts = nullptr;
+    if (needCosts) {
+        if (costs && costs->width == WIDTH && costs->height == HEIGHT) {
+            bucketCosts = costs;
+        }
+        else {
+            estimatedCosts = estimateRenderCosts(scene);
+            bucketCosts = &estimatedCosts;
+        }
+    }
+    if (scene.settings.adaptiveBuckets) {
+        splitCostlyBuckets(buckets, *bucketCosts, threadCount);
+    }
+    const bool interleaved = orderBuckets(buckets, scene, bucketCosts);
+
+    AABB sceneBounds;
+    for (const Instance& instance : scene.instances) {
+        sceneBounds.expand(instance.bounds);
+    }
+
+    // The counters and the time of each bucket are taken from its thread, added up per thread, and summed once all are done
+    std::vector<RenderStats> threadStats(threadCount);
+    std::vector<std::vector<std::pair<Bucket, double>>> threadBucketMs(threadCount);
+    std::vector<RenderThreadStats> threadWork = runOnRenderThreads(
+        scene,
+        buckets,
+        interleaved,
+        [&](const Bucket& bucket, unsigned thread) {
+            const auto bucketStart = std::chrono::steady_clock::now();
+            RenderStats& bucketStats = threadRenderStats();
+            bucketStats = {};
+            if (scene.settings.integrator == Integrator::Wavefront) {
+                renderBucketWavefront(pixels, bucket, scene, sceneBounds, activePixels);
+            }
+            else {
+                renderBucket(pixels, bucket, scene, activePixels);
+            }
+            addRenderStats(threadStats[thread], bucketStats);
+            if (costs) {
+                threadBucketMs[thread].push_back({ bucket, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - bucketStart).count() });
+            }
         }
     );
+
+    if (costs) {
+        resetRenderCosts(*costs, scene);
+        for (const auto& bucketMs : threadBucketMs) {
+            for (const auto& [bucket, ms] : bucketMs) {
+                addBucketCost(*costs, bucket, ms);
+            }
+        }
+    }
+    if (stats) {
+        for (const RenderStats& thread : threadStats) {
+            addRenderStats(*stats, thread);
+        }
+        stats->threads = std::move(threadWork);
+    }
 #else // Scanline
 
     std::vector<int> height(HEIGHT);
@@ -135,4 +858,133 @@ void renderImage(Color* pixels, const Scene& scene)
         }
     );
 #endif
+
+    if (stats) {
+        stats->renderMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+    }
+}
+
+void renderImage(Color* pixels, const Scene& scene, RenderStats* stats, RenderCostMap* costs)
+{
+    renderPixels(pixels, scene, nullptr, stats, costs);
+}
+
+// Passes a pixel gets before its noise is estimated, fewer give too rough an estimate
+const int MIN_ADAPTIVE_PASSES = 3;
+
+static double luminance(const Color& color)
+{
+    return 0.2126 * color.r + 0.7152 * color.g + 0.0722 * color.b;
+}
+
+// The passes of a pixel of a progressive render
+struct PixelPasses {
+    int count = 0;
+    // Sum of the weights of the passes
+    double weight = 0;
+    // Weighted mean and sum of squared deviations of the luminance of the passes
+    double meanLuminance = 0;
+    double squaredDeviations = 0;
+
+    void add(const Color& color, double passWeight)
+    {
+        const double value = luminance(color);
+        ++count;
+        weight += passWeight;
+        const double delta = value - meanLuminance;
+        meanLuminance += passWeight / weight * delta;
+        squaredDeviations += passWeight * delta * (value - meanLuminance);
+    }
+
+    // Estimated standard error of the mean luminance, the noise left in the pixel
+    double noise() const
+    {
+        return count > 1 ? std::sqrt(squaredDeviations / weight / count) : INFINITY;
+    }
+};
+
+int renderProgressive(Color* pixels, Scene& scene, int passGIRays, const ProgressiveCallback& callback, RenderStats* stats, int* sampleCounts)
+{
+    const size_t pixelCount = scene.settings.width * scene.settings.height;
+    const int giRays = std::max(scene.settings.giRays, 0);
+    passGIRays = std::clamp(passGIRays, 1, std::max(giRays, 1));
+    const int savedPassGIRays = scene.settings.passGIRays;
+    const real_t noiseThreshold = scene.settings.noiseThreshold;
+    if (stats) {
+        *stats = {};
+    }
+
+    // Each pass is weighted by its share of the GI rays, the last one may trace fewer
+    std::vector<Color> passPixels(pixelCount);
+    std::vector<PixelPasses> pixelPasses(pixelCount);
+    // Pixels that are still too noisy, only they are rendered by the next pass
+    std::vector<char> activePixels(pixelCount, true);
+    // Each pass is scheduled by the costs of the one before
+    RenderCostMap costs;
+    ProgressivePass pass;
+    pass.passCount = std::max((giRays + passGIRays - 1) / passGIRays, 1);
+    pass.noisyPixels = pixelCount;
+    for (; pass.index < pass.passCount && pass.noisyPixels > 0; ++pass.index) {
+        const int tracedGIRays = std::min(passGIRays, giRays - pass.giRays);
+        scene.settings.passGIRays = tracedGIRays;
+        RenderStats passStats;
+        renderPixels(passPixels.data(), scene, pass.index > 0 ? activePixels.data() : nullptr, &passStats, &costs);
+
+        const double passWeight = giRays ? tracedGIRays : 1;
+        double squaredChange = 0;
+        for (size_t i = 0; i < pixelCount; ++i) {
+            if (!activePixels[i]) {
+                continue;
+            }
+            PixelPasses& passes = pixelPasses[i];
+            passes.add(passPixels[i], passWeight);
+            if (passes.count == 1) {
+                pixels[i] = passPixels[i];
+                continue;
+            }
+            const real_t weight = real_t(passWeight / passes.weight);
+            const Color pixel = (1 - weight) * pixels[i] + weight * passPixels[i];
+            const real_t dr = pixel.r - pixels[i].r;
+            const real_t dg = pixel.g - pixels[i].g;
+            const real_t db = pixel.b - pixels[i].b;
+            const double change = double(dr * dr + dg * dg + db * db) / 3;
+            // A NaN pixel would hide the change of all the others
+            squaredChange += std::isfinite(change) ? change : 0;
+            pixels[i] = pixel;
+        }
+
+        pass.giRays += tracedGIRays;
+        pass.passMs = passStats.renderMs;
+        pass.totalMs += passStats.renderMs;
+        pass.renderedPixels = pass.noisyPixels;
+        pass.rmsChange = std::sqrt(squaredChange / std::max<size_t>(pass.renderedPixels, 1));
+        if (stats) {
+            addRenderStats(*stats, passStats);
+            stats->renderMs += passStats.renderMs;
+            stats->threads = std::move(passStats.threads);
+        }
+        if (sampleCounts) {
+            for (size_t i = 0; i < pixelCount; ++i) {
+                sampleCounts[i] = pixelPasses[i].count;
+            }
+        }
+
+        // Pixels whose noise is below the threshold are done, the next passes skip them. So are NaN pixels,
+        // more passes would not change them
+        if (noiseThreshold > 0 && pass.index + 1 >= MIN_ADAPTIVE_PASSES) {
+            for (size_t i = 0; i < pixelCount; ++i) {
+                if (activePixels[i] && !(pixelPasses[i].noise() > noiseThreshold)) {
+                    activePixels[i] = false;
+                    --pass.noisyPixels;
+                }
+            }
+        }
+        if (callback && !callback(pixels, pass)) {
+            ++pass.index;
+            break;
+        }
+    }
+
+    scene.settings.passGIRays = savedPassGIRays;
+    return pass.index;
 }
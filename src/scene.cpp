@@ -7,20 +7,201 @@
 #include "rapidjson/istreamwrapper.h"
 #pragma warning(pop)
 
+#include <chrono>
+#include <cmath>
 #include <fstream>
 #include <iostream>
 
-void Scene::addObject(const Object& object)
+int Scene::addObject(Object object, bool visible)
 {
-    objects.push_back(object);
+    objects.push_back(std::move(object));
+    const int objectIndex = int(objects.size() - 1);
+    if (visible) {
+        Instance& instance = instances.emplace_back();
+        instance.objectIndex = objectIndex;
+        updateInstanceBounds(instance);
+    }
+    return objectIndex;
 }
 
-bool Scene::intersect(Ray ray, IntersectionData& idata, bool backface, bool any, real_t max_t) const
+// Below this the transform is singular or close to it, and its inverse would give inf or NaN rays
+const real_t MIN_INSTANCE_DETERMINANT = 1e-12f;
+
+int Scene::addInstance(int objectIndex, const Matrix& transform, const Vector& translation, const Material* material)
+{
+    const real_t determinant = transform.determinant();
+    if (!(std::abs(determinant) > MIN_INSTANCE_DETERMINANT) || !std::isfinite(determinant)) {
+        std::cerr << "Instance with a singular matrix\n";
+        return -1;
+    }
+    Instance& instance = instances.emplace_back();
+    instance.objectIndex = objectIndex;
+    instance.transform = transform;
+    instance.translation = translation;
+    instance.inverseTransform = transform.inverse();
+    instance.normalTransform = instance.inverseTransform.transposed();
+    instance.material = material;
+    instance.identity = false;
+    updateInstanceBounds(instance);
+    return int(instances.size() - 1);
+}
+
+void Scene::updateInstanceBounds(Instance& instance) const
+{
+    const AABB& objectBounds = objects[instance.objectIndex].getAABB();
+    if (instance.identity) {
+        instance.bounds = objectBounds;
+        return;
+    }
+    // Bounds of the transformed corners of the object bounds
+    instance.bounds = {};
+    for (int corner = 0; corner < 8; ++corner) {
+        const Vector p{
+            (corner & 1) ? objectBounds.max.x : objectBounds.min.x,
+            (corner & 2) ? objectBounds.max.y : objectBounds.min.y,
+            (corner & 4) ? objectBounds.max.z : objectBounds.min.z,
+        };
+        instance.bounds.expand(instance.transform * p + instance.translation);
+    }
+}
+
+bool Scene::updateObjectVertices(int objectIndex, const std::vector<Vector>& vertices)
+{
+    if (objectIndex < 0 || objectIndex >= int(objects.size())) {
+        std::cerr << "Error: No object " << objectIndex << " to update\n";
+        return false;
+    }
+    const bool rebuilt = objects[objectIndex].updateVertices(vertices);
+    for (Instance& instance : instances) {
+        if (instance.objectIndex == objectIndex) {
+            updateInstanceBounds(instance);
+        }
+    }
+    buildTLAS();
+    return rebuilt;
+}
+
+const int MAX_INSTANCES_PER_TLAS_LEAF = 2;
+
+void Scene::buildTLAS()
+{
+    tlas.clear();
+    tlasInstances.resize(instances.size());
+    for (int i = 0; i < int(instances.size()); ++i) {
+        tlasInstances[i] = i;
+    }
+    if (instances.empty()) {
+        return;
+    }
+
+    tlas.reserve(instances.size() * 2);
+    TLASNode& root = tlas.emplace_back();
+    root.startInstanceIndex = 0;
+    root.endInstanceIndex = int(instances.size() - 1);
+    buildTLASRecursive(0);
+    // root is likely to be invalidated after the last call. DO NOT USE
+}
+
+void Scene::buildTLASRecursive(int nodeIndex)
+{
+    const int start = tlas[nodeIndex].startInstanceIndex;
+    const int end = tlas[nodeIndex].endInstanceIndex;
+
+    AABB centroidBounds;
+    for (int i = start; i <= end; ++i) {
+        const AABB& instanceBounds = instances[tlasInstances[i]].bounds;
+        tlas[nodeIndex].bounds.expand(instanceBounds);
+        centroidBounds.expand((instanceBounds.min + instanceBounds.max) * 0.5f);
+    }
+
+    if (end - start + 1 <= MAX_INSTANCES_PER_TLAS_LEAF) {
+        return;
+    }
+
+    // Split at the median instance along the longest axis of the instance centers
+    const int splitAxis = (centroidBounds.max - centroidBounds.min).maxDimension();
+    const int mid = start + (end - start) / 2;
+    std::nth_element(tlasInstances.begin() + start, tlasInstances.begin() + mid, tlasInstances.begin() + end + 1,
+        [&](int a, int b) {
+            const AABB& boundsA = instances[a].bounds;
+            const AABB& boundsB = instances[b].bounds;
+            return boundsA.min[splitAxis] + boundsA.max[splitAxis] < boundsB.min[splitAxis] + boundsB.max[splitAxis];
+        });
+
+    TLASNode& leftChild = tlas.emplace_back();
+    leftChild.startInstanceIndex = start;
+    leftChild.endInstanceIndex = mid;
+
+    TLASNode& rightChild = tlas.emplace_back();
+    rightChild.startInstanceIndex = mid + 1;
+    rightChild.endInstanceIndex = end;
+
+    tlas[nodeIndex].left = int(tlas.size() - 2);
+    tlas[nodeIndex].right = int(tlas.size() - 1);
+
+    // leftChild and rightChild will most likely be invalidated after these 2 calls.
+    // DO NOT USE THEM BELLOW
+    buildTLASRecursive(tlas[nodeIndex].left);
+    buildTLASRecursive(tlas[nodeIndex].right);
+}
+
+template <RayQuery query>
+bool Scene::intersectInstance(int instanceIndex, const KernelRay& ray, IntersectionData& idata) const
 {
+    const Instance& instance = instances[instanceIndex];
+    const Object& object = objects[instance.objectIndex];
     IntersectionData temp_idata;
+
+    // Only look for hits closer than the closest one so far
+    bool intersection;
+    if (instance.identity) {
+        intersection = object.intersect<query>(ray, temp_idata, idata.t);
+    }
+    else {
+        // The direction is not normalized, so distances along the ray stay in world space
+        const Vector origin{ ray.origin[0], ray.origin[1], ray.origin[2] };
+        const Vector dir{ ray.dir[0], ray.dir[1], ray.dir[2] };
+        Ray objectRay;
+        objectRay.origin = instance.inverseTransform * (origin - instance.translation);
+        objectRay.dir = instance.inverseTransform * dir;
+        intersection = object.intersect<query>(prepareRay(objectRay), temp_idata, idata.t);
+    }
+
+    // Occlusion queries have no hit attributes to keep
+    if constexpr (isAnyHitQuery(query)) {
+        return intersection;
+    }
+    if (intersection && temp_idata.t < idata.t) {
+        idata = temp_idata;
+        idata.instance = &instance;
+        return true;
+    }
+    return false;
+}
+
+bool Scene::intersect(Ray ray, IntersectionData& idata, bool backface, bool any, real_t max_t) const
+{
+    return intersect(prepareRay(ray), idata, backface, any, max_t);
+}
+
+bool Scene::intersect(const KernelRay& ray, IntersectionData& idata, bool backface, bool any, real_t max_t) const
+{
+    switch (rayQuery(backface, any)) {
+    case RayQuery::Closest: return intersect<RayQuery::Closest>(ray, idata, max_t);
+    case RayQuery::ClosestFrontFace: return intersect<RayQuery::ClosestFrontFace>(ray, idata, max_t);
+    case RayQuery::Any: return intersect<RayQuery::Any>(ray, idata, max_t);
+    case RayQuery::AnyFrontFace: return intersect<RayQuery::AnyFrontFace>(ray, idata, max_t);
+    }
+    return false;
+}
+
+template <RayQuery query>
+bool Scene::intersect(const KernelRay& ray, IntersectionData& idata, real_t max_t) const
+{
     idata.t = max_t;
     /*
     if (!any) { // "Temporary" workaround for rendering lights
+        IntersectionData temp_idata;
         for (const Light& l : lights) {
             bool intersection = l.intersect(ray, temp_idata, backface, any, max_t);
             if (intersection && temp_idata.t < idata.t) {
@@ -32,17 +213,137 @@ bool Scene::intersect(Ray ray, IntersectionData& idata, bool backface, bool any,
     }
     */
 
-    for (const Object& o : objects) {
-        temp_idata.t = max_t;
-        bool intersection = o.intersect(ray, temp_idata, backface, any, max_t);
-        if (intersection && temp_idata.t < idata.t) {
-            idata = temp_idata;
-            if (any) return true;
+    if (tlasInstances.size() != instances.size()) {
+        // The TLAS is out of date, test every instance
+        for (int i = 0; i < int(instances.size()); ++i) {
+            if (intersectInstance<query>(i, ray, idata) && isAnyHitQuery(query)) {
+                return true;
+            }
+        }
+        return idata.t < max_t;
+    }
+
+    if (tlas.empty()) {
+        return false;
+    }
+
+    const SIMDKernels& kernels = getSIMDKernels();
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        const TLASNode& node = tlas[stack[--stackSize]];
+        real_t tNear;
+        if (!kernels.intersectAABB(ray, node.bounds.min.v, node.bounds.max.v, tNear) || tNear > idata.t) {
+            continue;
         }
+
+        if (node.left == -1 && node.right == -1) {
+            for (int i = node.startInstanceIndex; i <= node.endInstanceIndex; ++i) {
+                if (intersectInstance<query>(tlasInstances[i], ray, idata) && isAnyHitQuery(query)) {
+                    return true;
+                }
+            }
+            continue;
+        }
+
+        stack[stackSize++] = node.right;
+        stack[stackSize++] = node.left;
     }
     return idata.t < max_t;
 }
 
+int Scene::intersectInstancePacket(int instanceIndex, const KernelRayPacket& packet, IntersectionData idata[RAY_PACKET_SIZE], int activeMask, bool backface) const
+{
+    const Instance& instance = instances[instanceIndex];
+    const Object& object = objects[instance.objectIndex];
+    IntersectionData temp_idata[RAY_PACKET_SIZE];
+
+    // Only look for hits closer than the closest ones so far
+    real_t maxT[RAY_PACKET_SIZE];
+    for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+        maxT[i] = idata[i].t;
+    }
+
+    int hitMask;
+    if (instance.identity) {
+        hitMask = object.intersectPacket(packet, temp_idata, activeMask, maxT, backface);
+    }
+    else {
+        // The transform is affine, so coherent rays stay coherent in object space
+        Ray objectRays[RAY_PACKET_SIZE];
+        for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+            const Vector origin{ packet.origin[0][i], packet.origin[1][i], packet.origin[2][i] };
+            const Vector dir{ packet.dir[0][i], packet.dir[1][i], packet.dir[2][i] };
+            objectRays[i].origin = instance.inverseTransform * (origin - instance.translation);
+            objectRays[i].dir = instance.inverseTransform * dir;
+        }
+        hitMask = object.intersectPacket(prepareRayPacket(objectRays), temp_idata, activeMask, maxT, backface);
+    }
+
+    for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+        if (hitMask & (1 << i)) {
+            idata[i] = temp_idata[i];
+            idata[i].instance = &instance;
+        }
+    }
+    return hitMask;
+}
+
+int Scene::intersectPacket(const Ray rays[RAY_PACKET_SIZE], IntersectionData idata[RAY_PACKET_SIZE], int activeMask, bool backface) const
+{
+    for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+        idata[i].t = 1e30f;
+    }
+
+    const KernelRayPacket packet = prepareRayPacket(rays);
+    int hitMask = 0;
+    if (tlasInstances.size() != instances.size()) {
+        // The TLAS is out of date, test every instance
+        for (int i = 0; i < int(instances.size()); ++i) {
+            hitMask |= intersectInstancePacket(i, packet, idata, activeMask, backface);
+        }
+        return hitMask;
+    }
+
+    if (tlas.empty()) {
+        return 0;
+    }
+
+    const SIMDKernels& kernels = getSIMDKernels();
+    struct StackEntry {
+        int nodeIndex;
+        int mask;
+    };
+    StackEntry stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = { 0, activeMask };
+    while (stackSize > 0) {
+        const StackEntry entry = stack[--stackSize];
+        const TLASNode& node = tlas[entry.nodeIndex];
+        real_t tMax[RAY_PACKET_SIZE];
+        for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+            tMax[i] = idata[i].t;
+        }
+        real_t tNear[RAY_PACKET_SIZE];
+        const int mask = kernels.intersectPacketAABB(packet, node.bounds.min.v, node.bounds.max.v, tMax, entry.mask, tNear);
+        if (mask == 0) {
+            continue;
+        }
+
+        if (node.left == -1 && node.right == -1) {
+            for (int i = node.startInstanceIndex; i <= node.endInstanceIndex; ++i) {
+                hitMask |= intersectInstancePacket(tlasInstances[i], packet, idata, mask, backface);
+            }
+            continue;
+        }
+
+        stack[stackSize++] = { node.right, mask };
+        stack[stackSize++] = { node.left, mask };
+    }
+    return hitMask;
+}
+
 Color Scene::shade(const Ray& ray, const IntersectionData& idata) const
 {
     if (idata.u == -1 && idata.v == -1) {
@@ -50,13 +351,45 @@ Color Scene::shade(const Ray& ray, const IntersectionData& idata) const
         return { 1, 1, .9f, 1 };
     }
     Color finalColor{ 1, 0, 1, 1 };
-    const Material* material = idata.object ? idata.object->getMaterial() : nullptr;
+    const Material* material = getMaterial(idata);
     if (material) {
         finalColor = material->shade(*this, ray, idata);
     }
     return finalColor;
 }
 
+const Material* Scene::getMaterial(const IntersectionData& idata) const
+{
+    if (idata.instance && idata.instance->material) {
+        return idata.instance->material;
+    }
+    return idata.object ? idata.object->getMaterial() : nullptr;
+}
+
+HitAttributes Scene::finalizeHit(const Ray& ray, const IntersectionData& idata, bool smooth) const
+{
+    const Vector ip = ray.origin + ray.dir * idata.t;
+    if (!idata.instance || idata.instance->identity) {
+        return idata.object->finalizeHit(ip, idata, smooth);
+    }
+    const Instance& instance = *idata.instance;
+
+    // Computed in object space, where the vertices and their normals are. The hit point itself is
+    // kept in world space, the round trip through the inverse transform only moves it
+    const Vector objectIp = smooth ? instance.inverseTransform * (ip - instance.translation) : ip;
+    HitAttributes hit = idata.object->finalizeHit(objectIp, idata, smooth);
+    hit.ip = ip;
+    hit.normal = normalized(instance.normalTransform * hit.normal);
+    if (!smooth) {
+        hit.smoothIp = hit.ip;
+        hit.smoothNormal = hit.normal;
+        return hit;
+    }
+    hit.smoothIp = instance.transform * hit.smoothIp + instance.translation;
+    hit.smoothNormal = normalized(instance.normalTransform * hit.smoothNormal);
+    return hit;
+}
+
 rapidjson::Document getJsonDocument(const std::string& fileName)
 {
     using namespace rapidjson;
@@ -82,6 +415,15 @@ rapidjson::Document getJsonDocument(const std::string& fileName)
     return doc;
 }
 
+// The member of an object, or a null value if it doesn't have one. Optional keys must be looked up with this,
+// FindMember returns MemberEnd for a missing key
+const rapidjson::Value& findMember(const rapidjson::Value& objectVal, const char* name)
+{
+    static const rapidjson::Value nullVal;
+    const auto member = objectVal.FindMember(name);
+    return member != objectVal.MemberEnd() ? member->value : nullVal;
+}
+
 Color loadColor(const rapidjson::Value::ConstArray& arr)
 {
     assert(arr.Size() == 3 || arr.Size() == 4);
@@ -135,9 +477,10 @@ Light loadLight(const rapidjson::Value& lightVal)
     return light;
 }
 
-Object loadObject(const rapidjson::Value& objectVal)
+Object loadObject(const rapidjson::Value& objectVal, const BVHBuildSettings& bvhSettings, double& parseMs)
 {
     using namespace rapidjson;
+    const auto startTime = std::chrono::steady_clock::now();
 
     std::vector<Vector> verts;
     std::vector<int> triangles;
@@ -163,7 +506,10 @@ Object loadObject(const rapidjson::Value& objectVal)
         }
     }
 
-    Object obj(verts, triangles);
+    const auto parsedTime = std::chrono::steady_clock::now();
+    parseMs = std::chrono::duration<double, std::milli>(parsedTime - startTime).count();
+
+    Object obj(std::move(verts), std::move(triangles), nullptr, bvhSettings);
     return obj;
 }
 
@@ -257,6 +603,76 @@ Camera loadCamera(const rapidjson::Value& cameraVal)
     return camera;
 }
 
+BVHBuildSettings loadBVHSettings(const rapidjson::Value& bvhVal)
+{
+    using namespace rapidjson;
+    BVHBuildSettings bvhSettings;
+
+    if (!bvhVal.IsNull() && bvhVal.IsObject()) {
+        const Value& builderVal = findMember(bvhVal, "builder");
+        if (!builderVal.IsNull() && builderVal.IsString()) {
+            std::string builderStr = builderVal.GetString();
+            if (builderStr == "median") {
+                bvhSettings.mode = BVHBuildMode::Median;
+            }
+            else if (builderStr == "sah") {
+                bvhSettings.mode = BVHBuildMode::SAH;
+            }
+            else if (builderStr == "lbvh") {
+                bvhSettings.mode = BVHBuildMode::LBVH;
+            }
+            else {
+                std::cerr << "Unknown BVH builder: " << builderStr << '\n';
+            }
+        }
+        const Value& binsVal = findMember(bvhVal, "bins");
+        if (!binsVal.IsNull() && binsVal.IsInt()) {
+            bvhSettings.binCount = binsVal.GetInt();
+        }
+        const Value& traversalCostVal = findMember(bvhVal, "traversal_cost");
+        if (!traversalCostVal.IsNull() && traversalCostVal.IsNumber()) {
+            bvhSettings.traversalCost = traversalCostVal.GetFloat();
+        }
+        const Value& intersectionCostVal = findMember(bvhVal, "intersection_cost");
+        if (!intersectionCostVal.IsNull() && intersectionCostVal.IsNumber()) {
+            bvhSettings.intersectionCost = intersectionCostVal.GetFloat();
+        }
+        const Value& minLeafSizeVal = findMember(bvhVal, "min_leaf_size");
+        if (!minLeafSizeVal.IsNull() && minLeafSizeVal.IsInt()) {
+            bvhSettings.minLeafSize = minLeafSizeVal.GetInt();
+        }
+        const Value& maxLeafSizeVal = findMember(bvhVal, "max_leaf_size");
+        if (!maxLeafSizeVal.IsNull() && maxLeafSizeVal.IsInt()) {
+            bvhSettings.maxLeafSize = maxLeafSizeVal.GetInt();
+        }
+        const Value& wideVal = findMember(bvhVal, "wide");
+        if (!wideVal.IsNull() && wideVal.IsBool()) {
+            bvhSettings.wide = wideVal.GetBool();
+        }
+        const Value& compressedVal = findMember(bvhVal, "compressed");
+        if (!compressedVal.IsNull() && compressedVal.IsBool()) {
+            bvhSettings.compressed = compressedVal.GetBool();
+        }
+        const Value& watertightVal = findMember(bvhVal, "watertight");
+        if (!watertightVal.IsNull() && watertightVal.IsBool()) {
+            bvhSettings.watertight = watertightVal.GetBool();
+        }
+        const Value& buildThreadsVal = findMember(bvhVal, "build_threads");
+        if (!buildThreadsVal.IsNull() && buildThreadsVal.IsInt()) {
+            bvhSettings.buildThreads = buildThreadsVal.GetInt();
+        }
+        const Value& cacheDirVal = findMember(bvhVal, "cache_dir");
+        if (!cacheDirVal.IsNull() && cacheDirVal.IsString()) {
+            bvhSettings.cacheDirectory = cacheDirVal.GetString();
+        }
+        const Value& refitRebuildThresholdVal = findMember(bvhVal, "refit_rebuild_threshold");
+        if (!refitRebuildThresholdVal.IsNull() && refitRebuildThresholdVal.IsNumber()) {
+            bvhSettings.refitRebuildThreshold = refitRebuildThresholdVal.GetFloat();
+        }
+    }
+    return bvhSettings;
+}
+
 SceneSettings loadSettings(const rapidjson::Value& settingsVal)
 {
     using namespace rapidjson;
@@ -279,15 +695,97 @@ SceneSettings loadSettings(const rapidjson::Value& settingsVal)
             if (!bucketSizeVal.IsNull() && bucketSizeVal.IsNumber()) {
                 settings.bucketSize = bucketSizeVal.GetInt();
             }
+            const Value& bucketOrderVal = findMember(imageSettingsVal, "bucket_order");
+            if (!bucketOrderVal.IsNull() && bucketOrderVal.IsString()) {
+                std::string bucketOrderStr = bucketOrderVal.GetString();
+                if (bucketOrderStr == "raster") {
+                    settings.bucketOrder = BucketOrder::Raster;
+                }
+                else if (bucketOrderStr == "spiral") {
+                    settings.bucketOrder = BucketOrder::Spiral;
+                }
+                else if (bucketOrderStr == "hilbert") {
+                    settings.bucketOrder = BucketOrder::Hilbert;
+                }
+                else if (bucketOrderStr == "cost") {
+                    settings.bucketOrder = BucketOrder::Cost;
+                }
+            }
+            const Value& adaptiveBucketsVal = findMember(imageSettingsVal, "adaptive_buckets");
+            if (!adaptiveBucketsVal.IsNull() && adaptiveBucketsVal.IsBool()) {
+                settings.adaptiveBuckets = adaptiveBucketsVal.GetBool();
+            }
+            const Value& rayPacketsVal = findMember(imageSettingsVal, "ray_packets");
+            if (!rayPacketsVal.IsNull() && rayPacketsVal.IsBool()) {
+                settings.rayPackets = rayPacketsVal.GetBool();
+            }
+        }
+        const Value& integratorVal = findMember(settingsVal, "integrator");
+        if (!integratorVal.IsNull() && integratorVal.IsString()) {
+            std::string integratorStr = integratorVal.GetString();
+            if (integratorStr == "recursive") {
+                settings.integrator = Integrator::Recursive;
+            }
+            else if (integratorStr == "wavefront") {
+                settings.integrator = Integrator::Wavefront;
+            }
+        }
+        const Value& giRaysVal = findMember(settingsVal, "gi_rays");
+        if (!giRaysVal.IsNull() && giRaysVal.IsInt()) {
+            settings.giRays = std::max(giRaysVal.GetInt(), 0);
         }
+        const Value& noiseThresholdVal = findMember(settingsVal, "noise_threshold");
+        if (!noiseThresholdVal.IsNull() && noiseThresholdVal.IsNumber()) {
+            settings.noiseThreshold = noiseThresholdVal.GetFloat();
+        }
+        const Value& renderThreadsVal = findMember(settingsVal, "render_threads");
+        if (!renderThreadsVal.IsNull() && renderThreadsVal.IsUint()) {
+            settings.renderThreads = renderThreadsVal.GetUint();
+        }
+        const Value& bvhVal = findMember(settingsVal, "bvh");
+        settings.bvh = loadBVHSettings(bvhVal);
     }
     return settings;
 }
 
-void Scene::load(const std::string& fileName)
+void loadInstance(const rapidjson::Value& instanceVal, Scene& scene)
+{
+    using namespace rapidjson;
+
+    if (instanceVal.IsNull() || !instanceVal.IsObject()) {
+        return;
+    }
+    const Value& objectIndexVal = findMember(instanceVal, "object_index");
+    if (objectIndexVal.IsNull() || !objectIndexVal.IsUint() || objectIndexVal.GetUint() >= scene.objects.size()) {
+        std::cerr << "Instance without a valid object_index\n";
+        return;
+    }
+
+    Matrix transform;
+    const Value& matrixVal = findMember(instanceVal, "matrix");
+    if (!matrixVal.IsNull() && matrixVal.IsArray()) {
+        transform = loadMatrix(matrixVal.GetArray());
+    }
+    Vector translation;
+    const Value& positionVal = findMember(instanceVal, "position");
+    if (!positionVal.IsNull() && positionVal.IsArray()) {
+        translation = loadVector(positionVal.GetArray());
+    }
+    const Material* material = nullptr;
+    const Value& materialIndexVal = findMember(instanceVal, "material_index");
+    if (!materialIndexVal.IsNull() && materialIndexVal.IsUint() && materialIndexVal.GetUint() < scene.materials.size()) {
+        material = scene.materials[materialIndexVal.GetUint()];
+    }
+    scene.addInstance(objectIndexVal.GetUint(), transform, translation, material);
+}
+
+void Scene::load(const std::string& fileName, std::optional<BVHBuildMode> builder)
 {
     using namespace rapidjson;
+    const auto startTime = std::chrono::steady_clock::now();
     Document doc = getJsonDocument(fileName);
+    const auto parsedTime = std::chrono::steady_clock::now();
+    documentParseMs = std::chrono::duration<double, std::milli>(parsedTime - startTime).count();
 
     if (doc.HasParseError()) {
         if (doc.GetParseError() == kParseErrorDocumentEmpty) {
@@ -298,6 +796,9 @@ void Scene::load(const std::string& fileName)
 
     const Value& settingsVal = doc.FindMember("settings")->value;
     settings = loadSettings(settingsVal);
+    if (builder) {
+        settings.bvh.mode = *builder;
+    }
 
     const Value& cameraVal = doc.FindMember("camera")->value;
     camera = loadCamera(cameraVal);
@@ -320,7 +821,10 @@ void Scene::load(const std::string& fileName)
     const Value& objectsVal = doc.FindMember("objects")->value;
     if (!objectsVal.IsNull() && objectsVal.IsArray()) {
         for (const Value& v : objectsVal.GetArray()) {
-            Object o = loadObject(v);
+            double parseMs = 0;
+            Object o = loadObject(v, settings.bvh, parseMs);
+            objectParseMs.resize(objects.size());
+            objectParseMs.push_back(parseMs);
             // TODO: fix this ugly
             int materialIndex = -1;
             const Value& materialIndexVal = v.FindMember("material_index")->value;
@@ -329,9 +833,66 @@ void Scene::load(const std::string& fileName)
             }
             if (materialIndex >= 0 && materialIndex < materials.size())
                 o.setMaterial(materials[materialIndex]);
-            addObject(o);
+            // Objects that are only placed through instances are hidden
+            bool visible = true;
+            const Value& visibleVal = findMember(v, "visible");
+            if (!visibleVal.IsNull() && visibleVal.IsBool()) {
+                visible = visibleVal.GetBool();
+            }
+            addObject(std::move(o), visible);
+        }
+    }
+
+    const Value& instancesVal = findMember(doc, "instances");
+    if (!instancesVal.IsNull() && instancesVal.IsArray()) {
+        for (const Value& v : instancesVal.GetArray()) {
+            loadInstance(v, *this);
+        }
+    }
+
+    buildTLAS();
+}
+
+void Scene::printStats(std::ostream& os) const
+{
+    const char* builderName =
+        settings.bvh.mode == BVHBuildMode::SAH ? "SAH" :
+        settings.bvh.mode == BVHBuildMode::LBVH ? "LBVH" :
+        "median";
+    os << "BVH builder: " << builderName << '\n';
+    os << "SIMD kernels: " << getSIMDKernels().name << ", " << getSIMDKernels().packWidth << " triangles per leaf pack"
+        << (settings.bvh.watertight ? ", watertight\n" : "\n");
+    os << "TLAS: " << tlas.size() << " nodes over " << tlasInstances.size() << " instances of " << objects.size() << " objects\n";
+    os << "JSON parse: " << documentParseMs << " ms\n";
+
+    double totalParseMs = 0;
+    double totalBuildMs = 0;
+
+    for (size_t i = 0; i < objects.size(); ++i) {
+        const BVHStats& stats = objects[i].getBVHStats();
+        os << "Object " << i << ": "
+            << objects[i].getTriangleCount() << " triangles, "
+            << stats.nodeCount << " nodes, "
+            << stats.leafCount << " leaves, "
+            << "depth " << stats.maxDepth << ", "
+            << "SAH cost " << stats.sahCost << ", "
+            << "traversal steps/ray " << stats.traversalSteps << ", "
+            << "memory " << stats.memoryBytes / 1024.0 << " KB, ";
+        if (i < objectParseMs.size()) {
+            os << "parse " << objectParseMs[i] << " ms, ";
+            totalParseMs += objectParseMs[i];
+        }
+        os << (stats.loadedFromCache ? "cache load " : "build ") << stats.buildMs << " ms";
+        totalBuildMs += stats.buildMs;
+        if (stats.wideNodeCount > 0) {
+            const real_t improvement = stats.traversalSteps > 0 ? 100 * (1 - stats.wideTraversalSteps / stats.traversalSteps) : 0;
+            os << (stats.compressed ? ", compressed BVH8: " : ", BVH8: ") << stats.wideNodeCount << " nodes, "
+                << "traversal steps/ray " << stats.wideTraversalSteps
+                << " (" << improvement << "% fewer)";
         }
+        os << '\n';
     }
+    os << "Objects parse: " << totalParseMs << " ms, build: " << totalBuildMs << " ms\n";
 }
 
 void Scene::getSizeFromFile(const std::string& fileName, int& width, int& height)
@@ -1,12 +1,20 @@
 #include "scene_object.h"
 #include "utils.h"
 #include "renderer_lib.h"
+#include "bvh_cache.h"
 
 #include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <thread>
 
 void Object::calculate_normals()
 {
-    vertex_normals.resize(vertices.size(), {});
+    vertex_normals.assign(vertices.size(), {});
 
     size_t num_triangles = triangles.size();
     for (size_t i = 0; i < num_triangles; i++) {
@@ -28,94 +36,797 @@ void Object::calculate_normals()
 
 void Object::calculate_aabb()
 {
+    aabb = {};
     for (const Vector& v : vertices) {
         aabb.expand(v);
     }
-    hasAABB = aabb.max.x - aabb.min.x > EPSILON && aabb.max.y - aabb.min.y > EPSILON && aabb.max.z - aabb.min.z > EPSILON;
 }
 
+// Leaf size of the median builder, which has no cost model
 const int MAX_TRIANGLES_PER_LEAF = 8;
 
+// Traversal uses a fixed-size stack of BVH_STACK_SIZE entries.
+// Past this depth, nodes are split at the median, which keeps the depth
+// of the tree well under the stack size for any realistic triangle count.
+const int MAX_SAH_DEPTH = 32;
+
+// Subtrees with fewer triangles are not worth a separate build task
+const int MIN_TRIANGLES_PER_BUILD_TASK = 4096;
+
 void Object::calculate_bvh()
 {
+    const auto startTime = std::chrono::steady_clock::now();
+
     bvh.clear();
-    // Make a lower-bound estimate for the number of nodes.
-    // In a balanced full tree, the amount of nodes is T/MAX_T * 2 - 1
-    // So use that as a starting point
-    size_t est = triangles.size() / MAX_TRIANGLES_PER_LEAF * 2;
-    bvh.reserve(est);
-    BVHNode& root = bvh.emplace_back();
-    root.startTriangleIndex = 0;
-    root.endTriangleIndex = int(triangles.size() - 1);
-    calculate_bvh_recursive(0);
-    // root is likely to be invalidated after the last call. DO NOT USE
+    leafPacks.clear();
+    wideBVH.clear();
+    compressedBVH.clear();
+    packWidth = getSIMDKernels().packWidth;
+    if (!triangles.empty()) {
+        // Every split adds two nodes and every leaf has at least one triangle,
+        // so there are at most 2 * T - 1 nodes. Allocating them upfront
+        // lets subtrees be built concurrently without reallocations.
+        bvh.resize(triangles.size() * 2 - 1);
+        BVHNode& root = bvh[0];
+        root.leftFirst = 0;
+        root.count = int(triangles.size());
+
+        // Build the top levels of the tree in parallel, enough to have a few tasks per thread
+        const unsigned threads = buildSettings.buildThreads > 0 ? buildSettings.buildThreads : std::thread::hardware_concurrency();
+        const int parallelDepth = threads > 1 ? int(std::ceil(std::log2(threads))) + 1 : 0;
+
+        std::atomic<int> nodeCount = 1;
+        if (buildSettings.mode == BVHBuildMode::LBVH) {
+            calculate_lbvh(nodeCount, threads, parallelDepth);
+        }
+        else {
+            calculate_bvh_recursive(0, 0, nodeCount, parallelDepth);
+        }
+        bvh.resize(nodeCount);
+        calculate_leaf_packs();
+        calculate_wide_bvh();
+    }
+    bvh.shrink_to_fit();
+    calculate_bvh_stats();
+    builtSahCost = bvhStats.sahCost;
+
+    const auto endTime = std::chrono::steady_clock::now();
+    bvhStats.buildMs = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+}
+
+void Object::calculate_bvh_cached()
+{
+    const std::string cacheDirectory = BVHCache::getDirectory(buildSettings);
+    if (cacheDirectory.empty() || triangles.empty()) {
+        calculate_bvh();
+        return;
+    }
+
+    const auto startTime = std::chrono::steady_clock::now();
+    const uint64_t key = BVHCache::computeKey(*this);
+    if (!BVHCache::load(*this, cacheDirectory, key)) {
+        calculate_bvh();
+        BVHCache::save(*this, cacheDirectory, key);
+        return;
+    }
+    calculate_bvh_stats();
+    builtSahCost = bvhStats.sahCost;
+
+    const auto endTime = std::chrono::steady_clock::now();
+    bvhStats.buildMs = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+    bvhStats.loadedFromCache = true;
 }
 
-void Object::calculate_bvh_recursive(int nodeIndex)
+void Object::calculate_bvh_recursive(int nodeIndex, int depth, std::atomic<int>& nodeCount, int parallelDepth)
 {
+    // While building, every node is a leaf with its triangles in [leftFirst, leftFirst + count)
+    const int start = bvh[nodeIndex].leftFirst;
+    const int end = start + bvh[nodeIndex].count - 1;
+
     // Calculate the bounding box for the node based on the triangles it contains
-    for (int i = bvh[nodeIndex].startTriangleIndex; i <= bvh[nodeIndex].endTriangleIndex; ++i) {
+    AABB bounds;
+    for (int i = start; i <= end; ++i) {
         const Triangle& triangle = triangles[i];
 
         // Expand the bounding box based on the triangle vertices
-        bvh[nodeIndex].bounds.expand(vertices[triangle.v1]);
-        bvh[nodeIndex].bounds.expand(vertices[triangle.v2]);
-        bvh[nodeIndex].bounds.expand(vertices[triangle.v3]);
+        bounds.expand(vertices[triangle.v1]);
+        bounds.expand(vertices[triangle.v2]);
+        bounds.expand(vertices[triangle.v3]);
     }
+    bvh[nodeIndex].setBounds(bounds);
+
+    // Reorder the triangles of the node and find the last triangle of the left child
+    const int mid = (buildSettings.mode == BVHBuildMode::SAH && depth < MAX_SAH_DEPTH) ?
+        find_split_sah(nodeIndex) :
+        find_split_median(nodeIndex);
 
     // If termination criteria are met, stop recursion and return
-    if (bvh[nodeIndex].endTriangleIndex - bvh[nodeIndex].startTriangleIndex <= MAX_TRIANGLES_PER_LEAF) {
-#if (WITH_SIMD == 2)
-        bvh[nodeIndex].pack = makePackedTriangles(bvh[nodeIndex].startTriangleIndex, bvh[nodeIndex].endTriangleIndex);
-#endif
+    if (mid < 0) {
         return;
     }
 
+    // Create the left and right child nodes, next to each other
+    const int leftIndex = nodeCount.fetch_add(2);
+
+    BVHNode& leftChild = bvh[leftIndex];
+    leftChild.leftFirst = start;
+    leftChild.count = mid - start + 1;
+
+    BVHNode& rightChild = bvh[leftIndex + 1];
+    rightChild.leftFirst = mid + 1;
+    rightChild.count = end - mid;
+
+    bvh[nodeIndex].leftFirst = leftIndex;
+    bvh[nodeIndex].count = 0;
+
+    // The children own disjoint ranges of triangles and nodes, so they can be built concurrently
+    if (depth < parallelDepth && end - start + 1 >= MIN_TRIANGLES_PER_BUILD_TASK) {
+        auto leftTask = std::async(std::launch::async, [&]() {
+            calculate_bvh_recursive(leftIndex, depth + 1, nodeCount, parallelDepth);
+        });
+        calculate_bvh_recursive(leftIndex + 1, depth + 1, nodeCount, parallelDepth);
+        leftTask.get();
+    }
+    else {
+        calculate_bvh_recursive(leftIndex, depth + 1, nodeCount, parallelDepth);
+        calculate_bvh_recursive(leftIndex + 1, depth + 1, nodeCount, parallelDepth);
+    }
+}
+
+Vector Object::triangleCentroid(const Triangle& triangle) const
+{
+    return (vertices[triangle.v1] + vertices[triangle.v2] + vertices[triangle.v3]) / 3.0f;
+}
+
+int Object::find_split_median(int nodeIndex)
+{
+    const int start = bvh[nodeIndex].leftFirst;
+    const int end = start + bvh[nodeIndex].count - 1;
+
+    if (end - start + 1 <= MAX_TRIANGLES_PER_LEAF) {
+        return -1;
+    }
+
     // Calculate the axis to split along (e.g., longest axis of the bounding box)
-    Vector boxSize = bvh[nodeIndex].bounds.max - bvh[nodeIndex].bounds.min;
+    const AABB bounds = bvh[nodeIndex].getBounds();
+    Vector boxSize = bounds.max - bounds.min;
     int splitAxis = boxSize.maxDimension();
 
     // Calculate the midpoint to split the triangles
-    int mid = bvh[nodeIndex].startTriangleIndex + (bvh[nodeIndex].endTriangleIndex - bvh[nodeIndex].startTriangleIndex) / 2;
+    int mid = start + (end - start) / 2;
 
     // Sort the triangles based on their centroid along the chosen axis
-    std::nth_element(triangles.begin() + bvh[nodeIndex].startTriangleIndex, triangles.begin() + mid, triangles.begin() + bvh[nodeIndex].endTriangleIndex + 1,
+    std::nth_element(triangles.begin() + start, triangles.begin() + mid, triangles.begin() + end + 1,
         [&](const Triangle& a, const Triangle& b) {
-            Vector centroidA = (vertices[a.v1] + vertices[a.v2] + vertices[a.v3]) / 3.0f;
-            Vector centroidB = (vertices[b.v1] + vertices[b.v2] + vertices[b.v3]) / 3.0f;
-            return centroidA[splitAxis] < centroidB[splitAxis];
+            return triangleCentroid(a)[splitAxis] < triangleCentroid(b)[splitAxis];
         });
 
-    // Create the left and right child nodes
-    BVHNode& leftChild = bvh.emplace_back();
-    leftChild.startTriangleIndex = bvh[nodeIndex].startTriangleIndex;
-    leftChild.endTriangleIndex = mid;
+    return mid;
+}
+
+int Object::find_split_sah(int nodeIndex)
+{
+    const int start = bvh[nodeIndex].leftFirst;
+    const int count = bvh[nodeIndex].count;
+    const int end = start + count - 1;
+
+    if (count <= std::max(buildSettings.minLeafSize, 1)) {
+        return -1;
+    }
+
+    // Bin the triangles by their centroids, so only the bin boundaries
+    // have to be evaluated as split candidates
+    AABB centroidBounds;
+    for (int i = start; i <= end; ++i) {
+        centroidBounds.expand(triangleCentroid(triangles[i]));
+    }
+
+    struct Bin {
+        AABB bounds;
+        int count = 0;
+    };
+    const int binCount = std::max(buildSettings.binCount, 2);
+    std::vector<Bin> bins(binCount);
+    std::vector<real_t> leftArea(binCount);
+    std::vector<int> leftCount(binCount);
+
+    real_t bestCost = 1e30f;
+    int bestAxis = -1;
+    int bestBin = -1;
+
+    for (int axis = 0; axis < 3; ++axis) {
+        const real_t extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+        if (extent < EPSILON) {
+            continue;
+        }
+        const real_t scale = binCount / extent;
+
+        std::fill(bins.begin(), bins.end(), Bin{});
+        for (int i = start; i <= end; ++i) {
+            const Triangle& triangle = triangles[i];
+            const int b = std::min(binCount - 1, int((triangleCentroid(triangle)[axis] - centroidBounds.min[axis]) * scale));
+            bins[b].count++;
+            bins[b].bounds.expand(vertices[triangle.v1]);
+            bins[b].bounds.expand(vertices[triangle.v2]);
+            bins[b].bounds.expand(vertices[triangle.v3]);
+        }
+
+        // Sweep from the left to get the area and count on the left side of each plane...
+        AABB left;
+        int leftSum = 0;
+        for (int b = 0; b < binCount - 1; ++b) {
+            left.expand(bins[b].bounds);
+            leftSum += bins[b].count;
+            leftArea[b] = left.surfaceArea();
+            leftCount[b] = leftSum;
+        }
+
+        // ... and from the right to evaluate the cost of splitting after bin b
+        AABB right;
+        int rightSum = 0;
+        for (int b = binCount - 1; b > 0; --b) {
+            right.expand(bins[b].bounds);
+            rightSum += bins[b].count;
+            if (leftCount[b - 1] == 0 || rightSum == 0) {
+                continue;
+            }
+            const real_t cost = leftArea[b - 1] * leafPackCount(leftCount[b - 1]) + right.surfaceArea() * leafPackCount(rightSum);
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = b - 1;
+            }
+        }
+    }
+
+    const real_t nodeArea = bvh[nodeIndex].getBounds().surfaceArea();
+    if (bestAxis != -1 && nodeArea > 0) {
+        bestCost = buildSettings.traversalCost + buildSettings.intersectionCost * bestCost / nodeArea;
+    }
+    const real_t leafCost = buildSettings.intersectionCost * leafPackCount(count);
+
+    if (count <= buildSettings.maxLeafSize && (bestAxis == -1 || bestCost >= leafCost)) {
+        return -1;
+    }
+
+    if (bestAxis == -1) {
+        // All centroids coincide, but the node is too big for a leaf.
+        // Split it in the middle, the order of the triangles doesn't matter.
+        return start + (count - 1) / 2;
+    }
+
+    const real_t scale = binCount / (centroidBounds.max[bestAxis] - centroidBounds.min[bestAxis]);
+    auto midIt = std::partition(triangles.begin() + start, triangles.begin() + end + 1,
+        [&](const Triangle& triangle) {
+            const int b = std::min(binCount - 1, int((triangleCentroid(triangle)[bestAxis] - centroidBounds.min[bestAxis]) * scale));
+            return b <= bestBin;
+        });
 
-    BVHNode& rightChild = bvh.emplace_back();
-    rightChild.startTriangleIndex = mid + 1;
-    rightChild.endTriangleIndex = bvh[nodeIndex].endTriangleIndex;
+    return int(midIt - triangles.begin()) - 1;
+}
 
-    bvh[nodeIndex].left = int(bvh.size() - 2);
-    bvh[nodeIndex].right = int(bvh.size() - 1);
+// Spread the lower 10 bits of v, so that there are two zero bits between every two of them
+uint32_t expandMortonBits(uint32_t v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
 
-    // leftChild and rightChild will most likely be invalidated after these 2 calls.
-    // DO NOT USE THEM BELLOW
-    calculate_bvh_recursive(bvh[nodeIndex].left);
-    calculate_bvh_recursive(bvh[nodeIndex].right);
+// 30-bit Morton code of a point in the unit cube
+uint32_t mortonCode(real_t x, real_t y, real_t z)
+{
+    auto quantize = [](real_t f) {
+        return uint32_t(std::min(std::max(f * 1024.0f, 0.0f), 1023.0f));
+    };
+    return (expandMortonBits(quantize(x)) << 2) | (expandMortonBits(quantize(y)) << 1) | expandMortonBits(quantize(z));
 }
 
-IntersectionData Object::smoothIntersection(const IntersectionData& idata) const
+// Sort 64-bit keys by the 30-bit Morton code in their upper half.
+// LSD radix sort: every pass histograms and scatters disjoint chunks of the keys concurrently.
+void radixSortMortonKeys(std::vector<uint64_t>& keys, unsigned threads)
 {
-    IntersectionData idataSmooth = idata;
+    const int RADIX_BITS = 10;
+    const int RADIX = 1 << RADIX_BITS;
+
+    const size_t n = keys.size();
+    const size_t chunkCount = std::max<size_t>(1, std::min<size_t>(threads, n / MIN_TRIANGLES_PER_BUILD_TASK));
+    const size_t chunkSize = (n + chunkCount - 1) / chunkCount;
+
+    auto forEachChunk = [&](auto&& func) {
+        std::vector<std::future<void>> tasks;
+        for (size_t c = 1; c < chunkCount; ++c) {
+            tasks.push_back(std::async(std::launch::async, func, c));
+        }
+        func(0);
+        for (std::future<void>& task : tasks) {
+            task.get();
+        }
+    };
+
+    std::vector<uint64_t> sorted(n);
+    // Write position of every digit in every chunk
+    std::vector<size_t> offsets(chunkCount * RADIX);
+
+    for (int shift = 32; shift < 32 + 30; shift += RADIX_BITS) {
+        std::fill(offsets.begin(), offsets.end(), 0);
 
-    const Vector P = idata.ip;
-    const Vector A = vertices[triangles[idata.triangle_index].v1];
-    const Vector B = vertices[triangles[idata.triangle_index].v2];
-    const Vector C = vertices[triangles[idata.triangle_index].v3];
+        forEachChunk([&](size_t c) {
+            size_t* counts = &offsets[c * RADIX];
+            const size_t chunkEnd = std::min(n, (c + 1) * chunkSize);
+            for (size_t i = c * chunkSize; i < chunkEnd; ++i) {
+                counts[(keys[i] >> shift) & (RADIX - 1)]++;
+            }
+        });
+
+        // Keys with a smaller digit go first, ties keep the chunk order, so the sort is stable
+        size_t sum = 0;
+        for (int digit = 0; digit < RADIX; ++digit) {
+            for (size_t c = 0; c < chunkCount; ++c) {
+                const size_t count = offsets[c * RADIX + digit];
+                offsets[c * RADIX + digit] = sum;
+                sum += count;
+            }
+        }
 
-    const Vector nA = vertex_normals[triangles[idata.triangle_index].v1];
-    const Vector nB = vertex_normals[triangles[idata.triangle_index].v2];
-    const Vector nC = vertex_normals[triangles[idata.triangle_index].v3];
+        forEachChunk([&](size_t c) {
+            size_t* positions = &offsets[c * RADIX];
+            const size_t chunkEnd = std::min(n, (c + 1) * chunkSize);
+            for (size_t i = c * chunkSize; i < chunkEnd; ++i) {
+                sorted[positions[(keys[i] >> shift) & (RADIX - 1)]++] = keys[i];
+            }
+        });
+
+        keys.swap(sorted);
+    }
+}
+
+void Object::calculate_lbvh(std::atomic<int>& nodeCount, unsigned threads, int parallelDepth)
+{
+    const size_t count = triangles.size();
+
+    AABB centroidBounds;
+    for (const Triangle& triangle : triangles) {
+        centroidBounds.expand(triangleCentroid(triangle));
+    }
+    const Vector extent = centroidBounds.max - centroidBounds.min;
+    const Vector scale{
+        extent.x > EPSILON ? 1.0f / extent.x : 0.0f,
+        extent.y > EPSILON ? 1.0f / extent.y : 0.0f,
+        extent.z > EPSILON ? 1.0f / extent.z : 0.0f,
+    };
+
+    // Morton code in the upper half, triangle index in the lower one
+    std::vector<uint64_t> keys(count);
+    for (size_t i = 0; i < count; ++i) {
+        const Vector c = triangleCentroid(triangles[i]) - centroidBounds.min;
+        const uint32_t code = mortonCode(c.x * scale.x, c.y * scale.y, c.z * scale.z);
+        keys[i] = (uint64_t(code) << 32) | uint64_t(i);
+    }
+
+    radixSortMortonKeys(keys, std::max(threads, 1u));
+
+    std::vector<Triangle> sortedTriangles(count);
+    std::vector<uint32_t> mortonCodes(count);
+    for (size_t i = 0; i < count; ++i) {
+        sortedTriangles[i] = triangles[uint32_t(keys[i])];
+        mortonCodes[i] = uint32_t(keys[i] >> 32);
+    }
+    triangles.swap(sortedTriangles);
+
+    calculate_lbvh_recursive(0, mortonCodes, 0, nodeCount, parallelDepth);
+}
+
+void Object::calculate_lbvh_recursive(int nodeIndex, const std::vector<uint32_t>& mortonCodes, int depth, std::atomic<int>& nodeCount, int parallelDepth)
+{
+    const int start = bvh[nodeIndex].leftFirst;
+    const int count = bvh[nodeIndex].count;
+    const int end = start + count - 1;
+
+    if (count <= std::max(buildSettings.maxLeafSize, 1)) {
+        AABB bounds;
+        for (int i = start; i <= end; ++i) {
+            const Triangle& triangle = triangles[i];
+            bounds.expand(vertices[triangle.v1]);
+            bounds.expand(vertices[triangle.v2]);
+            bounds.expand(vertices[triangle.v3]);
+        }
+        bvh[nodeIndex].setBounds(bounds);
+        return;
+    }
+
+    // The codes are sorted, so the triangles with the highest differing bit
+    // of the range set are all at its end. Split there, or in the middle if all codes are equal.
+    int mid = start + (count - 1) / 2;
+    uint32_t diff = mortonCodes[start] ^ mortonCodes[end];
+    if (diff != 0) {
+        while (diff & (diff - 1)) {
+            diff &= diff - 1;
+        }
+        const auto rightIt = std::partition_point(mortonCodes.begin() + start, mortonCodes.begin() + end + 1,
+            [diff](uint32_t code) { return (code & diff) == 0; });
+        mid = int(rightIt - mortonCodes.begin()) - 1;
+    }
+
+    const int leftIndex = nodeCount.fetch_add(2);
+
+    BVHNode& leftChild = bvh[leftIndex];
+    leftChild.leftFirst = start;
+    leftChild.count = mid - start + 1;
+
+    BVHNode& rightChild = bvh[leftIndex + 1];
+    rightChild.leftFirst = mid + 1;
+    rightChild.count = end - mid;
+
+    bvh[nodeIndex].leftFirst = leftIndex;
+    bvh[nodeIndex].count = 0;
+
+    if (depth < parallelDepth && count >= MIN_TRIANGLES_PER_BUILD_TASK) {
+        auto leftTask = std::async(std::launch::async, [&]() {
+            calculate_lbvh_recursive(leftIndex, mortonCodes, depth + 1, nodeCount, parallelDepth);
+        });
+        calculate_lbvh_recursive(leftIndex + 1, mortonCodes, depth + 1, nodeCount, parallelDepth);
+        leftTask.get();
+    }
+    else {
+        calculate_lbvh_recursive(leftIndex, mortonCodes, depth + 1, nodeCount, parallelDepth);
+        calculate_lbvh_recursive(leftIndex + 1, mortonCodes, depth + 1, nodeCount, parallelDepth);
+    }
+
+    // The bounds are gathered bottom-up, so every triangle is visited once
+    AABB bounds = bvh[leftIndex].getBounds();
+    bounds.expand(bvh[leftIndex + 1].getBounds());
+    bvh[nodeIndex].setBounds(bounds);
+}
+
+bool Object::updateVertices(const std::vector<Vector>& newVertices)
+{
+    if (newVertices.size() != vertices.size()) {
+        std::cerr << "Error: Expected " << vertices.size() << " vertices, got " << newVertices.size() << '\n';
+        return false;
+    }
+    vertices = newVertices;
+    calculate_normals();
+    calculate_aabb();
+
+    refit_bvh();
+    if (buildSettings.refitRebuildThreshold > 0 && bvhStats.sahCost > builtSahCost * buildSettings.refitRebuildThreshold) {
+        calculate_bvh();
+        return true;
+    }
+    return false;
+}
+
+void Object::refit_bvh()
+{
+    // Children are always allocated after their parent,
+    // so walking the nodes backwards visits them bottom-up
+    for (int i = int(bvh.size()) - 1; i >= 0; --i) {
+        BVHNode& node = bvh[i];
+        AABB bounds;
+        if (node.isLeaf()) {
+            const int start = getLeafPackInfo(node.leftFirst).firstTriangle;
+            makeLeafPacks(node.leftFirst, start, node.count);
+            for (int t = start; t < start + node.count; ++t) {
+                const Triangle& triangle = triangles[t];
+                bounds.expand(vertices[triangle.v1]);
+                bounds.expand(vertices[triangle.v2]);
+                bounds.expand(vertices[triangle.v3]);
+            }
+        }
+        else {
+            bounds = bvh[node.leftFirst].getBounds();
+            bounds.expand(bvh[node.leftFirst + 1].getBounds());
+        }
+        node.setBounds(bounds);
+    }
+
+    // The wide nodes store copies of the bounds, collapsing again is as cheap as updating them
+    calculate_wide_bvh();
+
+    const double buildMs = bvhStats.buildMs;
+    calculate_bvh_stats();
+    bvhStats.buildMs = buildMs;
+}
+
+void Object::setWideBVHLayout(bool wide, bool compressed)
+{
+    buildSettings.wide = wide;
+    buildSettings.compressed = compressed;
+    calculate_wide_bvh();
+
+    const double buildMs = bvhStats.buildMs;
+    const bool loadedFromCache = bvhStats.loadedFromCache;
+    calculate_bvh_stats();
+    bvhStats.buildMs = buildMs;
+    bvhStats.loadedFromCache = loadedFromCache;
+}
+
+// Plane of a compressed wide node, see CompressedWideBVHNode
+static float dequantizePlane(float origin, float scale, int q)
+{
+    return origin + float(q) * scale;
+}
+
+// Smallest power of two grid step that reaches maxPlane from minPlane in 255 steps
+static float quantizationScale(float minPlane, float maxPlane)
+{
+    // At least an ulp of the planes, so that the inverted boxes of unused slots stay inverted
+    const float extent = std::max(maxPlane - minPlane, std::max(std::abs(minPlane), std::abs(maxPlane)) * FLT_EPSILON);
+    float scale = std::exp2(std::ceil(std::log2(std::max(extent / 255, FLT_MIN))));
+    while (dequantizePlane(minPlane, scale, 255) < maxPlane) {
+        scale *= 2;
+    }
+    return scale;
+}
+
+// Quantized planes are rounded outwards, checked against the dequantized value the kernels compute
+static unsigned char quantizeMinPlane(float origin, float scale, float plane)
+{
+    int q = std::clamp(int(std::floor((plane - origin) / scale)), 0, 255);
+    while (q > 0 && dequantizePlane(origin, scale, q) > plane) {
+        --q;
+    }
+    return (unsigned char)q;
+}
+
+static unsigned char quantizeMaxPlane(float origin, float scale, float plane)
+{
+    int q = std::clamp(int(std::ceil((plane - origin) / scale)), 0, 255);
+    while (q < 255 && dequantizePlane(origin, scale, q) < plane) {
+        ++q;
+    }
+    return (unsigned char)q;
+}
+
+static AABB compressedChildBounds(const CompressedWideBVHNode& node, int i)
+{
+    AABB bounds;
+    if (node.qMin[0][i] > node.qMax[0][i]) {
+        return bounds;
+    }
+    for (int axis = 0; axis < 3; ++axis) {
+        bounds.min[axis] = dequantizePlane(node.origin[axis], node.scale[axis], node.qMin[axis][i]);
+        bounds.max[axis] = dequantizePlane(node.origin[axis], node.scale[axis], node.qMax[axis][i]);
+    }
+    return bounds;
+}
+
+void Object::calculate_bvh_stats()
+{
+    bvhStats = {};
+    if (bvh.empty()) {
+        return;
+    }
+
+    const real_t rootArea = bvh[0].getBounds().surfaceArea();
+    const real_t invRootArea = rootArea > 0 ? 1 / rootArea : 0;
+
+    std::vector<std::pair<int, int>> stack{ { 0, 1 } };
+    while (!stack.empty()) {
+        const auto [nodeIndex, depth] = stack.back();
+        stack.pop_back();
+
+        const BVHNode& node = bvh[nodeIndex];
+        const real_t relativeArea = node.getBounds().surfaceArea() * invRootArea;
+        bvhStats.nodeCount++;
+        bvhStats.maxDepth = std::max(bvhStats.maxDepth, depth);
+        if (node.isLeaf()) {
+            bvhStats.leafCount++;
+            bvhStats.sahCost += buildSettings.intersectionCost * leafPackCount(node.count) * relativeArea;
+        }
+        else {
+            bvhStats.sahCost += buildSettings.traversalCost * relativeArea;
+            bvhStats.traversalSteps += relativeArea;
+            stack.push_back({ node.leftFirst, depth + 1 });
+            stack.push_back({ node.leftFirst + 1, depth + 1 });
+        }
+    }
+
+    bvhStats.memoryBytes = bvh.size() * sizeof(BVHNode);
+    bvhStats.memoryBytes += leafPacks.size() * sizeof(LeafPackBlock);
+    bvhStats.memoryBytes += wideBVH.size() * sizeof(WideBVHNode);
+    bvhStats.memoryBytes += compressedBVH.size() * sizeof(CompressedWideBVHNode);
+
+    bvhStats.wideNodeCount = int(wideBVH.size() + compressedBVH.size());
+    bvhStats.compressed = !compressedBVH.empty();
+    for (const WideBVHNode& node : wideBVH) {
+        AABB bounds;
+        for (int i = 0; i < 8; ++i) {
+            bounds.expand(AABB{ { node.minX[i], node.minY[i], node.minZ[i] }, { node.maxX[i], node.maxY[i], node.maxZ[i] } });
+        }
+        bvhStats.wideTraversalSteps += bounds.surfaceArea() * invRootArea;
+    }
+    // With the quantized bounds, which are a bit larger
+    for (const CompressedWideBVHNode& node : compressedBVH) {
+        AABB bounds;
+        for (int i = 0; i < 8; ++i) {
+            bounds.expand(compressedChildBounds(node, i));
+        }
+        bvhStats.wideTraversalSteps += bounds.surfaceArea() * invRootArea;
+    }
+}
+
+void Object::calculate_wide_bvh()
+{
+    wideBVH.clear();
+    compressedBVH.clear();
+    if (!(buildSettings.wide || buildSettings.compressed) || bvh.empty() || bvh[0].isLeaf()) {
+        return;
+    }
+    collapse_wide_bvh_recursive(0);
+    if (buildSettings.compressed) {
+        compress_wide_bvh();
+    }
+}
+
+int Object::collapse_wide_bvh_recursive(int nodeIndex)
+{
+    // Open up the interior child with the largest surface area,
+    // until there are 8 children or all of them are leaves
+    int children[8] = { bvh[nodeIndex].leftFirst, bvh[nodeIndex].leftFirst + 1 };
+    int childCount = 2;
+    while (childCount < 8) {
+        int best = -1;
+        real_t bestArea = -1;
+        for (int i = 0; i < childCount; ++i) {
+            const BVHNode& child = bvh[children[i]];
+            const real_t area = child.getBounds().surfaceArea();
+            if (!child.isLeaf() && area > bestArea) {
+                best = i;
+                bestArea = area;
+            }
+        }
+        if (best == -1) {
+            break;
+        }
+        const int opened = children[best];
+        children[best] = bvh[opened].leftFirst;
+        children[childCount++] = bvh[opened].leftFirst + 1;
+    }
+
+    const int wideIndex = int(wideBVH.size());
+    WideBVHNode& wideNode = wideBVH.emplace_back();
+    for (int i = 0; i < 8; ++i) {
+        const AABB bounds = i < childCount ? bvh[children[i]].getBounds() : AABB{};
+        wideNode.minX[i] = bounds.min.x;
+        wideNode.minY[i] = bounds.min.y;
+        wideNode.minZ[i] = bounds.min.z;
+        wideNode.maxX[i] = bounds.max.x;
+        wideNode.maxY[i] = bounds.max.y;
+        wideNode.maxZ[i] = bounds.max.z;
+        wideNode.child[i] = ~0;
+    }
+
+    // wideNode will most likely be invalidated by the recursive calls.
+    // DO NOT USE IT BELLOW
+    for (int i = 0; i < childCount; ++i) {
+        const bool leaf = bvh[children[i]].isLeaf();
+        const int child = leaf ? ~children[i] : collapse_wide_bvh_recursive(children[i]);
+        wideBVH[wideIndex].child[i] = child;
+    }
+    return wideIndex;
+}
+
+void Object::compress_wide_bvh()
+{
+    compressedBVH.resize(wideBVH.size());
+    for (size_t n = 0; n < wideBVH.size(); ++n) {
+        const WideBVHNode& node = wideBVH[n];
+        CompressedWideBVHNode& compressedNode = compressedBVH[n];
+        const float* childMin[3] = { node.minX, node.minY, node.minZ };
+        const float* childMax[3] = { node.maxX, node.maxY, node.maxZ };
+
+        // Unused child slots have empty bounds
+        AABB bounds;
+        for (int i = 0; i < 8; ++i) {
+            bounds.expand(AABB{ { node.minX[i], node.minY[i], node.minZ[i] }, { node.maxX[i], node.maxY[i], node.maxZ[i] } });
+        }
+        for (int axis = 0; axis < 3; ++axis) {
+            const float origin = bounds.min[axis];
+            const float scale = quantizationScale(bounds.min[axis], bounds.max[axis]);
+            compressedNode.origin[axis] = origin;
+            compressedNode.scale[axis] = scale;
+            for (int i = 0; i < 8; ++i) {
+                const bool used = childMin[0][i] <= childMax[0][i];
+                compressedNode.qMin[axis][i] = used ? quantizeMinPlane(origin, scale, childMin[axis][i]) : 255;
+                compressedNode.qMax[axis][i] = used ? quantizeMaxPlane(origin, scale, childMax[axis][i]) : 0;
+            }
+        }
+        std::memcpy(compressedNode.child, node.child, sizeof(node.child));
+    }
+
+    // Traversal uses only the compressed nodes, refits collapse and compress the binary BVH again
+    wideBVH.clear();
+    wideBVH.shrink_to_fit();
+}
+
+int Object::leafPackCount(int triangleCount) const
+{
+    return (triangleCount + packWidth - 1) / packWidth;
+}
+
+int Object::leafPackBlocks() const
+{
+    const size_t packBytes = 9 * packWidth * sizeof(float) + sizeof(LeafPackInfo);
+    return int((packBytes + sizeof(LeafPackBlock) - 1) / sizeof(LeafPackBlock));
+}
+
+LeafPackInfo Object::getLeafPackInfo(int block) const
+{
+    // The info follows the floats of the pack, see LeafPackBlock
+    LeafPackInfo info;
+    std::memcpy(&info, leafPacks[block].data + 9 * packWidth, sizeof(info));
+    return info;
+}
+
+void Object::calculate_leaf_packs()
+{
+    const int blocksPerPack = leafPackBlocks();
+    int blockCount = 0;
+    for (const BVHNode& node : bvh) {
+        if (node.isLeaf()) {
+            blockCount += leafPackCount(node.count) * blocksPerPack;
+        }
+    }
+
+    leafPacks.assign(blockCount, {});
+    int block = 0;
+    for (BVHNode& node : bvh) {
+        if (node.isLeaf()) {
+            makeLeafPacks(block, node.leftFirst, node.count);
+            node.leftFirst = block;
+            block += leafPackCount(node.count) * blocksPerPack;
+        }
+    }
+}
+
+void Object::makeLeafPacks(int block, int start, int count)
+{
+    const int blocksPerPack = leafPackBlocks();
+    for (int first = 0; first < count; first += packWidth, block += blocksPerPack) {
+        const int packCount = std::min(packWidth, count - first);
+        float* pack = leafPacks[block].data;
+        for (int lane = 0; lane < packWidth; ++lane) {
+            const Triangle& triangle = triangles[start + first + std::min(lane, packCount - 1)];
+            const Vector& v0 = vertices[triangle.v1];
+            // The watertight test takes the vertices as they are, see LeafPackBlock
+            const Vector e1 = buildSettings.watertight ? vertices[triangle.v2] : vertices[triangle.v2] - v0;
+            const Vector e2 = buildSettings.watertight ? vertices[triangle.v3] : vertices[triangle.v3] - v0;
+            for (int axis = 0; axis < 3; ++axis) {
+                pack[axis * packWidth + lane] = v0[axis];
+                pack[(3 + axis) * packWidth + lane] = e1[axis];
+                pack[(6 + axis) * packWidth + lane] = e2[axis];
+            }
+        }
+        const LeafPackInfo info{ start + first, packCount };
+        std::memcpy(pack + 9 * packWidth, &info, sizeof(info));
+    }
+}
+
+HitAttributes Object::finalizeHit(const Vector& ip, const IntersectionData& idata, bool smooth) const
+{
+    const Triangle& triangle = triangles[idata.triangle_index];
+    const Vector A = vertices[triangle.v1];
+    const Vector B = vertices[triangle.v2];
+    const Vector C = vertices[triangle.v3];
+
+    HitAttributes hit;
+    hit.ip = ip;
+    hit.normal = normalized(cross(B - A, C - A));
+    if (!smooth) {
+        hit.smoothIp = hit.ip;
+        hit.smoothNormal = hit.normal;
+        return hit;
+    }
+
+    const Vector P = ip;
+    const real_t w = 1 - idata.u - idata.v;
+    const Vector nA = vertex_normals[triangle.v1];
+    const Vector nB = vertex_normals[triangle.v2];
+    const Vector nC = vertex_normals[triangle.v3];
 
     // Attempt to fix the shadow terminator problem.
     // Hanika, J. (2021). Hacking the Shadow Terminator.
@@ -135,383 +846,385 @@ IntersectionData Object::smoothIntersection(const IntersectionData& idata) const
     tmpv = tmpv - dotv * nC;
 
     // finally P' is the barycentric mean of these three
-    idataSmooth.ip = P + idata.u * tmpu + idata.v * tmpv + idata.w * tmpw;
-    idataSmooth.normal = normalized(
-        nA * idata.w +
+    hit.smoothIp = P + idata.u * tmpu + idata.v * tmpv + w * tmpw;
+    hit.smoothNormal = normalized(
+        nA * w +
         nB * idata.u +
         nC * idata.v
     );
 
-    return idataSmooth;
+    return hit;
 }
 
-bool triangleIntersection(const Ray& ray, const std::vector<Vector>& vertices, int v1, int v2, int v3, IntersectionData& idata, bool backface = false, real_t max_t = 1e30f)
+// KernelRay::shearAxes and KernelRay::shear of a direction
+static void prepareShear(const Vector& dir, int axes[3], float shear[3])
 {
-    real_t& t = idata.t;
-    real_t& u = idata.u;
-    real_t& v = idata.v;
-
-    // Calculate the triangle edges
-    const Vector e1 = vertices[v2] - vertices[v1];
-    const Vector e2 = vertices[v3] - vertices[v1];
-
-    const Vector h = cross(ray.dir, e2);
-    real_t d = dot(e1, h);
-
-    // Ray is parallel to the triangle
-    if ((backface ? std::abs(d) : d) < EPSILON)
-        return false;
-
-    // If d < 0 => we are hitting the back side of the triangle plane
-    // return here if we want backface culling
-
-    // Precompute to avoid division
-    real_t f = 1 / d;
-
-    const Vector s = ray.origin - vertices[v1];
-    // U component of the barycentric coordinates of the intersection point
-    // on the triangle plane, with axis e1 and e2
-    // It is the signed distance from AC (e2) side to the intersection point,
-    // normalized to the distance from AC to B
-    u = f * dot(s, h);
-
-    // If u < 0, it means the intersection point is on the other side of the AC triangle side compared to B
-    // if u > 1, it means the intersection point is further away from AC than B
-    // both of those cases imply the ray does not intersect the triangle
-    if (u < 0.0f || u > 1.0f)
-        return false;
+    int kz = 0;
+    for (int axis = 1; axis < 3; ++axis) {
+        if (std::abs(dir[axis]) > std::abs(dir[kz])) {
+            kz = axis;
+        }
+    }
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+    if (dir[kz] < 0) {
+        std::swap(kx, ky);
+    }
+    axes[0] = kx;
+    axes[1] = ky;
+    axes[2] = kz;
+    shear[0] = dir[kx] / dir[kz];
+    shear[1] = dir[ky] / dir[kz];
+    shear[2] = 1 / dir[kz];
+}
 
-    const Vector q = cross(s, e1);
-    // V component of the barycentric coordinates of the intersection point
-    // on the tirangle plane, with axis e1, e2
-    // It is the signed distance from AB (e1) side to the intersection point,
-    // normalized to the distance from AB to C
-    v = f * dot(ray.dir, q);
-
-    // v < 0 means IP is on the other side of AB compared to C
-    // u + v > 1 means IP on the other side of BC compared to A
-    // both of those cases imply the ray does not intersect the triangle
-    if (v < 0.0f || u + v > 1.0f)
-        return false;
+KernelRay prepareRay(const Ray& ray)
+{
+    KernelRay kernelRay;
+    for (int axis = 0; axis < 3; ++axis) {
+        kernelRay.origin[axis] = ray.origin[axis];
+        kernelRay.dir[axis] = ray.dir[axis];
+        kernelRay.invDir[axis] = 1 / ray.dir[axis];
+        kernelRay.originInvDir[axis] = ray.origin[axis] * kernelRay.invDir[axis];
+        kernelRay.negativeDir[axis] = kernelRay.invDir[axis] < 0;
+    }
+    prepareShear(ray.dir, kernelRay.shearAxes, kernelRay.shear);
+    return kernelRay;
+}
 
-    // Calculate the distance from ray origin to the IP
-    t = f * dot(e2, q);
+KernelRayPacket prepareRayPacket(const Ray rays[RAY_PACKET_SIZE])
+{
+    KernelRayPacket packet;
+    for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+        for (int axis = 0; axis < 3; ++axis) {
+            packet.origin[axis][i] = rays[i].origin[axis];
+            packet.dir[axis][i] = rays[i].dir[axis];
+            packet.invDir[axis][i] = 1 / rays[i].dir[axis];
+            packet.originInvDir[axis][i] = rays[i].origin[axis] * packet.invDir[axis][i];
+        }
+        int axes[3];
+        float shear[3];
+        prepareShear(rays[i].dir, axes, shear);
+        for (int axis = 0; axis < 3; ++axis) {
+            packet.shearAxes[axis][i] = axes[axis];
+            packet.shear[axis][i] = shear[axis];
+        }
+    }
+    return packet;
+}
 
-    // If t < 0, the intersection is in the negative ray direction
-    if (t < 0 || t > max_t) {
+template <bool backface>
+bool Object::intersectBVHTriangles(const KernelRay& ray, const SIMDKernels& kernels, const BVHNode& node, IntersectionData& idata) const
+{
+    const int blocksPerPack = leafPackBlocks();
+    const auto intersectLeafPack = buildSettings.watertight ? kernels.intersectLeafPackWatertight : kernels.intersectLeafPack;
+    KernelHit hit{ idata.t, 0, 0, 0 };
+    int hitBlock = -1;
+    for (int first = 0, block = node.leftFirst; first < node.count; first += packWidth, block += blocksPerPack) {
+        if (intersectLeafPack(ray, leafPacks[block].data, std::min(packWidth, node.count - first), backface, hit)) {
+            hitBlock = block;
+        }
+    }
+    if (hitBlock < 0) {
         return false;
     }
 
-    idata.w = 1 - u - v;
-    idata.ip = ray.origin + ray.dir * t;
-    idata.normal = normalized(cross(e1, e2));
-    // The ray intersects the triangle
+    setLeafPackHit(hitBlock, hit, idata);
     return true;
 }
 
-#if (WITH_SIMD == 2)
-
-void avx_multi_cross(__m256 result[3], const __m256 a[3], const __m256 b[3])
+// Only what is needed to pick the closest hit, the position and normals wait for finalizeHit
+void Object::setLeafPackHit(int block, const KernelHit& hit, IntersectionData& idata) const
 {
-    result[0] = _mm256_fmsub_ps(a[1], b[2], _mm256_mul_ps(b[1], a[2]));
-    result[1] = _mm256_fmsub_ps(a[2], b[0], _mm256_mul_ps(b[2], a[0]));
-    result[2] = _mm256_fmsub_ps(a[0], b[1], _mm256_mul_ps(b[0], a[1]));
+    idata.t = hit.t;
+    idata.u = hit.u;
+    idata.v = hit.v;
+    idata.triangle_index = getLeafPackInfo(block).firstTriangle + hit.lane;
+    idata.object = this;
 }
 
-__m256 avx_multi_dot(const __m256 a[3], const __m256 b[3])
+template <bool backface>
+bool Object::occludedBVHTriangles(const KernelRay& ray, const SIMDKernels& kernels, const BVHNode& node, real_t max_t) const
 {
-    return _mm256_fmadd_ps(a[2], b[2], _mm256_fmadd_ps(a[1], b[1], _mm256_mul_ps(a[0], b[0])));
+    const int blocksPerPack = leafPackBlocks();
+    const auto occludedLeafPack = buildSettings.watertight ? kernels.occludedLeafPackWatertight : kernels.occludedLeafPack;
+    for (int first = 0, block = node.leftFirst; first < node.count; first += packWidth, block += blocksPerPack) {
+        if (occludedLeafPack(ray, leafPacks[block].data, std::min(packWidth, node.count - first), backface, max_t)) {
+            return true;
+        }
+    }
+    return false;
 }
 
-void avx_multi_sub(__m256 result[3], const __m256 a[3], const __m256 b[3])
+template <RayQuery query>
+bool Object::BVHIntersection(const KernelRay& ray, const SIMDKernels& kernels, IntersectionData& idata, real_t max_t) const
 {
-    result[0] = _mm256_sub_ps(a[0], b[0]);
-    result[1] = _mm256_sub_ps(a[1], b[1]);
-    result[2] = _mm256_sub_ps(a[2], b[2]);
-}
+    struct StackEntry {
+        int nodeIndex;
+        real_t tNear;
+    };
+    StackEntry stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+
+    real_t tNear;
+    if (!kernels.intersectAABB(ray, bvh[0].boundsMin, bvh[0].boundsMax, tNear)) {
+        return false;
+    }
+    stack[stackSize++] = { 0, tNear };
 
-const __m256 oneM256 = _mm256_set1_ps(1.0f);
-const __m256 minusOneM256 = _mm256_set1_ps(-1.0f);
-const __m256 positiveEpsilonM256 = _mm256_set1_ps(EPSILON);
-const __m256 negativeEpsilonM256 = _mm256_set1_ps(-EPSILON);
-const __m256 zeroM256 = _mm256_set1_ps(0.0f);
-const __m256 fullMaskM256 = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    while (stackSize > 0) {
+        const StackEntry entry = stack[--stackSize];
 
-bool intersectPackedTriangles(const PackedRay& pRay, const PackedTriangles& packedTris, IntersectionData& idata, __m256 backfaceMask)
-{
-    __m256 h[3];
-    avx_multi_cross(h, pRay.dir, packedTris.e2);
-    __m256 d = avx_multi_dot(packedTris.e1, h);
-    __m256 f = _mm256_div_ps(oneM256, d);
-    __m256 s[3];
-    avx_multi_sub(s, pRay.origin, packedTris.v0);
-    __m256 u = _mm256_mul_ps(f, avx_multi_dot(s, h));
-    __m256 q[3];
-    avx_multi_cross(q, s, packedTris.e1);
-    __m256 v = _mm256_mul_ps(f, avx_multi_dot(pRay.dir, q));
-    __m256 t = _mm256_mul_ps(f, avx_multi_dot(packedTris.e2, q));
+        // A closer hit may have been found since the node was pushed
+        if (entry.tNear > idata.t) {
+            continue;
+        }
 
-    // Failure conditions
-    __m256 failed = _mm256_and_ps(
-        _mm256_or_ps(_mm256_cmp_ps(d, negativeEpsilonM256, _CMP_GT_OQ), backfaceMask),
-        _mm256_cmp_ps(d, positiveEpsilonM256, _CMP_LT_OQ)
-    );
-    //__m256 failed = _mm256_cmp_ps(d, positiveEpsilonM256, _CMP_LT_OQ);
-
-    failed = _mm256_or_ps(failed, _mm256_cmp_ps(u, zeroM256, _CMP_LT_OQ));
-    failed = _mm256_or_ps(failed, _mm256_cmp_ps(v, zeroM256, _CMP_LT_OQ));
-    failed = _mm256_or_ps(failed, _mm256_cmp_ps(_mm256_add_ps(u, v), oneM256, _CMP_GT_OQ));
-    failed = _mm256_or_ps(failed, _mm256_cmp_ps(t, zeroM256, _CMP_LT_OQ));
-    failed = _mm256_or_ps(failed, _mm256_cmp_ps(t, pRay.length, _CMP_GT_OQ));
-
-    __m256 tResults = _mm256_blendv_ps(t, minusOneM256, failed);
-
-    int mask = _mm256_movemask_ps(tResults);
-    if (mask != 0xFF)
-    {
-        // There is at least one intersection
-        int idx = -1;
-
-        real_t* ptr = (real_t*)&tResults;
-        for (int i = 0; i < 8; ++i)
-        {
-            if (ptr[i] > 0.0f && ptr[i] < idata.t)
-            {
-                idata.t = ptr[i];
-                idx = i;
+        const BVHNode& node = bvh[entry.nodeIndex];
+        if (node.isLeaf()) {
+            if constexpr (isAnyHitQuery(query)) {
+                if (occludedBVHTriangles<hitsBackFaces(query)>(ray, kernels, node, max_t)) {
+                    return true;
+                }
             }
+            else {
+                intersectBVHTriangles<hitsBackFaces(query)>(ray, kernels, node, idata);
+            }
+            continue;
         }
 
-        if (idx != -1) {
-            idata.u = ((real_t*)&u)[idx];
-            idata.v = ((real_t*)&v)[idx];
-            idata.w = 1.f - (idata.u + idata.v);
-            Vector o{ ((real_t*)&pRay.origin[0])[idx], ((real_t*)&pRay.origin[1])[idx], ((real_t*)&pRay.origin[2])[idx] };
-            Vector d{ ((real_t*)&pRay.dir[0])[idx], ((real_t*)&pRay.dir[1])[idx], ((real_t*)&pRay.dir[2])[idx] };
-            idata.ip = o + d * idata.t;
-            Vector e1{ ((real_t*)&packedTris.e1[0])[idx], ((real_t*)&packedTris.e1[1])[idx], ((real_t*)&packedTris.e1[2])[idx] };
-            Vector e2{ ((real_t*)&packedTris.e2[0])[idx], ((real_t*)&packedTris.e2[1])[idx], ((real_t*)&packedTris.e2[2])[idx] };
-            idata.normal = normalized(cross(e1, e2));
-            idata.triangle_index = idx;
-            return true;
+        const int left = node.leftFirst;
+        const int right = node.leftFirst + 1;
+        real_t tNearLeft, tNearRight;
+        const bool hitLeft = kernels.intersectAABB(ray, bvh[left].boundsMin, bvh[left].boundsMax, tNearLeft) && tNearLeft <= idata.t;
+        const bool hitRight = kernels.intersectAABB(ray, bvh[right].boundsMin, bvh[right].boundsMax, tNearRight) && tNearRight <= idata.t;
+
+        // Push the farther child first, so the nearer one is visited next
+        if (hitLeft && hitRight) {
+            if (tNearLeft <= tNearRight) {
+                stack[stackSize++] = { right, tNearRight };
+                stack[stackSize++] = { left, tNearLeft };
+            }
+            else {
+                stack[stackSize++] = { left, tNearLeft };
+                stack[stackSize++] = { right, tNearRight };
+            }
+        }
+        else if (hitLeft) {
+            stack[stackSize++] = { left, tNearLeft };
+        }
+        else if (hitRight) {
+            stack[stackSize++] = { right, tNearRight };
         }
     }
 
-    return false;
+    return idata.t < max_t;
 }
 
-PackedTriangles Object::makePackedTriangles(size_t start, size_t end) const
-{
-    PackedTriangles pTri{};
-    for (size_t i = 0; i < 3; ++i) {
-        __m256 v2 = _mm256_set_ps(
-            vertices[triangles[std::min(start + 7, end)].v2].v[i],
-            vertices[triangles[std::min(start + 6, end)].v2].v[i],
-            vertices[triangles[std::min(start + 5, end)].v2].v[i],
-            vertices[triangles[std::min(start + 4, end)].v2].v[i],
-            vertices[triangles[std::min(start + 3, end)].v2].v[i],
-            vertices[triangles[std::min(start + 2, end)].v2].v[i],
-            vertices[triangles[std::min(start + 1, end)].v2].v[i],
-            vertices[triangles[std::min(start + 0, end)].v2].v[i]
-        );
-        __m256 v3 = _mm256_set_ps(
-            vertices[triangles[std::min(start + 7, end)].v3].v[i],
-            vertices[triangles[std::min(start + 6, end)].v3].v[i],
-            vertices[triangles[std::min(start + 5, end)].v3].v[i],
-            vertices[triangles[std::min(start + 4, end)].v3].v[i],
-            vertices[triangles[std::min(start + 3, end)].v3].v[i],
-            vertices[triangles[std::min(start + 2, end)].v3].v[i],
-            vertices[triangles[std::min(start + 1, end)].v3].v[i],
-            vertices[triangles[std::min(start + 0, end)].v3].v[i]
-        );
-        pTri.v0[i] = _mm256_set_ps(
-            vertices[triangles[std::min(start + 7, end)].v1].v[i],
-            vertices[triangles[std::min(start + 6, end)].v1].v[i],
-            vertices[triangles[std::min(start + 5, end)].v1].v[i],
-            vertices[triangles[std::min(start + 4, end)].v1].v[i],
-            vertices[triangles[std::min(start + 3, end)].v1].v[i],
-            vertices[triangles[std::min(start + 2, end)].v1].v[i],
-            vertices[triangles[std::min(start + 1, end)].v1].v[i],
-            vertices[triangles[std::min(start + 0, end)].v1].v[i]
-        );
-        pTri.e1[i] = _mm256_sub_ps(v2, pTri.v0[i]);
-        pTri.e2[i] = _mm256_sub_ps(v3, pTri.v0[i]);
-    }
-    return pTri;
-}
-
-#endif
-
-#if WITH_SIMD
-
-const __m128 oneM128 = _mm_set1_ps(1.f);
-bool AABBIntersection(const Ray& ray, AABB aabb)
-{
-    // Precompute inverse direction
-    __m128 invDir = _mm_div_ps(oneM128, ray.dir.simd);
-
-    // Calculate the intersections with the AABB
-    __m128 t0 = _mm_mul_ps(_mm_sub_ps(aabb.min.simd, ray.origin.simd), invDir);
-    __m128 t1 = _mm_mul_ps(_mm_sub_ps(aabb.max.simd, ray.origin.simd), invDir);
-
-    // Calculate the min and max intersections for each axis
-    Vector tMin;
-    tMin.simd = _mm_min_ps(t0, t1);
-    __m128 tMax = _mm_max_ps(t0, t1);
-
-    // Bound checks
-    __m128 xMin = _mm_set1_ps(tMin.x);
-    __m128 yMin = _mm_set1_ps(tMin.y);
-    __m128 zMin = _mm_set1_ps(tMin.z);
-    __m128 maskX = _mm_cmpge_ps(xMin, tMax);
-    __m128 maskY = _mm_cmpge_ps(yMin, tMax);
-    __m128 maskZ = _mm_cmpge_ps(zMin, tMax);
-
-    // Only consider the first three bits
-    int maskBits = _mm_movemask_ps(maskX) | _mm_movemask_ps(maskY) | _mm_movemask_ps(maskZ);
-
-    // Return true if any intersection is found. Only consider the first 3 bits
-    return (maskBits & 0b111) == 0;
-}
-
-#else
-
-bool AABBIntersection(const Ray& ray, const AABB& aabb)
-{
-    // X planes
-    const real_t invDirX = 1 / ray.dir.x;
-    real_t tMinX = (aabb.min.x - ray.origin.x) * invDirX;
-    if (tMinX > 0) {
-        Vector pMinX = ray.origin + tMinX * ray.dir;
-        if (pMinX.y >= aabb.min.y && pMinX.y <= aabb.max.y &&
-            pMinX.z >= aabb.min.z && pMinX.z <= aabb.max.z) {
-            return true;
-        }
-    }
+static int intersectWideNode(const SIMDKernels& kernels, const KernelRay& ray, const WideBVHNode& node, float maxT, float tNear[8])
+{
+    return kernels.intersectWideNode(ray, node, maxT, tNear);
+}
 
-    real_t tMaxX = (aabb.max.x - ray.origin.x) * invDirX;
-    if (tMaxX > 0) {
-        Vector pMaxX = ray.origin + tMaxX * ray.dir;
-        if (pMaxX.y >= aabb.min.y && pMaxX.y <= aabb.max.y &&
-            pMaxX.z >= aabb.min.z && pMaxX.z <= aabb.max.z) {
-            return true;
-        }
-    }
+static int intersectWideNode(const SIMDKernels& kernels, const KernelRay& ray, const CompressedWideBVHNode& node, float maxT, float tNear[8])
+{
+    return kernels.intersectCompressedWideNode(ray, node, maxT, tNear);
+}
 
-    // Y planes
-    const real_t invDirY = 1 / ray.dir.y;
-    real_t tMinY = (aabb.min.y - ray.origin.y) * invDirY;
-    if (tMinY > 0) {
-        Vector pMinY = ray.origin + tMinY * ray.dir;
-        if (pMinY.x >= aabb.min.x && pMinY.x <= aabb.max.x &&
-            pMinY.z >= aabb.min.z && pMinY.z <= aabb.max.z) {
-            return true;
+template <RayQuery query, typename WideNode>
+bool Object::wideBVHIntersection(const std::vector<WideNode>& nodes, const KernelRay& ray, const SIMDKernels& kernels, IntersectionData& idata, real_t max_t) const
+{
+    struct StackEntry {
+        int child;
+        real_t tNear;
+    };
+    // Every level of the tree pushes at most 7 entries that are not popped right away
+    StackEntry stack[BVH_STACK_SIZE * 8];
+    int stackSize = 0;
+    stack[stackSize++] = { 0, 0 };
+
+    while (stackSize > 0) {
+        const StackEntry entry = stack[--stackSize];
+
+        // A closer hit may have been found since the node was pushed
+        if (entry.tNear > idata.t) {
+            continue;
         }
-    }
 
-    real_t tMaxY = (aabb.max.y - ray.origin.y) * invDirY;
-    if (tMaxY > 0) {
-        Vector pMaxY = ray.origin + tMaxY * ray.dir;
-        if (pMaxY.x >= aabb.min.x && pMaxY.x <= aabb.max.x &&
-            pMaxY.z >= aabb.min.z && pMaxY.z <= aabb.max.z) {
-            return true;
+        if (entry.child < 0) {
+            if constexpr (isAnyHitQuery(query)) {
+                if (occludedBVHTriangles<hitsBackFaces(query)>(ray, kernels, bvh[~entry.child], max_t)) {
+                    return true;
+                }
+            }
+            else {
+                intersectBVHTriangles<hitsBackFaces(query)>(ray, kernels, bvh[~entry.child], idata);
+            }
+            continue;
         }
-    }
 
-    // Z planes
-    const real_t invDirZ = 1 / ray.dir.z;
-    real_t tMinZ = (aabb.min.z - ray.origin.z) * invDirZ;
-    if (tMinZ > 0) {
-        Vector pMinZ = ray.origin + tMinZ * ray.dir;
-        if (pMinZ.x >= aabb.min.x && pMinZ.x <= aabb.max.x &&
-            pMinZ.y >= aabb.min.y && pMinZ.y <= aabb.max.y) {
-            return true;
+        const WideNode& node = nodes[entry.child];
+        real_t tNear[8];
+        const int mask = intersectWideNode(kernels, ray, node, idata.t, tNear);
+        if (mask == 0) {
+            continue;
         }
-    }
 
-    real_t tMaxZ = (aabb.max.z - ray.origin.z) * invDirZ;
-    if (tMaxZ > 0) {
-        Vector pMaxZ = ray.origin + tMaxZ * ray.dir;
-        if (pMaxZ.x >= aabb.min.x && pMaxZ.x <= aabb.max.x &&
-            pMaxZ.y >= aabb.min.y && pMaxZ.y <= aabb.max.y) {
-            return true;
+        // Sort the hit children by distance, farthest first, and push them,
+        // so the nearest one is visited next
+        StackEntry hits[8];
+        int hitCount = 0;
+        for (int i = 0; i < 8; ++i) {
+            if (!(mask & (1 << i))) {
+                continue;
+            }
+            StackEntry hit{ node.child[i], tNear[i] };
+            int j = hitCount++;
+            for (; j > 0 && hits[j - 1].tNear < hit.tNear; --j) {
+                hits[j] = hits[j - 1];
+            }
+            hits[j] = hit;
+        }
+        for (int i = 0; i < hitCount; ++i) {
+            stack[stackSize++] = hits[i];
         }
     }
 
-    return false;
+    return idata.t < max_t;
 }
 
-#endif
-
-bool Object::intersectBVHTriangles(const Ray& ray, const BVHNode& node, IntersectionData& idata, bool backface, bool any, real_t max_t) const
+bool Object::intersect(Ray ray, IntersectionData& idata, bool backface, bool any, real_t max_t) const
 {
-    IntersectionData temp_idata{};
-    temp_idata.t = 1e30f;
-#if (WITH_SIMD == 2)
-    PackedRay pRay{};
-    pRay.origin[0] = _mm256_set1_ps(ray.origin.x);
-    pRay.origin[1] = _mm256_set1_ps(ray.origin.y);
-    pRay.origin[2] = _mm256_set1_ps(ray.origin.z);
-    pRay.dir[0] = _mm256_set1_ps(ray.dir.x);
-    pRay.dir[1] = _mm256_set1_ps(ray.dir.y);
-    pRay.dir[2] = _mm256_set1_ps(ray.dir.z);
-    pRay.length = _mm256_set1_ps(max_t);
+    return intersect(prepareRay(ray), idata, backface, any, max_t);
+}
 
-    __m256 backfaceMask = backface ? zeroM256 : fullMaskM256;
-    bool hit = intersectPackedTriangles(pRay, node.pack, temp_idata, backfaceMask);
-    if (hit && temp_idata.t < idata.t) {
-        idata = temp_idata;
-        idata.object = this;
-        idata.triangle_index = node.startTriangleIndex + idata.triangle_index;
+bool Object::intersect(const KernelRay& ray, IntersectionData& idata, bool backface, bool any, real_t max_t) const
+{
+    switch (rayQuery(backface, any)) {
+    case RayQuery::Closest: return intersect<RayQuery::Closest>(ray, idata, max_t);
+    case RayQuery::ClosestFrontFace: return intersect<RayQuery::ClosestFrontFace>(ray, idata, max_t);
+    case RayQuery::Any: return intersect<RayQuery::Any>(ray, idata, max_t);
+    case RayQuery::AnyFrontFace: return intersect<RayQuery::AnyFrontFace>(ray, idata, max_t);
     }
-    return hit;
-#else
-    for (int i = node.startTriangleIndex; i <= node.endTriangleIndex; i++) {
-        const bool hit = triangleIntersection(
-            ray,
-            vertices,
-            triangles[i].v1,
-            triangles[i].v2,
-            triangles[i].v3,
-            temp_idata,
-            backface,
-            max_t
-        );
-        if (hit && temp_idata.t < idata.t) {
-            idata = temp_idata;
-            idata.object = this;
-            idata.triangle_index = int(i);
-            if (any) return true;
-        }
-    }
-#endif
-    return idata.t < max_t;
+    return false;
 }
 
-bool Object::BVHIntersection(const Ray& ray, const BVHNode& node, IntersectionData& idata, bool backface, bool any, real_t max_t) const
+template <RayQuery query>
+bool Object::intersect(const KernelRay& ray, IntersectionData& idata, real_t max_t) const
 {
-    if (hasAABB && !AABBIntersection(ray, node.bounds)) {
+    idata.t = max_t;
+    if (bvh.empty()) {
         return false;
     }
 
-    if (any && idata.t < max_t) {
-        return true;
+    const SIMDKernels& kernels = getSIMDKernels();
+    if (!compressedBVH.empty()) {
+        return wideBVHIntersection<query>(compressedBVH, ray, kernels, idata, max_t);
     }
-
-    if (node.left == -1 && node.right == -1) {
-        return intersectBVHTriangles(ray, node, idata, backface, any, max_t);
+    if (!wideBVH.empty()) {
+        return wideBVHIntersection<query>(wideBVH, ray, kernels, idata, max_t);
     }
+    return BVHIntersection<query>(ray, kernels, idata, max_t);
+}
 
-    bool hitLeft = BVHIntersection(ray, bvh[node.left], idata, backface, any, max_t);
-    bool hitRight = BVHIntersection(ray, bvh[node.right], idata, backface, any, max_t);
+// Scene::intersect calls them directly
+template bool Object::intersect<RayQuery::Closest>(const KernelRay& ray, IntersectionData& idata, real_t max_t) const;
+template bool Object::intersect<RayQuery::ClosestFrontFace>(const KernelRay& ray, IntersectionData& idata, real_t max_t) const;
+template bool Object::intersect<RayQuery::Any>(const KernelRay& ray, IntersectionData& idata, real_t max_t) const;
+template bool Object::intersect<RayQuery::AnyFrontFace>(const KernelRay& ray, IntersectionData& idata, real_t max_t) const;
 
-    return hitLeft || hitRight;
+int Object::intersectPacket(const Ray rays[RAY_PACKET_SIZE], IntersectionData idata[RAY_PACKET_SIZE], int activeMask, const real_t maxT[RAY_PACKET_SIZE], bool backface) const
+{
+    return intersectPacket(prepareRayPacket(rays), idata, activeMask, maxT, backface);
 }
 
-bool Object::intersect(Ray ray, IntersectionData& idata, bool backface, bool any, real_t max_t) const
+int Object::intersectPacket(const KernelRayPacket& packet, IntersectionData idata[RAY_PACKET_SIZE], int activeMask, const real_t maxT[RAY_PACKET_SIZE], bool backface) const
 {
-    idata.t = max_t;
-    return BVHIntersection(ray, bvh[0], idata, backface, any, max_t);
+    for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+        idata[i].t = maxT[i];
+    }
+    if (bvh.empty()) {
+        return 0;
+    }
+
+    KernelPacketHit hits;
+    int hitBlock[RAY_PACKET_SIZE];
+    for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+        hits.t[i] = maxT[i];
+        hits.u[i] = hits.v[i] = 0;
+        hits.lane[i] = 0;
+        hitBlock[i] = -1;
+    }
+
+    // Rays leave a node's mask when they miss it, the packet is done with a node when its mask is empty
+    struct StackEntry {
+        int nodeIndex;
+        int mask;
+    };
+    StackEntry stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+
+    const SIMDKernels& kernels = getSIMDKernels();
+    const auto intersectPacketLeafPack = buildSettings.watertight ? kernels.intersectPacketLeafPackWatertight : kernels.intersectPacketLeafPack;
+    const int blocksPerPack = leafPackBlocks();
+    float tNear[RAY_PACKET_SIZE];
+    const int rootMask = kernels.intersectPacketAABB(packet, bvh[0].boundsMin, bvh[0].boundsMax, hits.t, activeMask, tNear);
+    if (rootMask == 0) {
+        return 0;
+    }
+    stack[stackSize++] = { 0, rootMask };
+
+    while (stackSize > 0) {
+        const StackEntry entry = stack[--stackSize];
+        const BVHNode& node = bvh[entry.nodeIndex];
+
+        if (node.isLeaf()) {
+            for (int first = 0, block = node.leftFirst; first < node.count; first += packWidth, block += blocksPerPack) {
+                const int updated = intersectPacketLeafPack(packet, leafPacks[block].data, std::min(packWidth, node.count - first), backface, entry.mask, hits);
+                for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+                    if (updated & (1 << i)) {
+                        hitBlock[i] = block;
+                    }
+                }
+            }
+            continue;
+        }
+
+        // The boxes are tested against the closest hits found so far
+        const int left = node.leftFirst;
+        const int right = node.leftFirst + 1;
+        float tNearLeft[RAY_PACKET_SIZE], tNearRight[RAY_PACKET_SIZE];
+        const int maskLeft = kernels.intersectPacketAABB(packet, bvh[left].boundsMin, bvh[left].boundsMax, hits.t, entry.mask, tNearLeft);
+        const int maskRight = kernels.intersectPacketAABB(packet, bvh[right].boundsMin, bvh[right].boundsMax, hits.t, entry.mask, tNearRight);
+
+        // Visit first the child that the first ray entering both enters first. The rays are coherent,
+        // so it is the nearer one for most of the packet
+        bool leftFirst = true;
+        if (maskLeft & maskRight) {
+            int lane = 0;
+            while (!(maskLeft & maskRight & (1 << lane))) {
+                ++lane;
+            }
+            leftFirst = tNearLeft[lane] <= tNearRight[lane];
+        }
+        const StackEntry nearChild = leftFirst ? StackEntry{ left, maskLeft } : StackEntry{ right, maskRight };
+        const StackEntry farChild = leftFirst ? StackEntry{ right, maskRight } : StackEntry{ left, maskLeft };
+        if (farChild.mask) {
+            stack[stackSize++] = farChild;
+        }
+        if (nearChild.mask) {
+            stack[stackSize++] = nearChild;
+        }
+    }
+
+    int hitMask = 0;
+    for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+        if (hitBlock[i] >= 0) {
+            setLeafPackHit(hitBlock[i], { hits.t[i], hits.u[i], hits.v[i], hits.lane[i] }, idata[i]);
+            hitMask |= 1 << i;
+        }
+    }
+    return hitMask;
 }
 
 bool solveQuadratic(const real_t& a, const real_t& b, const real_t& c, real_t& x0, real_t& x1)
@@ -0,0 +1,94 @@
+#include "simd_kernels.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+// Registers of a cpuid leaf: eax, ebx, ecx, edx
+static void cpuid(int leaf, int subleaf, uint32_t registers[4])
+{
+#ifdef _MSC_VER
+    int result[4];
+    __cpuidex(result, leaf, subleaf);
+    std::memcpy(registers, result, sizeof(result));
+#else
+    if (!__get_cpuid_count(leaf, subleaf, &registers[0], &registers[1], &registers[2], &registers[3])) {
+        std::memset(registers, 0, 4 * sizeof(uint32_t));
+    }
+#endif
+}
+
+// Register state the OS saves on context switches, the wide registers are usable only if it saves them
+static uint64_t xgetbv()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (uint64_t(edx) << 32) | eax;
+#endif
+}
+
+static bool hasBits(uint32_t value, uint32_t bits)
+{
+    return (value & bits) == bits;
+}
+
+// Newest first
+static const SIMDKernels* const ALL_KERNELS[] = { &avx512Kernels, &avx2Kernels, &sse41Kernels, &scalarKernels };
+
+static const SIMDKernels& detectSIMDKernels()
+{
+    uint32_t leaf0[4];
+    cpuid(0, 0, leaf0);
+    const uint32_t maxLeaf = leaf0[0];
+
+    uint32_t leaf1[4] = {};
+    uint32_t leaf7[4] = {};
+    if (maxLeaf >= 1) cpuid(1, 0, leaf1);
+    if (maxLeaf >= 7) cpuid(7, 0, leaf7);
+
+    const bool sse41 = hasBits(leaf1[2], 1u << 19);
+    const bool osxsave = hasBits(leaf1[2], 1u << 27);
+    const uint64_t xcr0 = osxsave ? xgetbv() : 0;
+
+    // AVX and FMA in leaf 1, AVX2 in leaf 7. The OS must save the XMM and YMM registers
+    const bool avx2 = sse41 && osxsave &&
+        hasBits(leaf1[2], (1u << 28) | (1u << 12)) &&
+        hasBits(leaf7[1], 1u << 5) &&
+        hasBits(uint32_t(xcr0), 0x6);
+
+    // AVX-512F and VL. The OS must also save the mask registers and the upper ZMM registers
+    const bool avx512 = avx2 &&
+        hasBits(leaf7[1], (1u << 16) | (1u << 31)) &&
+        hasBits(uint32_t(xcr0), 0xE6);
+
+    const SIMDKernels* best = avx512 ? &avx512Kernels : avx2 ? &avx2Kernels : sse41 ? &sse41Kernels : &scalarKernels;
+
+    // The override can only pick a set that is older than the supported one
+    const char* requested = std::getenv("CHAOS_SIMD_KERNELS");
+    if (requested) {
+        const char* names[] = { "avx512", "avx2", "sse4.1", "scalar" };
+        bool supported = false;
+        for (int i = 0; i < 4; ++i) {
+            supported = supported || ALL_KERNELS[i] == best;
+            if (supported && std::strcmp(requested, names[i]) == 0) {
+                return *ALL_KERNELS[i];
+            }
+        }
+    }
+    return *best;
+}
+
+const SIMDKernels& getSIMDKernels()
+{
+    static const SIMDKernels& kernels = detectSIMDKernels();
+    return kernels;
+}